@@ -0,0 +1,117 @@
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "StellarCartography/StarMap.h"
+
+/*
+ * Compares the spatial backends on fixed-radius searches. Stars are spread
+ * uniformly at a density of one per unit volume, so a threshold t gives each
+ * star about 4/3 pi t^3 neighbors regardless of the size of the map.
+ *
+ * Usage: spatialbench [kd|grid|both] [stars...]
+ */
+
+using namespace StellarCartography;
+
+namespace
+{
+
+typedef std::chrono::steady_clock bench_clock;
+
+double elapsed(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        bench_clock::now() - start).count();
+}
+
+StarMap uniformGalaxy(std::size_t n)
+{
+    std::mt19937 rng(n);
+    std::uniform_real_distribution<double> coord(0.0, std::cbrt(n));
+    std::vector<Star> stars;
+    stars.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i),
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    return StarMap(stars.begin(), stars.end());
+}
+
+void run(StarMap& g, SpatialBackend backend, const char *name, double t)
+{
+    const int repeats = 3;
+    const std::size_t queries = 1000;
+
+    g.setSpatialBackend(backend);
+
+    double build = std::numeric_limits<double>::max();
+    std::size_t edges = 0;
+    for (int i = 0; i < repeats; ++i)
+    {
+        g.clearCache();
+        auto start = bench_clock::now();
+        edges = num_edges(*g.byDistance(t));
+        build = std::min(build, elapsed(start));
+    }
+
+    /* The index leaves its grid behind, so these queries can reuse it. */
+    auto start = bench_clock::now();
+    std::size_t found = 0;
+    for (std::size_t i = 0; i < queries; ++i)
+    {
+        found += g.neighbors(g[i * g.size() / queries], t).size();
+    }
+    double query = elapsed(start) * 1000.0 / queries;
+
+    std::cout
+        << std::setw(10) << g.size()
+        << std::setw(8) << t
+        << std::setw(10) << 2.0 * edges / g.size()
+        << std::setw(8) << name
+        << std::setw(12) << build
+        << std::setw(12) << query
+        << std::endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    std::string which = (argc > 1) ? argv[1] : "both";
+    std::vector<std::size_t> sizes;
+    for (int i = 2; i < argc; ++i)
+    {
+        sizes.push_back(boost::lexical_cast<std::size_t>(argv[i]));
+    }
+    if (sizes.empty()) sizes = { 10000, 100000, 1000000 };
+
+    std::cout
+        << std::setw(10) << "stars"
+        << std::setw(8) << "range"
+        << std::setw(10) << "degree"
+        << std::setw(8) << "backend"
+        << std::setw(12) << "build ms"
+        << std::setw(12) << "query us"
+        << std::endl;
+
+    for (auto n : sizes)
+    {
+        auto g = uniformGalaxy(n);
+        for (double t : { 0.5, 1.0, 2.0, 4.0 })
+        {
+            if (which != "grid") run(g, SpatialBackend::KdTree, "kd", t);
+            if (which != "kd") run(g, SpatialBackend::Grid, "grid", t);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,362 @@
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+#include "StellarCartography/Algorithms.h"
+#include "StellarCartography/Parallel.h"
+#include "StellarCartography/StarMap.h"
+
+/*
+ * Times the StarMap operations on synthetic galaxies of 10^3 up to 10^7
+ * stars, and writes the wall time and peak RSS of each as JSON so runs can
+ * be compared between builds. Galaxies come from fixed seeds, so every run
+ * times the same work, and each result has a checksum of what the
+ * operation returned, which changes if its answers do. Each shape averages
+ * one star per unit volume:
+ *
+ *   uniform    stars spread evenly through a cube.
+ *   clustered  dense gaussian clusters of about a thousand stars each.
+ *   disk       a flat disk, thin enough that most stars see few others.
+ *
+ * Usage: StellarCartographyBench [--max-stars N] [--shape S]... [--out FILE]
+ */
+
+using namespace StellarCartography;
+
+namespace
+{
+
+typedef std::chrono::steady_clock bench_clock;
+
+/* Jump range used throughout, giving about seven neighbors a star. */
+const double range = 1.2;
+
+/* Queries of each kind per galaxy, where one query is cheap. */
+const std::size_t queries = 1000;
+
+const double pi = std::acos(-1.0);
+
+double elapsed(bench_clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(
+        bench_clock::now() - start).count();
+}
+
+/*
+ * Reset the kernel's high-water mark for this process, so the next peak
+ * covers a single operation. Before Linux 4.0 this does nothing, and peaks
+ * are for the run so far.
+ */
+void resetPeakRss()
+{
+    std::ofstream("/proc/self/clear_refs") << "5";
+}
+
+std::size_t peakRss()
+{
+    std::ifstream is("/proc/self/status");
+    std::string key;
+    while (is >> key)
+    {
+        std::size_t kb;
+        if (key == "VmHWM:" && is >> kb) return kb * 1024;
+        is.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+
+    struct rusage usage;
+    ::getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss * 1024;
+}
+
+std::vector<Star> makeGalaxy(const std::string& shape, std::size_t n)
+{
+    std::mt19937 rng(n);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> normal(0.0, 1.0);
+
+    std::vector<Coordinate> centers;
+    if (shape == "clustered")
+    {
+        /* Clusters of a thousand stars with sigma 2 are eight times denser. */
+        double side = std::cbrt(n);
+        for (std::size_t i = 0; i < std::max<std::size_t>(n / 1000, 1); ++i)
+        {
+            centers.push_back(
+                { side * unit(rng), side * unit(rng), side * unit(rng) });
+        }
+    }
+
+    std::vector<Star> stars;
+    stars.reserve(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        Coordinate c;
+        if (shape == "uniform")
+        {
+            double side = std::cbrt(n);
+            c = { side * unit(rng), side * unit(rng), side * unit(rng) };
+        }
+        else if (shape == "clustered")
+        {
+            auto& o = centers[i % centers.size()];
+            c = {
+                o.x() + 2.0 * normal(rng),
+                o.y() + 2.0 * normal(rng),
+                o.z() + 2.0 * normal(rng)
+            };
+        }
+        else if (shape == "disk")
+        {
+            /* Most stars lie within a unit of the plane. */
+            double radius = std::sqrt(n / (2.5 * pi));
+            double r = radius * std::sqrt(unit(rng));
+            double a = 2.0 * pi * unit(rng);
+            c = { r * std::cos(a), r * std::sin(a), normal(rng) };
+        }
+        else
+        {
+            throw std::invalid_argument("Unknown shape: " + shape);
+        }
+        stars.emplace_back("S" + std::to_string(i), c);
+    }
+    return stars;
+}
+
+class Report
+{
+public:
+    explicit Report(std::ostream& os) : os_(os), first_(true)
+    {
+        os_ << "{\n"
+            << "  \"format\": 1,\n"
+            << "  \"threads\": " << threadCount() << ",\n"
+            << "  \"range\": " << range << ",\n"
+            << "  \"results\": [";
+    }
+
+    ~Report()
+    {
+        os_ << "\n  ]\n}" << std::endl;
+    }
+
+    /* Time f, which runs count operations and returns a checksum. */
+    void measure(
+        const std::string& shape,
+        std::size_t stars,
+        const char *operation,
+        std::size_t count,
+        const std::function<double ()>& f)
+    {
+        resetPeakRss();
+        auto start = bench_clock::now();
+        double checksum = f();
+        double ms = elapsed(start);
+        auto peak = peakRss();
+        auto per_op = ms * 1000.0 / std::max<std::size_t>(count, 1);
+
+        os_ << (first_ ? "\n" : ",\n")
+            << "    { \"shape\": \"" << shape << "\""
+            << ", \"stars\": " << stars
+            << ", \"operation\": \"" << operation << "\""
+            << ", \"count\": " << count
+            << ", \"wall_ms\": " << ms
+            << ", \"per_op_us\": " << per_op
+            << ", \"peak_rss_bytes\": " << peak
+            << ", \"checksum\": ";
+        if (std::isfinite(checksum))
+            os_ << std::setprecision(17) << checksum << std::setprecision(6);
+        else
+            os_ << "null";
+        os_ << " }";
+        first_ = false;
+
+        std::cerr << shape << " " << stars << " " << operation << ": "
+                  << ms << " ms" << std::endl;
+    }
+
+private:
+    std::ostream& os_;
+    bool first_;
+};
+
+/* The ith of count stars spread evenly through the map. */
+const Star& pick(const StarMap& g, std::size_t i, std::size_t count)
+{
+    return g[(i * 7919) % count * g.size() / count];
+}
+
+void run(Report& report, const std::string& shape, std::size_t n)
+{
+    auto stars = makeGalaxy(shape, n);
+    StarMap g;
+    auto q = std::min(queries, n);
+    auto measure = [&](
+        const char *operation, 
+        std::size_t count,
+        const std::function<double ()>& f)
+    {
+        report.measure(shape, n, operation, count, f);
+    };
+
+    measure("construct", n, [&]
+    {
+        g = StarMap(stars.begin(), stars.end());
+        return double(g.size());
+    });
+
+    /* Keep the input out of the later operations' peak RSS. */
+    std::vector<Star>().swap(stars);
+
+    measure("centerOfMass", 1, [&] { return g.centerOfMass().x(); });
+    measure("extent", 1, [&] { return g.extent(); });
+
+    measure("byDistance", 1, [&]
+    {
+        g.clearCache();
+        return double(num_edges(*g.byDistance(range)));
+    });
+
+    measure("neighbors", q, [&]
+    {
+        double sum = 0.0;
+        for (std::size_t i = 0; i < q; ++i)
+            sum += g.neighbors(pick(g, i, q), range).size();
+        return sum;
+    });
+
+    measure("nearestNeighbor", q, [&]
+    {
+        double sum = 0.0;
+        for (std::size_t i = 0; i < q; ++i)
+        {
+            /* An isolated star's nearest neighbor is a nameless Star(). */
+            auto s = g.nearestNeighbor(pick(g, i, q), range);
+            if (!s.getName().empty()) sum += s.getCoords().x();
+        }
+        return sum;
+    });
+
+    /* These can cover the whole graph, so there are far fewer of them. */
+    auto paths = std::min<std::size_t>(10, n);
+    measure("path", paths, [&]
+    {
+        double sum = 0.0;
+        for (std::size_t i = 0; i < paths; ++i)
+        {
+            auto& from = pick(g, i, paths);
+            auto& to = pick(g, paths - i - 1, paths);
+            sum += g.path(from, to, range).size();
+        }
+        return sum;
+    });
+
+    auto searches = std::min<std::size_t>(3, n);
+    measure("reachable", searches, [&]
+    {
+        double sum = 0.0;
+        for (std::size_t i = 0; i < searches; ++i)
+            sum += g.reachable(pick(g, i, searches), range).size();
+        return sum;
+    });
+
+    measure("connectedComponents", 1, [&]
+    {
+        return double(g.connectedComponents(range).size());
+    });
+
+    /* Locate stars from their exact distances to four others. */
+    measure("trilaterate", q, [&]
+    {
+        double sum = 0.0;
+        std::mt19937 rng(n);
+        std::uniform_int_distribution<std::size_t> index(0, n - 1);
+        for (std::size_t i = 0; i < q; ++i)
+        {
+            auto p = pick(g, i, q).getCoords();
+            std::vector<std::pair<Coordinate, double>> samples;
+            for (int j = 0; j < 4; ++j)
+            {
+                auto c = g[index(rng)].getCoords();
+                samples.emplace_back(c, c.distance(p));
+            }
+            try
+            {
+                auto x = trilaterate(samples.begin(), samples.end()).x();
+                if (std::isfinite(x)) sum += x;
+            }
+            catch (const std::exception&)
+            {
+                /* Too close to degenerate. */
+            }
+        }
+        return sum;
+    });
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t max_stars = 10000000;
+    std::vector<std::string> shapes;
+    std::string out;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (i + 1 == argc)
+        {
+            std::cerr << "Missing value for " << arg << std::endl;
+            return 1;
+        }
+
+        if (arg == "--max-stars")
+            max_stars = boost::lexical_cast<std::size_t>(argv[++i]);
+        else if (arg == "--shape") shapes.push_back(argv[++i]);
+        else if (arg == "--out") out = argv[++i];
+        else
+        {
+            std::cerr << "Usage: StellarCartographyBench [--max-stars N] "
+                      << "[--shape uniform|clustered|disk]... [--out FILE]"
+                      << std::endl;
+            return 1;
+        }
+    }
+    if (shapes.empty()) shapes = { "uniform", "clustered", "disk" };
+    for (auto& shape : shapes)
+    {
+        if (shape != "uniform" && shape != "clustered" && shape != "disk")
+        {
+            std::cerr << "Unknown shape: " << shape << std::endl;
+            return 1;
+        }
+    }
+
+    std::ofstream file;
+    if (!out.empty())
+    {
+        file.open(out);
+        if (!file)
+        {
+            std::cerr << "Can't write " << out << std::endl;
+            return 1;
+        }
+    }
+
+    Report report(out.empty() ? std::cout : file);
+    for (std::size_t n = 1000; n <= max_stars; n *= 10)
+    {
+        for (auto& shape : shapes) run(report, shape, n);
+    }
+    return 0;
+}
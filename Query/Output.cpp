@@ -0,0 +1,241 @@
+#include "Output.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+
+/* Output is written out in blocks of about this size. */
+const std::size_t buffer_bytes = 1 << 20;
+
+/* The shortest of the usual precisions that reads back as the same double. */
+void formatExact(char *buf, std::size_t size, double d)
+{
+    std::snprintf(buf, size, "%.15g", d);
+    if (std::strtod(buf, nullptr) != d) std::snprintf(buf, size, "%.17g", d);
+}
+
+}
+
+Output::Output(std::ostream& os, Format format) : os_(os), format_(format)
+{
+    buf_.reserve(buffer_bytes + (buffer_bytes >> 4));
+}
+
+Output::~Output()
+{
+    flush();
+}
+
+void Output::record(
+    const std::string& text,
+    std::initializer_list<Field> fields)
+{
+    record(text, fields.begin(), fields.end());
+}
+
+void Output::record(const std::string& text, const std::vector<Field>& fields)
+{
+    record(text, fields.data(), fields.data() + fields.size());
+}
+
+void Output::record(
+    const std::string& text,
+    const Field *begin,
+    const Field *end)
+{
+    switch (format_)
+    {
+    case Format::Text:
+        for (std::size_t i = 0; i < text.size(); )
+        {
+            auto close = text.find('}', i);
+            if (text[i] != '{' || close == std::string::npos)
+            {
+                auto open = text.find('{', i + 1);
+                if (open == std::string::npos) open = text.size();
+                buf_.append(text, i, open - i);
+                i = open;
+                continue;
+            }
+
+            /* {name} or {name:.N} */
+            auto spec = text.substr(i + 1, close - i - 1);
+            int places = -1;
+            auto colon = spec.find(":.");
+            if (colon != std::string::npos)
+            {
+                places = std::atoi(spec.c_str() + colon + 2);
+                spec.resize(colon);
+            }
+
+            auto f = begin;
+            while (f != end && spec != f->name) ++f;
+            if (f == end)
+                throw std::logic_error("No field for {" + spec + "}");
+
+            writeText(f->value, places);
+            i = close + 1;
+        }
+        buf_ += '\n';
+        break;
+
+    case Format::JsonLines:
+        buf_ += '{';
+        for (auto f = begin; f != end; ++f)
+        {
+            if (f != begin) buf_ += ',';
+            writeJson(Value(f->name));
+            buf_ += ':';
+            writeJson(f->value);
+        }
+        buf_ += "}\n";
+        break;
+
+    case Format::Tsv:
+        for (auto f = begin; f != end; ++f)
+        {
+            if (f != begin) buf_ += '\t';
+            writeTsv(f->value);
+        }
+        buf_ += '\n';
+        break;
+    }
+    drain();
+}
+
+void Output::text(const std::string& line)
+{
+    if (format_ != Format::Text) return;
+
+    buf_ += line;
+    buf_ += '\n';
+    drain();
+}
+
+void Output::write(const std::string& s)
+{
+    buf_ += s;
+    drain();
+}
+
+void Output::flush()
+{
+    os_.write(buf_.data(), buf_.size());
+    os_.flush();
+    buf_.clear();
+}
+
+auto Output::parseFormat(const std::string& name) -> Format
+{
+    if (name == "text") return Format::Text;
+    if (name == "jsonl") return Format::JsonLines;
+    if (name == "tsv") return Format::Tsv;
+    throw std::invalid_argument("Unknown output format: " + name);
+}
+
+void Output::writeText(const Value& v, int places)
+{
+    char num[64];
+    switch (v.kind_)
+    {
+    case Value::String:
+        buf_.append(v.str_);
+        return;
+    case Value::Number:
+        if (places >= 0)
+            std::snprintf(num, sizeof(num), "%.*f", places, v.number_);
+        else
+            std::snprintf(num, sizeof(num), "%g", v.number_);
+        break;
+    case Value::Integer:
+        std::snprintf(num, sizeof(num), "%lld", v.integer_);
+        break;
+    }
+    buf_ += num;
+}
+
+void Output::writeJson(const Value& v)
+{
+    char num[64];
+    switch (v.kind_)
+    {
+    case Value::String:
+        buf_ += '"';
+        for (auto p = v.str_.begin(); p != v.str_.end(); ++p)
+        {
+            unsigned char c = *p;
+            switch (c)
+            {
+            case '"': buf_ += "\\\""; break;
+            case '\\': buf_ += "\\\\"; break;
+            case '\n': buf_ += "\\n"; break;
+            case '\r': buf_ += "\\r"; break;
+            case '\t': buf_ += "\\t"; break;
+            default:
+                if (c < 0x20)
+                {
+                    std::snprintf(num, sizeof(num), "\\u%04x", c);
+                    buf_ += num;
+                }
+                else buf_ += c;
+            }
+        }
+        buf_ += '"';
+        return;
+    case Value::Number:
+        /* JSON has no infinities or NaN. */
+        if (!std::isfinite(v.number_))
+        {
+            buf_ += "null";
+            return;
+        }
+        formatExact(num, sizeof(num), v.number_);
+        break;
+    case Value::Integer:
+        std::snprintf(num, sizeof(num), "%lld", v.integer_);
+        break;
+    }
+    buf_ += num;
+}
+
+void Output::writeTsv(const Value& v)
+{
+    char num[64];
+    switch (v.kind_)
+    {
+    case Value::String:
+        for (auto p = v.str_.begin(); p != v.str_.end(); ++p)
+        {
+            switch (*p)
+            {
+            case '\\': buf_ += "\\\\"; break;
+            case '\n': buf_ += "\\n"; break;
+            case '\r': buf_ += "\\r"; break;
+            case '\t': buf_ += "\\t"; break;
+            default: buf_ += *p;
+            }
+        }
+        return;
+    case Value::Number:
+        formatExact(num, sizeof(num), v.number_);
+        break;
+    case Value::Integer:
+        std::snprintf(num, sizeof(num), "%lld", v.integer_);
+        break;
+    }
+    buf_ += num;
+}
+
+/* Write out a full buffer, without flushing the stream. */
+void Output::drain()
+{
+    if (buf_.size() < buffer_bytes) return;
+
+    os_.write(buf_.data(), buf_.size());
+    buf_.clear();
+}
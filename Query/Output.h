@@ -0,0 +1,98 @@
+#ifndef SCQ_OUTPUT_H
+#define SCQ_OUTPUT_H
+
+#include <cstddef>
+#include <initializer_list>
+#include <ostream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/*
+ * Writes command results in one of several formats. A command writes each
+ * result as a record: a list of named fields, and a template that lays them
+ * out as text. In the template, {name} is replaced by the field's value and
+ * {name:.N} by a number with N decimal places; fields it doesn't mention
+ * only appear in the other formats. As JSON Lines a record is one object,
+ * and as TSV one line of its values in order.
+ *
+ * Output is kept in a large buffer, which is written out when it fills and
+ * flushed by flush(), so a command with many results costs one flush.
+ */
+class Output
+{
+public:
+    enum class Format
+    {
+        Text,
+        JsonLines,
+        Tsv
+    };
+
+    /*
+     * A field's value. Strings are copied, so a value can be made from a
+     * temporary, such as a getter's result, and kept in a list of fields.
+     */
+    class Value
+    {
+    public:
+        Value(std::string s) : kind_(String), str_(std::move(s)) { }
+        Value(const char *s) : kind_(String), str_(s) { }
+        Value(double d) : kind_(Number), number_(d) { }
+
+        template<class T, class = typename std::enable_if<
+            std::is_integral<T>::value>::type>
+        Value(T i) : kind_(Integer), integer_(static_cast<long long>(i)) { }
+
+    private:
+        friend class Output;
+        enum Kind { String, Number, Integer };
+
+        Kind kind_;
+        std::string str_;
+        double number_;
+        long long integer_;
+    };
+
+    struct Field
+    {
+        const char *name;
+        Value value;
+    };
+
+    Output(std::ostream& os, Format format);
+    ~Output();
+
+    Output(const Output&) = delete;
+    Output& operator=(const Output&) = delete;
+
+    Format format() const { return format_; }
+
+    void record(const std::string& text, std::initializer_list<Field> fields);
+    void record(const std::string& text, const std::vector<Field>& fields);
+
+    /* A line only written as text, such as a heading. */
+    void text(const std::string& line);
+
+    /* Output that's already formatted, written as it is in every format. */
+    void write(const std::string& s);
+
+    void flush();
+
+    /* Parse "text", "jsonl" or "tsv". */
+    static Format parseFormat(const std::string& name);
+
+private:
+    void record(const std::string& text, const Field *begin, const Field *end);
+    void writeText(const Value& v, int places);
+    void writeJson(const Value& v);
+    void writeTsv(const Value& v);
+    void drain();
+
+    std::ostream& os_;
+    Format format_;
+    std::string buf_;
+};
+
+#endif /* SCQ_OUTPUT_H */
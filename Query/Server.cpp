@@ -0,0 +1,332 @@
+#include "Server.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace
+{
+
+/* Queries a client may have waiting before it's made to wait in turn. */
+const std::size_t max_in_flight = 256;
+
+/* Longer lines than this aren't queries, so the client is dropped. */
+const std::size_t max_line = 1 << 20;
+
+std::runtime_error systemError(const std::string& what)
+{
+    std::ostringstream ss;
+    ss << what << ": " << std::strerror(errno);
+    return std::runtime_error(ss.str());
+}
+
+bool sendAll(int fd, const std::string& s)
+{
+    for (std::size_t sent = 0; sent < s.size(); )
+    {
+        auto n = ::send(fd, s.data() + sent, s.size() - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+}
+
+}
+
+struct Server::Response
+{
+    explicit Response(const std::string& q) : query(q), done(false), ok(true)
+    {
+    }
+
+    std::string query;
+    bool done;
+    bool ok;
+    std::string body;
+};
+
+/*
+ * A client, and its responses in the order its queries arrived. Finished
+ * responses are written as soon as everything before them has been.
+ */
+struct Server::Connection
+{
+    explicit Connection(int f) : fd(f), reading(true) { }
+    ~Connection() { ::close(fd); }
+
+    int fd;
+    std::mutex mutex;
+
+    /* Responses were taken off the queue to be written. */
+    std::condition_variable drained;
+
+    /* A response finished, or the client stopped sending queries. */
+    std::condition_variable finished;
+
+    std::deque<std::shared_ptr<Response>> responses;
+    bool reading;
+};
+
+Server::Server(
+    const std::string& address,
+    std::size_t workers,
+    Handler handler) :
+    address_(address), fd_(-1), handler_(handler),
+    stopping_(false), clients_(0)
+{
+    auto colon = address.rfind(':');
+    if (colon != std::string::npos)
+    {
+        auto host = address.substr(0, colon);
+        if (host.empty() || host == "localhost") host = "127.0.0.1";
+
+        sockaddr_in addr = sockaddr_in();
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(std::stoi(address.substr(colon + 1)));
+        if (::inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+            (ntohl(addr.sin_addr.s_addr) >> 24) != 127)
+        {
+            throw std::invalid_argument(
+                "Can only serve on a loopback address: " + address);
+        }
+
+        fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd_ < 0) throw systemError("Can't create socket");
+
+        int on = 1;
+        ::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        if (::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        {
+            auto error = systemError("Can't bind " + address);
+            ::close(fd_);
+            throw error;
+        }
+    }
+    else
+    {
+        sockaddr_un addr = sockaddr_un();
+        addr.sun_family = AF_UNIX;
+        if (address.size() >= sizeof(addr.sun_path))
+            throw std::invalid_argument("Socket path too long: " + address);
+        std::strcpy(addr.sun_path, address.c_str());
+
+        /*
+         * Clear out a socket left behind by a server that died, but not one
+         * a live server is still answering on.
+         */
+        struct stat st;
+        if (::stat(address.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+        {
+            int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (probe < 0) throw systemError("Can't create socket");
+            bool live = ::connect(probe, 
+                reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+            ::close(probe);
+            if (live)
+            {
+                throw std::runtime_error(
+                    "Another server is already serving on " + address);
+            }
+            ::unlink(address.c_str());
+        }
+
+        fd_ = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd_ < 0) throw systemError("Can't create socket");
+        if (::bind(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+        {
+            auto error = systemError("Can't bind " + address);
+            ::close(fd_);
+            throw error;
+        }
+        unix_path_ = address;
+    }
+
+    if (::listen(fd_, SOMAXCONN) < 0)
+    {
+        auto error = systemError("Can't listen on " + address);
+        ::close(fd_);
+        throw error;
+    }
+
+    workers = std::max<std::size_t>(workers, 1);
+    for (std::size_t i = 0; i < workers; ++i)
+        workers_.emplace_back(&Server::work, this);
+}
+
+Server::~Server()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    ::shutdown(fd_, SHUT_RDWR);
+    for (auto fd : client_fds_) ::shutdown(fd, SHUT_RDWR);
+    idle_.wait(lock, [this] { return clients_ == 0; });
+
+    stopping_ = true;
+    ready_.notify_all();
+    lock.unlock();
+    for (auto& t : workers_) t.join();
+
+    ::close(fd_);
+    if (!unix_path_.empty()) ::unlink(unix_path_.c_str());
+}
+
+void Server::run()
+{
+    for (;;)
+    {
+        int fd = ::accept(fd_, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            throw systemError("Can't accept on " + address_);
+        }
+
+        auto c = std::make_shared<Connection>(fd);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++clients_;
+            client_fds_.insert(fd);
+        }
+
+        std::thread([this, c]
+        {
+            serve(c);
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            client_fds_.erase(c->fd);
+            --clients_;
+            idle_.notify_all();
+        }).detach();
+    }
+}
+
+/* Read a client's queries and queue them until it hangs up. */
+void Server::serve(std::shared_ptr<Connection> c)
+{
+    std::thread writer(&Server::write, this, std::ref(*c));
+    std::string buf;
+    char chunk[1 << 12];
+
+    for (;;)
+    {
+        auto n = ::read(c->fd, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        buf.append(chunk, n);
+
+        std::size_t start = 0;
+        for (auto nl = buf.find('\n'); nl != std::string::npos;
+             nl = buf.find('\n', start))
+        {
+            auto r = std::make_shared<Response>(
+                buf.substr(start, nl - start));
+            if (!r->query.empty() && r->query.back() == '\r')
+                r->query.pop_back();
+            start = nl + 1;
+
+            {
+                std::unique_lock<std::mutex> lock(c->mutex);
+                c->drained.wait(lock, [&c]
+                {
+                    return c->responses.size() < max_in_flight;
+                });
+                c->responses.push_back(r);
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                queue_.push_back([this, c, r] { execute(c, r); });
+            }
+            ready_.notify_one();
+        }
+        buf.erase(0, start);
+        if (buf.size() > max_line) break;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(c->mutex);
+        c->reading = false;
+        c->finished.notify_all();
+    }
+    writer.join();
+}
+
+void Server::execute(std::shared_ptr<Connection> c, std::shared_ptr<Response> r)
+{
+    std::ostringstream out;
+    try
+    {
+        handler_(r->query, out);
+        r->body = out.str();
+    }
+    catch (const std::exception& ex)
+    {
+        r->ok = false;
+        r->body = ex.what();
+    }
+
+    std::lock_guard<std::mutex> lock(c->mutex);
+    r->done = true;
+    c->finished.notify_all();
+}
+
+/*
+ * Write out finished responses, as far as the first unfinished one, until
+ * the client stops sending queries and every one has been answered. Once
+ * the client can't be written to, responses are dropped instead.
+ */
+void Server::write(Connection& c)
+{
+    bool broken = false;
+    std::string out;
+
+    std::unique_lock<std::mutex> lock(c.mutex);
+    for (;;)
+    {
+        c.finished.wait(lock, [&c]
+        {
+            return (!c.responses.empty() && c.responses.front()->done) ||
+                (!c.reading && c.responses.empty());
+        });
+        if (c.responses.empty()) return;
+
+        out.clear();
+        while (!c.responses.empty() && c.responses.front()->done)
+        {
+            auto& r = *c.responses.front();
+            out += r.ok ? "ok " : "error ";
+            out += std::to_string(r.body.size());
+            out += '\n';
+            out += r.body;
+            c.responses.pop_front();
+        }
+        c.drained.notify_all();
+
+        lock.unlock();
+        if (!broken) broken = !sendAll(c.fd, out);
+        lock.lock();
+    }
+}
+
+void Server::work()
+{
+    for (;;)
+    {
+        std::function<void ()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+            if (queue_.empty()) return;
+
+            task = std::move(queue_.front());
+            queue_.pop_front();
+        }
+        task();
+    }
+}
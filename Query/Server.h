@@ -0,0 +1,74 @@
+#ifndef SCQ_SERVER_H
+#define SCQ_SERVER_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Serves queries over a local socket: a Unix domain socket, or TCP on the
+ * loopback interface if the address is [localhost]:port. Each line a client
+ * sends is one query. Queries from all clients run on a shared pool of
+ * workers, and each client's responses come back in the order it sent the
+ * queries, so a client may send many before reading any. A response is a
+ * header line, "ok N" or "error N", followed by N bytes of output. Each
+ * client has its own writer thread, so one that doesn't read its responses
+ * only holds up itself, never the workers.
+ *
+ * The handler writes a query's output to the stream it's given, and throws
+ * to report an error. It's called from many threads at once.
+ */
+class Server
+{
+public:
+    typedef std::function<void (const std::string&, std::ostream&)> Handler;
+
+    /*
+     * Listen on the address. A Unix socket left behind by a server that
+     * died is replaced, but throws std::runtime_error if a server is still
+     * answering on it.
+     */
+    Server(const std::string& address, std::size_t workers, Handler handler);
+    ~Server();
+
+    Server(const Server&) = delete;
+    Server& operator=(const Server&) = delete;
+
+    /* Accept clients until the listening socket fails. */
+    void run();
+
+private:
+    struct Response;
+    struct Connection;
+
+    void serve(std::shared_ptr<Connection> c);
+    void execute(std::shared_ptr<Connection> c, std::shared_ptr<Response> r);
+    void write(Connection& c);
+    void work();
+
+    std::string address_;
+    std::string unix_path_;
+    int fd_;
+    Handler handler_;
+
+    std::mutex mutex_;
+    std::condition_variable ready_;
+    std::deque<std::function<void ()>> queue_;
+    bool stopping_;
+    std::vector<std::thread> workers_;
+
+    /* Connected clients, each with its own reader and writer threads. */
+    std::condition_variable idle_;
+    std::size_t clients_;
+    std::set<int> client_fds_;
+};
+
+#endif /* SCQ_SERVER_H */
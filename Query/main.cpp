@@ -3,41 +3,224 @@
 #include <boost/lexical_cast.hpp>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <functional>
-#include <boost/regex.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <readline/readline.h>
 #include <readline/history.h>
 
 #include "StellarCartography/Algorithms.h"
+#include "StellarCartography/CsvLoader.h"
+#include "StellarCartography/Metrics.h"
+#include "StellarCartography/Parallel.h"
 #include "StellarCartography/StarMap.h"
+#include "StellarCartography/Trace.h"
+
+#include "Output.h"
+#include "Server.h"
 
 using namespace StellarCartography;
 
-std::list<std::string> star_names;
-StarMap g;
+Output::Format output_format = Output::Format::Text;
+
 
+/* 
+ * Arguments point into the command line they were split from. Commands run
+ * against the map that was current when they started.
+ */
+typedef std::vector<boost::string_ref> ArgList;
+typedef std::function<void (const ArgList&, const StarMap&, Output&)> QueryFcn;
+typedef std::function<void (const ArgList&, StarMap&, Output&)> CommandFcn;
 
-typedef std::vector<std::string> ArgList;
-typedef std::function<void (ArgList)> QueryFcn;
-typedef std::unordered_map<std::string, QueryFcn> CommandTable;
+/*
+ * Keyed by the string literals naming them, so a command can be looked up
+ * straight from its argument, and a key's data() is nul-terminated.
+ */
+typedef std::map<boost::string_ref, QueryFcn> QueryTable;
+typedef std::map<boost::string_ref, CommandFcn> CommandTable;
 using namespace std; 
 using namespace boost;
 
 template<class T = std::string>
-T getArg(ArgList args, size_t idx)
+T getArg(const ArgList& args, size_t idx)
 {
     if (idx >= args.size()) throw std::out_of_range("Missing argument");
-    return lexical_cast<T>(args[idx]);
+    return lexical_cast<T>(args[idx].data(), args[idx].size());
 }
 
-typedef std::pair<Coordinate, double> Sample;
 template<>
-Sample getArg(ArgList args, size_t idx)
+std::string getArg(const ArgList& args, size_t idx)
+{
+    if (idx >= args.size()) throw std::out_of_range("Missing argument");
+    return args[idx].to_string();
+}
+
+/* The star named by an argument, without copying it. */
+const Star& getStarArg(const StarMap& g, const ArgList& args, size_t idx)
+{
+    return g[g.getId(getArg(args, idx))];
+}
+
+typedef std::pair<Coordinate, double> Sample;
+Sample getSample(const StarMap& g, const ArgList& args, size_t idx)
 {
-    std::string name = getArg(args, idx);
+    auto& star = getStarArg(g, args, idx);
     double range = getArg<double>(args, idx + 1);
 
-    return Sample(g.getStar(name).getCoords(), range);
+    return Sample(star.getCoords(), range);
+}
+
+/*
+ * A map being loaded on a background thread. Once it's built it replaces
+ * the current map in one step, so queries never wait for a load, and those
+ * already running keep the map they started with. A load that fails leaves
+ * the current map as it was.
+ */
+struct Load
+{
+    explicit Load(const std::string& p) : 
+        path(p), done(0), total(0), stars(0), finished(false)
+    {
+    }
+
+    std::string path;
+
+    /* Bytes parsed so far, out of total, if the loader reports them. */
+    std::atomic<size_t> done;
+    std::atomic<size_t> total;
+
+    /* Set under load_mutex when the load finishes. */
+    size_t stars;
+    bool finished;
+    std::string error;
+    std::vector<CsvLoader::Error> errors;
+};
+
+std::shared_ptr<StarMap> current_map = std::make_shared<StarMap>();
+
+std::mutex load_mutex;
+std::condition_variable load_finished;
+std::shared_ptr<Load> last_load;
+std::thread load_thread;
+
+/* Whether load waits for the new map, as scripts expect. */
+bool wait_for_loads = true;
+
+std::shared_ptr<StarMap> currentMap()
+{
+    return std::atomic_load(&current_map);
+}
+
+void startLoad(const std::string& path, std::function<StarMap (Load&)> build)
+{
+    std::lock_guard<std::mutex> lock(load_mutex);
+    if (last_load && !last_load->finished)
+    {
+        throw std::invalid_argument("Already loading " + last_load->path);
+    }
+    if (load_thread.joinable()) load_thread.join();
+
+    auto load = std::make_shared<Load>(path);
+    last_load = load;
+    load_thread = std::thread([load, build]
+    {
+        std::shared_ptr<StarMap> map;
+        std::string error;
+        try
+        {
+            map = std::make_shared<StarMap>(build(*load));
+            std::atomic_store(&current_map, map);
+        }
+        catch (const std::exception& ex)
+        {
+            error = ex.what();
+        }
+
+        std::lock_guard<std::mutex> lock(load_mutex);
+        load->stars = map ? map->size() : 0;
+        load->error = error;
+        load->finished = true;
+        load_finished.notify_all();
+    });
+}
+
+void reportLoad(Output& out)
+{
+    std::lock_guard<std::mutex> lock(load_mutex);
+    if (!last_load)
+    {
+        out.record("Nothing loaded", { { "state", "none" } });
+        return;
+    }
+
+    auto& load = *last_load;
+    if (load.finished && !load.error.empty())
+    {
+        out.record("Failed to load {path}: {error}", {
+            { "path", load.path },
+            { "state", "failed" },
+            { "error", load.error }
+        });
+    }
+    else if (load.finished)
+    {
+        for (auto& e : load.errors)
+        {
+            out.record("Line {line}: {message}", {
+                { "line", e.line },
+                { "message", e.message }
+            });
+        }
+        out.record("Loaded {stars} stars from {path}", {
+            { "path", load.path },
+            { "state", "done" },
+            { "stars", load.stars }
+        });
+    }
+    else if (load.total == 0 || load.done < load.total)
+    {
+        double total = load.total;
+        out.record("Loading {path}: {percent:.0}% read", {
+            { "path", load.path },
+            { "state", "reading" },
+            { "percent", total ? 100.0 * load.done / total : 0.0 }
+        });
+    }
+    else
+    {
+        out.record("Loading {path}: building the map", {
+            { "path", load.path },
+            { "state", "building" }
+        });
+    }
+}
+
+/* Wait for the load just started if loads are waited for. */
+void finishLoad(Output& out)
+{
+    if (!wait_for_loads)
+    {
+        reportLoad(out);
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(load_mutex);
+    load_finished.wait(lock, [] { return last_load->finished; });
+
+    auto& load = *last_load;
+    if (!load.error.empty()) throw std::runtime_error(load.error);
+    for (auto& e : load.errors)
+    {
+        out.record("Line {line}: {message}", {
+            { "line", e.line },
+            { "message", e.message }
+        });
+    }
 }
 
 std::ostream& operator<<(ostream& os, const Coordinate& c)
@@ -48,129 +231,224 @@ std::ostream& operator<<(ostream& os, const Coordinate& c)
     return os << ss.str();
 }
 
-CommandTable cmds 
+/* Queries only read the map, so any number may run at once. */
+QueryTable queries
 {
     { 
         "nearest",
-        [](ArgList args) 
+        [](const ArgList& args, const StarMap& g, Output& out) 
         {
-            Star from = g.getStar(getArg(args, 1));
-            Star to = 
-                g.nearestNeighbor(from, getArg<double>(args, 2));
-            cout << "Neighbor: " << to.getName() 
-                 << " Distance: " 
-                 << from.getCoords().distance(to.getCoords()) 
-                 << endl;
+            auto& from = getStarArg(g, args, 1);
+            double t = getArg<double>(args, 2);
+            size_t k = (args.size() > 3) ? getArg<size_t>(args, 3) : 1;
+
+            for (auto n : g.neighborsSorted(from, t, k))
+            {
+                out.record("Neighbor: {star} Distance: {distance}", {
+                    { "star", g[n.first].getName() },
+                    { "distance", n.second }
+                });
+            }
         }
     },
     { 
         "neighbors", 
-        [](ArgList args)
+        [](const ArgList& args, const StarMap& g, Output& out)
         {
-            Star from = g.getStar(getArg(args, 1));
+            auto& from = getStarArg(g, args, 1);
             double t = getArg<double>(args, 2);
-            for (auto n : g.neighbors(from, t))
+            size_t k = (args.size() > 3) ? 
+                getArg<size_t>(args, 3) : numeric_limits<size_t>::max();
+
+            for (auto n : g.neighborsSorted(from, t, k))
             {
-                cout << "Neighbor: " << n.getName()
-                     << " Distance: " 
-                     << from.getCoords().distance(n.getCoords()) 
-                     << endl;
+                out.record("Neighbor: {star} Distance: {distance}", {
+                    { "star", g[n.first].getName() },
+                    { "distance", n.second }
+                });
             }
         }
     },
     {
         "path",
-        [](ArgList a)
+        [](const ArgList& a, const StarMap& g, Output& out)
         {
-            Star from = g.getStar(getArg(a, 1));
-            Star to = g.getStar(getArg(a, 2));
+            Star from = getStarArg(g, a, 1);
+            auto& to = getStarArg(g, a, 2);
             double t = getArg<double>(a, 3);
 
             for (auto u : g.path(from, to, t))
             {
-                cout << u.getName() << " " 
-                     << from.getCoords().distance(u.getCoords())
-                     << endl;
+                out.record("{star} {distance}", {
+                    { "star", u.getName() },
+                    { "distance", from.getCoords().distance(u.getCoords()) }
+                });
+                from = u;
+            }
+        }
+    },
+    {
+        "route",
+        [](const ArgList& a, const StarMap& g, Output& out)
+        {
+            Star from = getStarArg(g, a, 1);
+            auto& to = getStarArg(g, a, 2);
+            double t = getArg<double>(a, 3);
+            double total = 0.0;
+
+            auto route = g.shortestPath(from, to, t);
+            if (route.empty()) return;
+
+            for (auto u : route)
+            {
+                double d = from.getCoords().distance(u.getCoords());
+                total += d;
+                out.record("{star} {distance}", {
+                    { "star", u.getName() },
+                    { "distance", d }
+                });
                 from = u;
             }
+            out.record("Total: {total}", { { "total", total } });
         }
     },
     {
         "reachable",
-        [](ArgList a)
+        [](const ArgList& a, const StarMap& g, Output& out)
         {
-            Star from = g.getStar(getArg(a, 1));
+            auto& from = getStarArg(g, a, 1);
             double t = getArg<double>(a, 2);
 
             for (auto v : g.reachable(from, t))
             {
-                cout << v.getName() << std::endl;
+                out.record("{star}", { { "star", v.getName() } });
             }
         }
     },
     {
         "connected",
-        [](ArgList a)
+        [](const ArgList& a, const StarMap& g, Output& out)
+        {
+            double t = getArg<double>(a, 1);
+
+            size_t i = 0;
+            for (auto& cc : g.connectedComponents(t))
+            {
+                out.text("Component:");
+                for (auto& v : cc)
+                {
+                    out.record("\t{star}", {
+                        { "component", i },
+                        { "star", v.getName() }
+                    });
+                }
+                ++i;
+            }
+        }
+    },
+    {
+        "minrange",
+        [](const ArgList& a, const StarMap& g, Output& out)
+        {
+            Star from = getStarArg(g, a, 1);
+            auto& to = getStarArg(g, a, 2);
+
+            out.record("{range}", { 
+                { "range", g.minimumJumpRange(from, to) } 
+            });
+        }
+    },
+    {
+        "clusters-at",
+        [](const ArgList& a, const StarMap& g, Output& out)
         {
             double t = getArg<double>(a, 1);
 
-            for (auto cc : g.connectedComponents(t))
+            if (a.size() > 2)
             {
-                cout << "Component:" << endl;
-                for (auto v : cc)
+                for (auto& v : g.component(getArg(a, 2), t))
                 {
-                    cout << "\t" << v.getName() << endl;
+                    out.record("{star}", { { "star", v.getName() } });
                 }
+                return;
             }
+
+            out.record("Clusters: {clusters}", {
+                { "clusters", g.componentCount(t) }
+            });
         }
     },
     {
         "trilaterate",
-        [](ArgList a)
+        [](const ArgList& a, const StarMap& g, Output& out)
         {
-            std::list<Sample> samples;
+            std::vector<Sample> samples;
 
             for (size_t i = 1; i < a.size(); i += 2)
             {
-                samples.emplace_back(getArg<Sample>(a, i));
+                samples.emplace_back(getSample(g, a, i));
             }
             
             auto q = 
                 StellarCartography::trilaterate(samples.begin(), samples.end());
-            cout << q.x() << ", " << q.y() << ", " << q.z() << endl;
+            out.record("{x}, {y}, {z}", {
+                { "x", q.x() }, { "y", q.y() }, { "z", q.z() }
+            });
+        }
+    },
+    {
+        "trilaterate-ransac",
+        [](const ArgList& a, const StarMap& g, Output& out)
+        {
+            auto tolerance = getArg<double>(a, 1);
+            std::vector<Sample> samples;
+
+            for (size_t i = 2; i < a.size(); i += 2)
+            {
+                samples.emplace_back(getSample(g, a, i));
+            }
+
+            auto q = StellarCartography::trilaterateRansac(
+                samples.begin(), samples.end(), tolerance);
+            out.record("{x}, {y}, {z}", {
+                { "x", q.x() }, { "y", q.y() }, { "z", q.z() }
+            });
         }
     },
     {
         "coordinates",
-        [](ArgList a)
+        [](const ArgList& a, const StarMap& g, Output& out)
         {
-            auto p = g.getStar(getArg(a, 1)).getCoords();
-            cout << "(" << p.x() << ", " << p.y() << ", " << p.z() << ")" << endl;
+            auto p = getStarArg(g, a, 1).getCoords();
+            out.record("({x}, {y}, {z})", {
+                { "x", p.x() }, { "y", p.y() }, { "z", p.z() }
+            });
         }
     },
     {
         "distance",
-        [](ArgList a)
+        [](const ArgList& a, const StarMap& g, Output& out)
         {
-            auto p1 = g.getStar(getArg(a, 1)).getCoords();
-            auto p2 = g.getStar(getArg(a, 2)).getCoords();
+            auto p1 = getStarArg(g, a, 1).getCoords();
+            auto p2 = getStarArg(g, a, 2).getCoords();
 
-            cout << p1.distance(p2) << endl;
+            out.record("{distance}", { { "distance", p1.distance(p2) } });
         }
     },
     {
         "map",
-        [](ArgList a)
+        [](const ArgList& a, const StarMap& g, Output& out)
         {
             auto d = getArg<double>(a, 1);
             Coordinate com = g.centerOfMass();
             double extent = g.extent();
             double scale = 10.0 / extent;
 
-            auto edge_writer = [](std::ostream& os, const Jump& edge)
+            auto edge_writer = [&g](std::ostream& os, const JumpId& edge)
             {
                 os << "[" 
-                   << "xlabel=\"" << fixed << setprecision(2) << edge.weight() << "\"" 
+                   << "xlabel=\"" << fixed << setprecision(2) 
+                   << g.getJump(edge).weight() << "\"" 
                    << "]";
             };
 
@@ -189,9 +467,10 @@ CommandTable cmds
                 return ss.str();
             };
 
-            auto vertex_writer = [com, scale, &make_label](
-                std::ostream& os, const Star& s)
+            auto vertex_writer = [&g, com, scale, &make_label](
+                std::ostream& os, StarId id)
             {
+                const Star& s = g[id];
                 Coordinate c = s.getCoords();
                 c = { (c.x() - com.x()) * scale, (c.y() - com.y()) * scale, 0.0 };
                 os << "[" 
@@ -208,49 +487,129 @@ CommandTable cmds
                 os << "node [style=filled]" << endl;
             };
 
+            std::ostringstream ss;
             boost::write_graphviz(
-                cout, g.byDistance(d), vertex_writer, edge_writer, graph_writer
+                ss, *g.byDistance(d), vertex_writer, edge_writer, graph_writer
             );
+            out.write(ss.str());
         }
     },
     {
-        "load",
-        [](ArgList a)
+        "loading",
+        [](const ArgList&, const StarMap&, Output& out)
+        {
+            reportLoad(out);
+        }
+    },
+    {
+        "info",
+        [](const ArgList& a, const StarMap& g, Output& out)
+        {
+            auto& s = getStarArg(g, a, 1);
+            auto c = s.getCoords();
+
+            std::string text =
+                "Name:         {name}\n"
+                "Location:     ({x:.2}, {y:.2}, {z:.2})";
+            std::vector<Output::Field> fields {
+                { "name", s.getName() },
+                { "x", c.x() }, { "y", c.y() }, { "z", c.z() }
+            };
+
+            for (auto& kv : s.properties())
+            {
+                std::ostringstream ss;
+                ss << "\n" << left << kv.first << ":";
+                ss.width(std::max<int>(13 - kv.first.size(), 0));
+                ss << " " << "{" << kv.first << "}";
+                text += ss.str();
+                fields.push_back({ kv.first.c_str(), kv.second });
+            }
+            out.record(text, fields);
+        }
+    },
+    {
+        "memory",
+        [](const ArgList&, const StarMap& g, Output& out)
         {
-            std::vector<Star> stars;
-            std::ifstream is(getArg(a, 1));
-            star_names.clear();
+            auto m = g.memoryUsage();
+            std::pair<const char*, std::size_t> parts[] = {
+                { "stars", m.stars },
+                { "properties", m.properties },
+                { "star_indexes", m.star_indexes },
+                { "coordinates", m.coordinates },
+                { "spatial_tree", m.spatial_tree },
+                { "pending_edits", m.pending_edits },
+                { "grid", m.grid },
+                { "hierarchy", m.hierarchy }
+            };
 
-            std::string line;
-            while (std::getline(is, line).good())
+            for (auto& p : parts)
             {
-                boost::trim(line);
-                std::vector<std::string> strs;
-                boost::split(strs, line, boost::is_any_of(","));
-                
-                Star s {
-                    strs[0],
+                std::ostringstream ss;
+                ss << left;
+                ss.width(15);
+                ss << std::string(p.first) + ":";
+                ss << "{bytes}";
+                out.record(ss.str(), 
+                    { { "part", p.first }, { "bytes", p.second } });
+            }
+            for (auto& e : m.graphs)
+            {
+                out.record("graph {threshold}: {bytes}", 
                     {
-                        boost::lexical_cast<double>(strs[1]),
-                        boost::lexical_cast<double>(strs[2]),
-                        boost::lexical_cast<double>(strs[3]),
+                        { "part", "graph" }, 
+                        { "threshold", e.first }, 
+                        { "bytes", e.second }
                     }
-                };
-
-                s.setProperty("bloc", strs[4]);
-                s.setProperty("government", strs[5]);
-                s.setProperty("economy", strs[6]);
-
-                stars.push_back(s);
-                star_names.push_back(strs[0]);
+                );
             }
+            out.record("total:         {bytes}", 
+                { { "part", "total" }, { "bytes", m.total() } });
+        }
+    },
+    {
+        "list",
+        [](const ArgList&, const StarMap& g, Output& out)
+        {
+            for (auto& s : g)
+            {
+                out.record("{star}", { { "star", s.getName() } });
+            }
+        }
+    }
+};
 
-            g = StarMap(stars.begin(), stars.end());
+/*
+ * Commands replace or change the map, write files, or change settings or
+ * statistics that every query shares, so they run alone.
+ */
+CommandTable commands
+{
+    {
+        "load",
+        [](const ArgList& a, StarMap&, Output& out)
+        {
+            auto path = getArg(a, 1);
+            startLoad(path, [path](Load& load)
+            {
+                CsvLoader loader({ "bloc", "government", "economy" });
+                loader.setProgress([&load](size_t done, size_t total)
+                {
+                    load.total = total;
+                    load.done = done;
+                });
+
+                auto map = loader.load(path);
+                load.errors = loader.errors();
+                return map;
+            });
+            finishLoad(out);
         }
     },
     {
         "save",
-        [](ArgList a)
+        [](const ArgList& a, StarMap& g, Output&)
         {
             std::ofstream os(getArg(a, 1));
 
@@ -262,100 +621,388 @@ CommandTable cmds
                    << c.x() << "," << c.y() << "," << c.z() << ","
                    << s.getProperty("bloc") << ","
                    << s.getProperty("government") << "," 
-                   << s.getProperty("economy") << endl;
+                   << s.getProperty("economy") << "\n";
             }
         }
     },
     {
-        "info",
-        [](ArgList a)
+        "load-map",
+        [](const ArgList& a, StarMap&, Output& out)
         {
-            auto s = g.getStar(getArg(a, 1));
+            auto path = getArg(a, 1);
+            startLoad(path, [path](Load&) 
+            { 
+                return StarMap(MapFile(path)); 
+            });
+            finishLoad(out);
+        }
+    },
+    {
+        "save-map",
+        [](const ArgList& a, StarMap& g, Output&)
+        {
+            std::vector<double> thresholds;
+            for (size_t i = 2; i < a.size(); ++i)
+            {
+                thresholds.push_back(getArg<double>(a, i));
+            }
+            g.save(getArg(a, 1), thresholds);
+        }
+    },
+    {
+        "cache",
+        [](const ArgList& a, StarMap& g, Output& out)
+        {
+            std::string op = (a.size() > 1) ? getArg(a, 1) : "stats";
 
-            cout << "Name:         " << s.getName() << endl;
-            cout << "Location:     " << s.getCoords() << endl;
+            if (op == "budget")
+            {
+                auto b = getArg(a, 2);
+                g.setCacheBudget(
+                    (b == "unbounded") ? 
+                        ThresholdCache<StarMap::dist_index>::unbounded() : 
+                        getArg<size_t>(a, 2)
+                );
+            }
+            else if (op == "policy")
+            {
+                auto p = getArg(a, 2);
+                if (p == "lru") g.setCachePolicy(EvictionPolicy::LRU);
+                else if (p == "lfu") g.setCachePolicy(EvictionPolicy::LFU);
+                else throw std::invalid_argument("Unknown policy: " + p);
+            }
+            else if (op == "clear")
+            {
+                g.clearCache();
+            }
+            else if (op != "stats")
+            {
+                throw std::invalid_argument("Unknown cache command: " + op);
+            }
+
+            auto s = g.cacheStats();
+            auto unbounded = 
+                s.budget == ThresholdCache<StarMap::dist_index>::unbounded();
+
+            out.record(
+                "Entries:      {entries}\n"
+                "Bytes:        {bytes}\n"
+                "Budget:       {budget}\n"
+                "Hits:         {hits}\n"
+                "Misses:       {misses}\n"
+                "Evictions:    {evictions}",
+                {
+                    { "entries", s.entries },
+                    { "bytes", s.bytes },
+                    { "budget", 
+                        unbounded ? Output::Value("unbounded") : s.budget },
+                    { "hits", s.hits },
+                    { "misses", s.misses },
+                    { "evictions", s.evictions }
+                }
+            );
+        }
+    },
+    {
+        "stats",
+        [](const ArgList& a, StarMap&, Output& out)
+        {
+            std::string op = (a.size() > 1) ? getArg(a, 1) : "show";
+            if (!Metrics::enabled())
+            {
+                out.text("Built without metrics");
+                return;
+            }
 
-            for (auto kv : s.properties())
+            if (op == "reset")
             {
-                std::ostringstream ss;
-                ss << left << kv.first << ":";
-                ss.width(std::max<int>(13 - kv.first.size(), 0));
-                ss << " ";
-                cout << ss.str() << kv.second << endl;
+                Metrics::reset();
+                return;
+            }
+            else if (op != "show")
+            {
+                throw std::invalid_argument("Unknown stats command: " + op);
+            }
+
+            auto snapshot = Metrics::snapshot();
+            for (auto& c : snapshot.counters)
+            {
+                out.record("{name}: {value}", 
+                    { { "name", c.name }, { "value", c.value } });
+            }
+            for (auto& h : snapshot.histograms)
+            {
+                out.record(
+                    "{name}: count {count} mean {mean:.1} "
+                    "p50 {p50} p90 {p90} p99 {p99} {unit}",
+                    {
+                        { "name", h.name },
+                        { "count", h.count },
+                        { "mean", h.mean() },
+                        { "p50", h.quantile(0.5) },
+                        { "p90", h.quantile(0.9) },
+                        { "p99", h.quantile(0.99) },
+                        { "unit", h.unit }
+                    }
+                );
             }
         }
     },
     {
-        "list",
-        [](ArgList)
+        "trace",
+        [](const ArgList& a, StarMap&, Output& out)
         {
-            for (auto s : star_names)
+            auto op = getArg(a, 1);
+            if (op == "start")
             {
-                cout << s << endl;
+                Trace::start();
             }
+            else if (op == "stop")
+            {
+                auto path = getArg(a, 2);
+                if (!Trace::recording())
+                    throw std::invalid_argument("Not tracing");
+
+                std::ofstream file(path);
+                if (!file) throw std::runtime_error("Can't write " + path);
+
+                auto events = Trace::stop(file);
+                out.record("Wrote {events} events to {path}",
+                    { { "events", events }, { "path", path } });
+            }
+            else
+            {
+                throw std::invalid_argument("Unknown trace command: " + op);
+            }
+        }
+    },
+    {
+        "format",
+        [](const ArgList& a, StarMap&, Output&)
+        {
+            output_format = Output::parseFormat(getArg(a, 1));
         }
     }
 };
 
-std::string strip_comments(const std::string& s)
+/*
+ * Split a command into arguments at whitespace, up to any comment. Quotes
+ * group words into one argument and are left out of it. The arguments
+ * point into the command, and args keeps its storage between calls.
+ */
+void split_args(const std::string& s, ArgList& args)
+{
+    auto isSpace = [](char c) { return c == ' ' || c == '\t' || c == '\r'; };
+    auto isTrimmed = [&isSpace](char c) 
+    { 
+        return isSpace(c) || c == '\'' || c == '"'; 
+    };
+
+    args.clear();
+    for (auto p = s.data(), end = s.data() + s.size(); p != end; )
+    {
+        if (isSpace(*p))
+        {
+            ++p;
+            continue;
+        }
+        if (*p == '#') break;
+
+        auto begin = p;
+        auto close = (*p == '\'' || *p == '"') ? 
+            std::find(p + 1, end, *p) : end;
+        if (close != end)
+        {
+            p = close + 1;
+        }
+        else
+        {
+            while (p != end && !isSpace(*p) && *p != '#') ++p;
+        }
+
+        auto last = p;
+        while (begin != last && isTrimmed(*begin)) ++begin;
+        while (begin != last && isTrimmed(last[-1])) --last;
+        if (begin != last) args.emplace_back(begin, last - begin);
+    }
+}
+
+/*
+ * Errors go to the output as text, but to stderr in the other formats so
+ * they can't be mistaken for results.
+ */
+void reportError(Output& out, const std::string& message)
 {
-    bool in_quote = false;
-    std::string result;
-    for (char c : s)
+    if (out.format() == Output::Format::Text)
     {
-        if (c == '"' || c == '\'') in_quote = !in_quote;
-        if (c == '#' && !in_quote) break;
-        result.push_back(c);
+        out.text(message);
+        return;
     }
-    return result;
+    /* In one write, so errors from parallel commands don't interleave. */
+    out.flush();
+    cerr << message + "\n";
 }
 
-std::vector<std::string> split_args(const std::string& s)
+bool isQuery(const ArgList& args)
 {
-    boost::regex split_regex("(^|\\s+)('.*?'|\".*?\"|[^\\s]+)");
-    std::vector<std::string> args;
-
-    std::transform(
-        boost::sregex_iterator(s.begin(), s.end(), split_regex),
-        boost::sregex_iterator(),
-        std::back_inserter(args),
-        [](boost::smatch m) 
-        { 
-            return boost::trim_copy_if(m.str(), boost::is_any_of(" \t'\"")); 
-        }
-    );
-    return args;
+    return !args.empty() && queries.count(args[0]);
 }
 
-void processQuery(const CommandTable& c, const std::string& cmd)
+void processQuery(const ArgList& args, Output& out)
 {
-    std::vector<std::string> args = split_args(strip_comments(cmd));
     if (args.size() == 0) return;
 
-    auto it = c.find(args[0]);
-    if (it != c.end())
+    auto q = queries.find(args[0]);
+    if (q != queries.end())
     {
-        it->second(args);
+        Trace::Scope scope(q->first.data());
+        std::shared_ptr<const StarMap> map = currentMap();
+        q->second(args, *map, out);
+        return;
     }
-    else
+
+    auto c = commands.find(args[0]);
+    if (c != commands.end())
     {
-        std::cout << "Unknown command: " << args[0] << std::endl;
+        Trace::Scope scope(c->first.data());
+        auto map = currentMap();
+        c->second(args, *map, out);
+        return;
     }
+    reportError(out, "Unknown command: " + getArg(args, 0));
+}
+
+void runQuery(const ArgList& args, Output& out)
+{
+    try
+    {
+        processQuery(args, out);
+    }
+    catch (const std::exception& ex)
+    {
+        reportError(out, std::string("Exception: ") + ex.what());
+    }
+}
+
+/*
+ * Run a command, with its results written to stdout in one go. Only the
+ * main thread runs commands this way, so they share one argument list.
+ */
+void runQuery(const std::string& cmd)
+{
+    static ArgList args;
+    split_args(cmd, args);
+
+    Output out(cout, output_format);
+    runQuery(args, out);
+}
+
+/*
+ * Run the commands from a stream a block at a time. Runs of queries are
+ * split into chunks of lines, which run in parallel, and the chunks'
+ * results are written in input order. Anything else runs alone.
+ */
+void runBatch(std::istream& is)
+{
+    const size_t block_lines = 1 << 14;
+    const size_t chunk_lines = 64;
+
+    std::vector<std::string> lines(block_lines);
+    std::vector<ArgList> args(block_lines);
+    std::vector<std::string> results;
+
+    auto runsAlone = [&args](size_t i) { return !isQuery(args[i]); };
+
+    for (;;)
+    {
+        size_t n = 0;
+        while (n < block_lines && std::getline(is, lines[n]))
+        {
+            split_args(lines[n], args[n]);
+            ++n;
+        }
+        if (n == 0) return;
+
+        for (size_t i = 0; i < n; )
+        {
+            if (runsAlone(i))
+            {
+                Output out(cout, output_format);
+                runQuery(args[i++], out);
+                continue;
+            }
+
+            auto first = i;
+            while (i < n && !runsAlone(i)) ++i;
+
+            auto chunks = (i - first + chunk_lines - 1) / chunk_lines;
+            results.assign(chunks, std::string());
+            parallelFor(i - first, chunk_lines, 
+                [&](size_t begin, size_t end)
+                {
+                    std::ostringstream ss;
+                    {
+                        Output out(ss, output_format);
+                        for (auto j = begin; j != end; ++j)
+                        {
+                            runQuery(args[first + j], out);
+                        }
+                    }
+                    results[begin / chunk_lines] = ss.str();
+                }
+            );
+
+            for (auto& r : results) cout.write(r.data(), r.size());
+            cout.flush();
+        }
+    }
+}
+
+/*
+ * Clients may only run queries: commands would write files with the
+ * server's permissions, or change the map or settings under every other
+ * client. The map is loaded by the script given on the command line.
+ * Failures go back to the client as errors.
+ */
+void serveQuery(const std::string& cmd, std::ostream& os)
+{
+    static thread_local ArgList args;
+    split_args(cmd, args);
+    if (args.size() == 0) return;
+
+    auto q = queries.find(args[0]);
+    if (q == queries.end())
+    {
+        if (commands.count(args[0]))
+        {
+            throw std::invalid_argument(
+                "Can't " + getArg(args, 0) + " while serving");
+        }
+        throw std::invalid_argument("Unknown command: " + getArg(args, 0));
+    }
+
+    Trace::Scope scope(q->first.data());
+    Output out(os, output_format);
+    std::shared_ptr<const StarMap> map = currentMap();
+    q->second(args, *map, out);
 }
 
 char *cmd_generator(const char *text, int state)
 {
-    static CommandTable::const_iterator it;
+    static std::vector<std::string> names;
+    static size_t i;
 
     if (state == 0)
     {
-        it = cmds.begin();
+        names.clear();
+        for (auto& q : queries) names.push_back(q.first.to_string());
+        for (auto& c : commands) names.push_back(c.first.to_string());
+        i = 0;
     }
 
-    while (it != cmds.end())
+    while (i < names.size())
     {
-        auto s = it->first;
-        ++it;
+        auto& s = names[i++];
         if (boost::starts_with(s, text))
         {
             return strdup(s.c_str());
@@ -367,16 +1014,18 @@ char *cmd_generator(const char *text, int state)
 
 char *star_generator(const char *text, int state)
 {
-    static std::list<std::string>::const_iterator it;
+    static std::shared_ptr<StarMap> map;
+    static StarMap::const_iterator it;
 
     if (state == 0)
     {
-        it = star_names.begin();
+        map = currentMap();
+        it = map->begin();
     }
 
-    while (it != star_names.end())
+    while (it != map->end())
     {
-        auto s = *it;
+        auto s = it->getName();
         ++it;
         if (boost::starts_with(s, text))
         {
@@ -418,7 +1067,7 @@ bool prompt(std::string& s)
     
         return true;
     }
-    return std::getline(cin, s);
+    return static_cast<bool>(std::getline(cin, s));
 }
 
 void redirect(const char *file)
@@ -433,21 +1082,134 @@ void redirect(const char *file)
     }
 }
 
+void usage()
+{
+    std::cerr << "Usage: scq [--format FORMAT] [--batch] [script]" << std::endl
+              << "       scq [--format FORMAT] --serve ADDRESS "
+              << "[--workers N] [script]" << std::endl
+              << "FORMAT is text, jsonl or tsv." << std::endl
+              << "ADDRESS is a Unix socket path, or [localhost]:PORT."
+              << std::endl;
+}
+
+/*
+ * Run the script, to load a map and set it up, and then answer queries on
+ * the socket until the server fails.
+ */
+int serve(
+    const std::string& address,
+    std::size_t workers,
+    const char *script)
+{
+    if (script)
+    {
+        std::ifstream is(script);
+        if (!is)
+        {
+            cerr << "Can't open " << script << ": " << strerror(errno) << endl;
+            return 1;
+        }
+
+        std::string cmd;
+        while (std::getline(is, cmd))
+        {
+            runQuery(cmd);
+        }
+    }
+
+    Server server(address, workers, &serveQuery);
+    cout << "Serving " << currentMap()->size() << " stars on " << address 
+         << endl;
+    server.run();
+    return 0;
+}
+
+/* Let a load in progress finish before the globals it uses go away. */
+struct LoadJoiner
+{
+    ~LoadJoiner()
+    {
+        if (load_thread.joinable()) load_thread.join();
+    }
+};
+
 int main(int argc, char *argv[])
 {
     using namespace std;
     using namespace boost;
 
-    if (argc > 2)
+    LoadJoiner joiner;
+
+    std::string address;
+    std::size_t workers = threadCount();
+    const char *script = 0;
+    bool batch = false;
+
+    try
+    {
+        for (int i = 1; i < argc; ++i)
+        {
+            std::string arg = argv[i];
+            if (arg == "--batch") 
+            {
+                batch = true;
+                continue;
+            }
+            if (boost::starts_with(arg, "--") && i + 1 == argc)
+            {
+                usage();
+                return 1;
+            }
+
+            if (arg == "--serve") address = argv[++i];
+            else if (arg == "--workers") 
+                workers = lexical_cast<size_t>(argv[++i]);
+            else if (arg == "--format") 
+                output_format = Output::parseFormat(argv[++i]);
+            else if (boost::starts_with(arg, "--"))
+            {
+                usage();
+                return 1;
+            }
+            else if (script)
+            {
+                std::cerr << "Too many command line arguments.";
+                return 1;
+            }
+            else script = argv[i];
+        }
+
+        if (!address.empty()) return serve(address, workers, script);
+        if (batch)
+        {
+            if (!script)
+            {
+                runBatch(cin);
+                return 0;
+            }
+
+            std::ifstream is(script);
+            if (!is)
+            {
+                cerr << "Can't open " << script << ": " 
+                     << strerror(errno) << endl;
+                return 1;
+            }
+            runBatch(is);
+            return 0;
+        }
+    }
+    catch (const std::exception& ex)
     {
-        std::cerr << "Too many command line arguments.";
+        cerr << ex.what() << endl;
         return 1;
     }
-    if (argc == 2)
+
+    if (script)
     {
         try
         {
-            redirect(argv[1]);
+            redirect(script);
         } 
         catch (const std::exception& ex)
         {
@@ -455,6 +1217,9 @@ int main(int argc, char *argv[])
         }
     }
 
+    /* At a prompt, load returns at once and the map is swapped in later. */
+    wait_for_loads = !isatty(fileno(stdin));
+
     while (true)
     {
         std::string cmd;
@@ -462,14 +1227,6 @@ int main(int argc, char *argv[])
         {
             return 0;
         }
-
-        try
-        {
-            processQuery(cmds, cmd);
-        }
-        catch (const std::exception& ex)
-        {
-            cout << "Exception: " << ex.what() << std::endl;
-        }
+        runQuery(cmd);
     }
 }
@@ -1,9 +1,13 @@
 #include "Algorithms.h"
 
 #include <boost/iterator/transform_iterator.hpp>
+#include <algorithm>
 #include <cmath>
-#include <combinations_iterator.hpp>
 #include <eigen3/Eigen/Dense>
+#include <limits>
+#include <numeric>
+#include <random>
+#include <stdexcept>
 
 using namespace StellarCartography;
 using namespace StellarCartography::Detail;
@@ -38,6 +42,124 @@ double error(const Coordinate& candidate, const SampleList& l)
     return std::accumulate(begin, end, 0.0);
 }
 
+/*
+ * A position from the samples' sphere equations, |x - p_i|^2 = r_i^2. Less
+ * their mean, these are linear in x. Points are taken relative to their
+ * centroid m, for accuracy, so that with y = x - m:
+ *
+ *   2 (p_i - m) . y = |p_i - m|^2 - r_i^2 - mean(|p_j - m|^2 - r_j^2)
+ *
+ * The least squares solution is unique if the points span three dimensions.
+ * If they lie in a plane, it's the solution within the plane, and normal
+ * is perpendicular to it.
+ */
+struct LinearFit
+{
+    Vector3d x;
+    Vector3d normal;
+    int rank;
+};
+
+LinearFit linearFit(const SampleList& samples)
+{
+    auto n = samples.size();
+
+    Vector3d m = Vector3d::Zero();
+    for (auto& s : samples) m += toVector(s.first);
+    m /= n;
+
+    MatrixXd a(n, 3);
+    VectorXd b(n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        Vector3d q = toVector(samples[i].first) - m;
+        a.row(i) = 2.0 * q.transpose();
+        b(i) = q.squaredNorm() - samples[i].second * samples[i].second;
+    }
+    b.array() -= b.mean();
+
+    JacobiSVD<MatrixXd> svd(a, ComputeThinU | ComputeThinV);
+    svd.setThreshold(1e-9);
+
+    return { m + svd.solve(b), svd.matrixV().col(2), int(svd.rank()) };
+}
+
+double squaredError(const Vector3d& x, const SampleList& samples)
+{
+    double result = 0.0;
+    for (auto& s : samples)
+    {
+        auto r = (x - toVector(s.first)).norm() - s.second;
+        result += r * r;
+    }
+    return result;
+}
+
+/*
+ * Points in a plane can't tell one side of it from the other. A fit to them
+ * lies in the plane, and this is the height above or below it that best
+ * fits their distances.
+ */
+double planeHeight(const LinearFit& fit, const SampleList& samples)
+{
+    double h2 = 0.0;
+    for (auto& s : samples)
+    {
+        h2 += s.second * s.second -
+            (fit.x - toVector(s.first)).squaredNorm();
+    }
+    return std::sqrt(std::max(h2 / samples.size(), 0.0));
+}
+
+/*
+ * Minimize the squared distance errors from a starting point by Gauss-Newton
+ * iteration. Each step solves a 3x3 system, so costs time linear in the
+ * number of samples, and a step that doesn't reduce the error is halved
+ * until it does. From a linear fit this takes a handful of steps.
+ */
+Vector3d refine(Vector3d x, const SampleList& samples)
+{
+    const int max_steps = 50;
+    const int max_halvings = 20;
+
+    auto cost = squaredError(x, samples);
+    for (int step = 0; step < max_steps; ++step)
+    {
+        Matrix3d jtj = Matrix3d::Zero();
+        Vector3d jtr = Vector3d::Zero();
+        for (auto& s : samples)
+        {
+            Vector3d d = x - toVector(s.first);
+            auto dist = d.norm();
+
+            /* At a sample's point its distance has no gradient. */
+            if (dist == 0.0) continue;
+
+            Vector3d j = d / dist;
+            jtj += j * j.transpose();
+            jtr += j * (dist - s.second);
+        }
+
+        Vector3d dx = jtj.ldlt().solve(-jtr);
+        if (!dx.allFinite()) break;
+
+        Vector3d next = x + dx;
+        auto next_cost = squaredError(next, samples);
+        for (int i = 0; i < max_halvings && !(next_cost < cost); ++i)
+        {
+            dx /= 2.0;
+            next = x + dx;
+            next_cost = squaredError(next, samples);
+        }
+        if (!(next_cost < cost)) break;
+
+        x = next;
+        cost = next_cost;
+        if (dx.norm() <= 1e-12 * (1.0 + x.norm())) break;
+    }
+    return x;
+}
+
 }
 
 Solution StellarCartography::Detail::trilaterateOne(
@@ -129,25 +251,97 @@ Coordinate StellarCartography::Detail::trilaterateMany(
     if (samples.size() < 3) 
         throw std::length_error("Not enough samples to trilaterate");
 
-    auto begin_c = make_combinations_iterator<3>(samples.begin(), samples.end());
-    auto end_c = make_combinations_iterator<3>(samples.end(), samples.end());
+    if (samples.size() == 3)
+    {
+        auto s = trilaterateOne(samples[0], samples[1], samples[2]);
+        return (error(s.second, samples) < error(s.first, samples)) ?
+            s.second : s.first;
+    }
+
+    auto fit = linearFit(samples);
+    if (fit.rank == 3) return fromVector(refine(fit.x, samples));
+    if (fit.rank < 2)
+        throw std::invalid_argument("Can't trilaterate from points in a line");
 
-    typedef std::pair<double, Coordinate> Result;
-    typedef std::function<Result(std::array<Sample, 3>)> Xformer;
+    /* Refine a candidate on each side of the plane. */
+    auto h = planeHeight(fit, samples);
+    auto above = fromVector(refine(fit.x + h * fit.normal, samples));
+    auto below = fromVector(refine(fit.x - h * fit.normal, samples));
+    return (error(below, samples) < error(above, samples)) ? below : above;
+}
+
+Coordinate StellarCartography::Detail::trilaterateRansac(
+    const SampleList& samples, double tolerance, std::size_t rounds)
+{
+    /* With four or fewer samples there's nothing to leave out. */
+    if (samples.size() <= 4) return trilaterateMany(samples);
+
+    std::mt19937 rng(samples.size());
+    std::vector<std::size_t> order(samples.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    SampleList subset(4);
+    std::size_t best_count = 0;
+    double best_error = std::numeric_limits<double>::infinity();
+    Vector3d best;
 
-    Xformer xfrm = [&samples](const std::array<Sample, 3>& c)
+    for (std::size_t round = 0; round < rounds; ++round)
     {
-        auto s = trilaterateOne(c[0], c[1], c[2]);
+        /* The first four of a partial shuffle. */
+        for (std::size_t i = 0; i < 4; ++i)
+        {
+            std::uniform_int_distribution<std::size_t> pick(
+                i, order.size() - 1);
+            std::swap(order[i], order[pick(rng)]);
+            subset[i] = samples[order[i]];
+        }
 
-        double e0 = error(s.first, samples);
-        double e1 = error(s.second, samples);
+        /* Four points in a plane place one candidate on each side of it. */
+        auto fit = linearFit(subset);
+        if (fit.rank < 2) continue;
 
-        return (e1 < e0) ? Result(e1, s.second) : Result(e0, s.first);
-    };
+        Vector3d candidates[2] = { fit.x, fit.x };
+        int n = 1;
+        if (fit.rank == 2)
+        {
+            auto h = planeHeight(fit, subset);
+            candidates[0] += h * fit.normal;
+            candidates[1] -= h * fit.normal;
+            n = 2;
+        }
 
-    auto begin = make_transform_iterator(begin_c, xfrm);
-    auto end = make_transform_iterator(end_c, xfrm);
+        for (int c = 0; c < n; ++c)
+        {
+            auto& x = candidates[c];
+            std::size_t count = 0;
+            double total = 0.0;
+            for (auto& s : samples)
+            {
+                auto e = std::abs((x - toVector(s.first)).norm() - s.second);
+                if (e <= tolerance)
+                {
+                    ++count;
+                    total += e;
+                }
+            }
 
-    return std::min_element(begin, end)->second;
-}
+            if (count > best_count ||
+                (count == best_count && total < best_error))
+            {
+                best_count = count;
+                best_error = total;
+                best = x;
+            }
+        }
+    }
+
+    if (best_count < 4) return trilaterateMany(samples);
 
+    SampleList inliers;
+    for (auto& s : samples)
+    {
+        if (std::abs((best - toVector(s.first)).norm() - s.second) <= tolerance)
+            inliers.push_back(s);
+    }
+    return trilaterateMany(inliers);
+}
@@ -1,7 +1,8 @@
 #ifndef SC_ALGORITHMS_H
 #define SC_ALGORITHMS_H
 
-#include <list>
+#include <cstddef>
+#include <vector>
 
 #include "StellarCartography/Coordinate.h"
 
@@ -12,7 +13,7 @@ namespace Detail
 {
 
 typedef std::pair<Coordinate, double> Sample;
-typedef std::list<Sample> SampleList;
+typedef std::vector<Sample> SampleList;
 typedef std::pair<Coordinate, Coordinate> Solution;
 
 Solution trilaterateOne(
@@ -20,14 +21,18 @@ Solution trilaterateOne(
 
 Coordinate trilaterateMany(const SampleList& samples);
 
+Coordinate trilaterateRansac(
+    const SampleList& samples, double tolerance, std::size_t rounds);
+
 }
 
 /*
  * Trilaterate a range of (Coordinate, Distance) points, returning
- * a best guess for the unknown position. Given only three points, 
+ * a best guess for the unknown position. Given only three points,
  * two solutions are possible and one is discarded arbitrarily. Given
- * four or more points, only one solution is possible (if any). In the
- * case where none of the solutions matches, an exception is thrown.
+ * four or more points, the position is the least squares fit to all of
+ * them, which is unique unless the points all lie in a plane. Points that
+ * all lie on a line can't place anything, and throw.
  */
 template<class It>
 Coordinate trilaterate(It begin, It end)
@@ -35,6 +40,21 @@ Coordinate trilaterate(It begin, It end)
     return Detail::trilaterateMany(Detail::SampleList(begin, end));
 }
 
+/*
+ * Trilaterate as above, ignoring points whose distances are wrong. Each
+ * round fits a position to four random points, or a position on each side
+ * if the four lie in a plane, and the fit that's within tolerance of the
+ * most points is refined using only those. Rounds are drawn from a fixed
+ * seed, so the result depends only on the input.
+ */
+template<class It>
+Coordinate trilaterateRansac(
+    It begin, It end, double tolerance, std::size_t rounds = 200)
+{
+    return Detail::trilaterateRansac(
+        Detail::SampleList(begin, end), tolerance, rounds);
+}
+
 }
 
 #endif /* SC_ALGORITHMS_H */
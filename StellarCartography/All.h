@@ -1,9 +1,17 @@
 #ifndef SC_ALL_H
 #define SC_ALL_H
 
+#include "StellarCartography/ConnectivityHierarchy.h"
 #include "StellarCartography/Coordinate.h"
+#include "StellarCartography/CsvLoader.h"
 #include "StellarCartography/Jump.h"
+#include "StellarCartography/MapFile.h"
+#include "StellarCartography/Metrics.h"
+#include "StellarCartography/Parallel.h"
 #include "StellarCartography/Star.h"
 #include "StellarCartography/StarMap.h"
+#include "StellarCartography/ThresholdCache.h"
+#include "StellarCartography/Trace.h"
+#include "StellarCartography/UniformGrid.h"
 
 #endif /* SC_ALL_H */
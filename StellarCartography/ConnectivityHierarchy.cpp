@@ -0,0 +1,466 @@
+#include "StellarCartography/ConnectivityHierarchy.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <numeric>
+#include <tuple>
+
+using namespace StellarCartography;
+
+namespace
+{
+
+const StarId no_star = std::numeric_limits<StarId>::max();
+
+struct Edge
+{
+    double d2;
+    StarId u, v;
+
+    bool operator<(const Edge& o) const
+    {
+        return std::tie(d2, u, v) < std::tie(o.d2, o.u, o.v);
+    }
+};
+
+class DisjointSets
+{
+    std::vector<StarId> parent_;
+    std::vector<StarId> size_;
+
+public:
+    explicit DisjointSets(std::size_t n) :
+        parent_(n), size_(n, 1)
+    {
+        std::iota(parent_.begin(), parent_.end(), 0);
+    }
+
+    StarId find(StarId x)
+    {
+        while (parent_[x] != x)
+        {
+            parent_[x] = parent_[parent_[x]];
+            x = parent_[x];
+        }
+        return x;
+    }
+
+    /* Returns the new representative, or no_star if already joined. */
+    StarId unite(StarId a, StarId b)
+    {
+        a = find(a);
+        b = find(b);
+        if (a == b) return no_star;
+        if (size_[a] < size_[b]) std::swap(a, b);
+        parent_[b] = a;
+        size_[a] += size_[b];
+        return a;
+    }
+};
+
+double distanceSquared(const double *p, const double *q)
+{
+    /* Same evaluation order as flann::L2, so results agree exactly. */
+    double d = 0.0;
+    for (int i = 0; i < 3; ++i) d += (p[i] - q[i]) * (p[i] - q[i]);
+    return d;
+}
+
+/*
+ * A kd-tree whose nodes remember when all of their points belong to the same
+ * cluster, so nearest-foreign-neighbor searches can skip them. This is the
+ * one query the Boruvka steps below need that FLANN can't answer.
+ */
+class ClusterTree
+{
+    static const std::size_t leaf_size = 16;
+
+    struct Node
+    {
+        double lo[3], hi[3];
+        std::size_t begin, end;
+        std::size_t left, right;
+        StarId cluster;
+
+        bool leaf() const { return left == 0; }
+    };
+
+public:
+    ClusterTree(const std::vector<double>& c) :
+        c_(c), ids_(c.size() / 3)
+    {
+        std::iota(ids_.begin(), ids_.end(), 0);
+        if (!ids_.empty()) build(0, ids_.size());
+    }
+
+    const std::vector<StarId>& ids() const { return ids_; }
+
+    void label(const std::vector<StarId>& cluster)
+    {
+        /* Children always follow their parent. */
+        for (auto it = nodes_.rbegin(); it != nodes_.rend(); ++it)
+        {
+            auto& nd = *it;
+            if (nd.leaf())
+            {
+                nd.cluster = cluster[ids_[nd.begin]];
+                for (auto i = nd.begin; i < nd.end; ++i)
+                {
+                    if (cluster[ids_[i]] != nd.cluster) nd.cluster = no_star;
+                }
+            }
+            else
+            {
+                auto l = nodes_[nd.left].cluster;
+                auto r = nodes_[nd.right].cluster;
+                nd.cluster = (l == r) ? l : no_star;
+            }
+        }
+    }
+
+    void nearestForeign(
+        StarId p, const std::vector<StarId>& cluster, Edge& best) const
+    {
+        search(0, p, c_.data() + 3 * p, cluster[p], cluster, best);
+    }
+
+private:
+    std::size_t build(std::size_t begin, std::size_t end)
+    {
+        auto idx = nodes_.size();
+        nodes_.emplace_back();
+
+        Node nd;
+        nd.begin = begin;
+        nd.end = end;
+        nd.left = nd.right = 0;
+        nd.cluster = no_star;
+        for (int d = 0; d < 3; ++d)
+        {
+            nd.lo[d] = std::numeric_limits<double>::max();
+            nd.hi[d] = std::numeric_limits<double>::lowest();
+        }
+        for (auto i = begin; i < end; ++i)
+        {
+            auto p = c_.data() + 3 * ids_[i];
+            for (int d = 0; d < 3; ++d)
+            {
+                nd.lo[d] = std::min(nd.lo[d], p[d]);
+                nd.hi[d] = std::max(nd.hi[d], p[d]);
+            }
+        }
+
+        if (end - begin > leaf_size)
+        {
+            int dim = 0;
+            for (int d = 1; d < 3; ++d)
+            {
+                if (nd.hi[d] - nd.lo[d] > nd.hi[dim] - nd.lo[dim]) dim = d;
+            }
+
+            auto mid = begin + (end - begin) / 2;
+            std::nth_element(
+                ids_.begin() + begin, ids_.begin() + mid, ids_.begin() + end,
+                [this, dim](StarId a, StarId b)
+                {
+                    return c_[3 * a + dim] < c_[3 * b + dim];
+                }
+            );
+
+            nd.left = build(begin, mid);
+            nd.right = build(mid, end);
+        }
+
+        nodes_[idx] = nd;
+        return idx;
+    }
+
+    double boxDistanceSquared(const Node& nd, const double *q) const
+    {
+        double d = 0.0;
+        for (int i = 0; i < 3; ++i)
+        {
+            double delta = std::max({ nd.lo[i] - q[i], q[i] - nd.hi[i], 0.0 });
+            d += delta * delta;
+        }
+        return d;
+    }
+
+    void search(
+        std::size_t idx,
+        StarId p,
+        const double *q,
+        StarId own,
+        const std::vector<StarId>& cluster,
+        Edge& best) const
+    {
+        auto& nd = nodes_[idx];
+        if (nd.cluster == own) return;
+        if (boxDistanceSquared(nd, q) > best.d2) return;
+
+        if (nd.leaf())
+        {
+            for (auto i = nd.begin; i < nd.end; ++i)
+            {
+                auto r = ids_[i];
+                if (cluster[r] == own) continue;
+
+                Edge e {
+                    distanceSquared(q, c_.data() + 3 * r),
+                    std::min(p, r),
+                    std::max(p, r)
+                };
+                if (e < best) best = e;
+            }
+            return;
+        }
+
+        auto l = nd.left;
+        auto r = nd.right;
+        if (boxDistanceSquared(nodes_[r], q) < boxDistanceSquared(nodes_[l], q))
+        {
+            std::swap(l, r);
+        }
+        search(l, p, q, own, cluster, best);
+        search(r, p, q, own, cluster, best);
+    }
+
+    const std::vector<double>& c_;
+    std::vector<StarId> ids_;
+    std::vector<Node> nodes_;
+};
+
+/*
+ * Euclidean minimum spanning tree by Boruvka's algorithm: every round, each
+ * cluster joins its nearest foreign neighbor, at least halving the number
+ * of clusters. Ties are broken by id, so no round can create a cycle.
+ */
+std::vector<Edge> spanningTree(const std::vector<double>& c)
+{
+    auto n = c.size() / 3;
+    ClusterTree tree(c);
+    DisjointSets sets(n);
+
+    std::vector<Edge> result;
+    std::vector<StarId> cluster(n);
+    std::vector<Edge> best(n);
+
+    while (result.size() + 1 < n)
+    {
+        for (StarId i = 0; i < n; ++i) cluster[i] = sets.find(i);
+        tree.label(cluster);
+
+        std::fill(
+            best.begin(), best.end(),
+            Edge { std::numeric_limits<double>::infinity(), no_star, no_star }
+        );
+
+        for (auto p : tree.ids())
+        {
+            tree.nearestForeign(p, cluster, best[cluster[p]]);
+        }
+
+        for (StarId i = 0; i < n; ++i)
+        {
+            auto& e = best[i];
+            if (e.u == no_star) continue;
+            if (sets.unite(e.u, e.v) != no_star) result.push_back(e);
+        }
+    }
+
+    return result;
+}
+
+}
+
+ConnectivityHierarchy::ConnectivityHierarchy(const StarMap& m) :
+    n_(m.size())
+{
+    std::vector<double> c;
+    c.reserve(3 * n_);
+    for (auto& s : m)
+    {
+        auto p = s.getCoords();
+        c.insert(c.end(), p.data(), p.data() + 3);
+    }
+
+    auto edges = spanningTree(c);
+    std::sort(edges.begin(), edges.end());
+
+    /* Kruskal reconstruction: merge clusters in order of jump length. */
+    std::size_t nodes = n_ ? 2 * n_ - 1 : 0;
+    weight2_.assign(nodes, -1.0);
+    parent_.assign(nodes, no_star);
+    left_.assign(nodes, no_star);
+    right_.assign(nodes, no_star);
+
+    DisjointSets sets(n_);
+    id_vector top(n_);
+    std::iota(top.begin(), top.end(), 0);
+
+    StarId next = n_;
+    for (auto& e : edges)
+    {
+        auto a = top[sets.find(e.u)];
+        auto b = top[sets.find(e.v)];
+
+        weight2_[next] = e.d2;
+        left_[next] = a;
+        right_[next] = b;
+        parent_[a] = parent_[b] = next;
+
+        top[sets.unite(e.u, e.v)] = next++;
+    }
+
+    /* Children always have lower ids than their parents. */
+    size_.assign(nodes, 1);
+    for (StarId v = n_; v < nodes; ++v)
+    {
+        size_[v] = 1 + size_[left_[v]] + size_[right_[v]];
+    }
+
+    depth_.assign(nodes, 0);
+    head_.assign(nodes, 0);
+    pos_.assign(nodes, 0);
+    order_.assign(nodes, 0);
+    leaf_first_.assign(nodes, 0);
+    leaves_.clear();
+    leaves_.reserve(n_);
+
+    if (nodes == 0) return;
+
+    /* Preorder, heavy child first, so every heavy chain is contiguous. */
+    id_vector stack { StarId(nodes - 1) };
+    head_[nodes - 1] = nodes - 1;
+    StarId counter = 0;
+    while (!stack.empty())
+    {
+        auto v = stack.back();
+        stack.pop_back();
+
+        pos_[v] = counter;
+        order_[counter++] = v;
+        leaf_first_[v] = leaves_.size();
+
+        if (v < n_)
+        {
+            leaves_.push_back(v);
+            continue;
+        }
+
+        auto heavy = left_[v];
+        auto light = right_[v];
+        if (size_[light] > size_[heavy]) std::swap(heavy, light);
+
+        head_[heavy] = head_[v];
+        head_[light] = light;
+        depth_[heavy] = depth_[light] = depth_[v] + 1;
+
+        stack.push_back(light);
+        stack.push_back(heavy);
+    }
+}
+
+StarId ConnectivityHierarchy::lca(StarId a, StarId b) const
+{
+    while (head_[a] != head_[b])
+    {
+        if (depth_[head_[a]] < depth_[head_[b]]) std::swap(a, b);
+        a = parent_[head_[a]];
+    }
+    return (depth_[a] < depth_[b]) ? a : b;
+}
+
+/* The highest ancestor of s reachable through jumps shorter than sqrt(t2). */
+StarId ConnectivityHierarchy::ancestor(StarId s, double t2) const
+{
+    auto v = s;
+    while (true)
+    {
+        auto h = head_[v];
+        if (weight2_[h] < t2)
+        {
+            auto p = parent_[h];
+            if (p == no_star || weight2_[p] >= t2) return h;
+            v = p;
+            continue;
+        }
+
+        /* Weights grow towards the head, so binary search the chain. */
+        auto begin = order_.begin() + pos_[h];
+        auto end = order_.begin() + pos_[v] + 1;
+        auto it = std::partition_point(
+            begin, end,
+            [this, t2](StarId u) { return weight2_[u] >= t2; }
+        );
+        return *it;
+    }
+}
+
+auto ConnectivityHierarchy::members(StarId node) const
+    -> member_range
+{
+    auto begin = leaves_.begin() + leaf_first_[node];
+    return { begin, begin + (size_[node] + 1) / 2 };
+}
+
+double ConnectivityHierarchy::bottleneck(StarId a, StarId b) const
+{
+    if (a == b) return 0.0;
+    return std::sqrt(weight2_[lca(a, b)]);
+}
+
+std::size_t ConnectivityHierarchy::componentCount(double threshold) const
+{
+    /* Merge nodes were created in order of increasing length. */
+    auto begin = weight2_.begin() + n_;
+    auto merged =
+        std::lower_bound(begin, weight2_.end(), threshold * threshold) - begin;
+    return n_ - merged;
+}
+
+auto ConnectivityHierarchy::component(StarId s, double threshold) const
+    -> member_range
+{
+    return members(ancestor(s, threshold * threshold));
+}
+
+auto ConnectivityHierarchy::components(double threshold) const
+    -> std::vector<member_range>
+{
+    std::vector<member_range> result;
+    if (n_ == 0) return result;
+
+    auto t2 = threshold * threshold;
+    id_vector stack { StarId(weight2_.size() - 1) };
+    while (!stack.empty())
+    {
+        auto v = stack.back();
+        stack.pop_back();
+
+        if (weight2_[v] < t2)
+        {
+            result.push_back(members(v));
+        }
+        else
+        {
+            stack.push_back(right_[v]);
+            stack.push_back(left_[v]);
+        }
+    }
+    return result;
+}
+
+std::size_t ConnectivityHierarchy::memoryUsage() const
+{
+    std::size_t ids =
+        parent_.capacity() + left_.capacity() + right_.capacity() +
+        size_.capacity() + depth_.capacity() + head_.capacity() +
+        pos_.capacity() + order_.capacity() + leaf_first_.capacity() +
+        leaves_.capacity();
+
+    return sizeof(*this) +
+        weight2_.capacity() * sizeof(double) +
+        ids * sizeof(StarId);
+}
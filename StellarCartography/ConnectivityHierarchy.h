@@ -0,0 +1,71 @@
+#ifndef SC_CONNECTIVITY_HIERARCHY_H
+#define SC_CONNECTIVITY_HIERARCHY_H
+
+#include "StellarCartography/StarMap.h"
+
+#include <boost/range/iterator_range.hpp>
+#include <vector>
+
+namespace StellarCartography
+{
+
+/*
+ * Connectivity of a StarMap at every jump range at once. This is the
+ * Kruskal reconstruction tree of the map's Euclidean minimum spanning tree:
+ * the leaves are stars, and each internal node is the merge of two clusters
+ * by the jump whose length it records. Lengths never decrease towards the
+ * root, so the cluster containing a star at range r is its highest ancestor
+ * whose jump is shorter than r, and the range needed to travel between two
+ * stars is the length recorded at their lowest common ancestor.
+ *
+ * As with StarMap::byDistance(), a jump is possible when its length is
+ * strictly less than the range. Queries take O(log n) time.
+ */
+class ConnectivityHierarchy
+{
+    typedef std::vector<StarId> id_vector;
+
+public:
+    typedef iterator_range<id_vector::const_iterator> member_range;
+
+    explicit ConnectivityHierarchy(const StarMap& m);
+
+    std::size_t size() const { return n_; }
+
+    /* Length of the longest jump on the best route between a and b. */
+    double bottleneck(StarId a, StarId b) const;
+
+    std::size_t componentCount(double threshold) const;
+    member_range component(StarId s, double threshold) const;
+    std::vector<member_range> components(double threshold) const;
+
+    std::size_t memoryUsage() const;
+
+private:
+    StarId lca(StarId a, StarId b) const;
+    StarId ancestor(StarId s, double t2) const;
+    member_range members(StarId node) const;
+
+    std::size_t n_;
+
+    /* Per-node tree structure; nodes [0, n) are leaves. */
+    std::vector<double> weight2_;
+    id_vector parent_;
+    id_vector left_;
+    id_vector right_;
+
+    /* Heavy-light decomposition of the tree. */
+    id_vector size_;
+    id_vector depth_;
+    id_vector head_;
+    id_vector pos_;
+    id_vector order_;
+
+    /* Leaves in preorder, so every subtree's leaves are contiguous. */
+    id_vector leaf_first_;
+    id_vector leaves_;
+};
+
+} /* namespace StellarCartography */
+
+#endif /* SC_CONNECTIVITY_HIERARCHY_H */
@@ -0,0 +1,286 @@
+#include "StellarCartography/CsvLoader.h"
+
+#include "StellarCartography/Parallel.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace StellarCartography;
+
+namespace
+{
+
+/* Chunks smaller than this aren't worth a thread. */
+const std::size_t min_chunk_bytes = 1 << 20;
+
+/* Longer numbers than this aren't coordinates. */
+const std::size_t max_number_length = 64;
+
+typedef std::pair<const char*, const char*> Field;
+
+bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+/*
+ * Parse a whole field as a finite double. strtod needs a terminated string,
+ * and the input may end without one, so the field is copied first.
+ */
+bool parseDouble(const Field& f, double& result)
+{
+    char buf[max_number_length];
+    auto begin = f.first, end = f.second;
+    while (begin != end && isBlank(end[-1])) --end;
+
+    std::size_t n = end - begin;
+    if (n == 0 || n >= sizeof(buf)) return false;
+    std::memcpy(buf, begin, n);
+    buf[n] = '\0';
+
+    char *stop;
+    result = std::strtod(buf, &stop);
+    return stop == buf + n && std::isfinite(result);
+}
+
+std::string systemError(const std::string& what, const std::string& path)
+{
+    std::ostringstream ss;
+    ss << what << " " << path << ": " << std::strerror(errno);
+    return ss.str();
+}
+
+/* A file mapped read-only for as long as this lives. */
+class MappedInput
+{
+public:
+    explicit MappedInput(const std::string& path) : base_(nullptr), size_(0)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error(systemError("Can't open", path));
+
+        struct stat st;
+        void *p = nullptr;
+        if (::fstat(fd, &st) == 0)
+        {
+            size_ = st.st_size;
+            if (size_ == 0)
+            {
+                ::close(fd);
+                return;
+            }
+            p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        }
+        if (!p || p == MAP_FAILED)
+        {
+            auto error = systemError("Can't map", path);
+            ::close(fd);
+            throw std::runtime_error(error);
+        }
+        ::close(fd);
+
+        base_ = static_cast<const char*>(p);
+        ::madvise(p, size_, MADV_SEQUENTIAL);
+    }
+
+    ~MappedInput()
+    {
+        if (base_) ::munmap(const_cast<char*>(base_), size_);
+    }
+
+    MappedInput(const MappedInput&) = delete;
+    MappedInput& operator=(const MappedInput&) = delete;
+
+    const char *begin() const { return base_; }
+    const char *end() const { return base_ + size_; }
+
+private:
+    const char *base_;
+    std::size_t size_;
+};
+
+}
+
+/*
+ * The stars and errors from part of the input. Line numbers here count
+ * from the start of the chunk, until parse() offsets them.
+ */
+struct CsvLoader::Chunk
+{
+    Chunk(const char *b, const char *e) : begin(b), end(e), lines(0) { }
+
+    const char *begin;
+    const char *end;
+    std::size_t lines;
+    std::vector<Star> stars;
+    std::vector<std::size_t> star_lines;
+    std::vector<Error> errors;
+    std::vector<Field> fields;
+};
+
+CsvLoader::CsvLoader(const std::vector<std::string>& properties) :
+    properties_(properties)
+{
+}
+
+StarMap CsvLoader::load(const std::string& path)
+{
+    MappedInput input(path);
+    return parse(input.begin(), input.end());
+}
+
+StarMap CsvLoader::parse(const std::string& text)
+{
+    return parse(text.data(), text.data() + text.size());
+}
+
+StarMap CsvLoader::parse(const char *begin, const char *end)
+{
+    errors_.clear();
+
+    std::size_t size = end - begin;
+    auto target = std::max(min_chunk_bytes, size / (4 * threadCount()) + 1);
+
+    std::vector<Chunk> chunks;
+    for (auto p = begin; p != end; )
+    {
+        auto q = end;
+        if (std::size_t(end - p) > target)
+        {
+            auto nl = std::memchr(p + target, '\n', end - p - target);
+            q = nl ? static_cast<const char*>(nl) + 1 : end;
+        }
+        chunks.emplace_back(p, q);
+        p = q;
+    }
+
+    std::mutex progress_mutex;
+    std::size_t done = 0;
+    parallelFor(chunks.size(), 1, [&](std::size_t c, std::size_t)
+    {
+        parseChunk(chunks[c]);
+        if (!progress_) return;
+
+        std::lock_guard<std::mutex> lock(progress_mutex);
+        done += chunks[c].end - chunks[c].begin;
+        progress_(done, size);
+    });
+
+    std::vector<Star> stars;
+    std::vector<std::size_t> lines;
+    std::size_t first = 1;
+    for (auto& c : chunks)
+    {
+        for (auto& e : c.errors)
+            errors_.push_back({ first + e.line, std::move(e.message) });
+        for (std::size_t i = 0; i < c.stars.size(); ++i)
+        {
+            stars.push_back(std::move(c.stars[i]));
+            lines.push_back(first + c.star_lines[i]);
+        }
+        first += c.lines;
+        c = Chunk(nullptr, nullptr);
+    }
+
+    std::vector<std::size_t> dropped;
+    StarMap result(std::move(stars), dropped);
+    for (auto i : dropped)
+    {
+        errors_.push_back({
+            lines[i],
+            "Star " + stars[i].getName() +
+                " has the name or position of another star."
+        });
+    }
+    if (!dropped.empty())
+    {
+        std::stable_sort(errors_.begin(), errors_.end(),
+            [](const Error& l, const Error& r) { return l.line < r.line; });
+    }
+
+    return result;
+}
+
+void CsvLoader::parseChunk(Chunk& chunk) const
+{
+    for (auto p = chunk.begin; p != chunk.end; ++chunk.lines)
+    {
+        auto nl = static_cast<const char*>(
+            std::memchr(p, '\n', chunk.end - p));
+        auto next = nl ? nl + 1 : chunk.end;
+        auto end = nl ? nl : chunk.end;
+
+        while (p != end && isBlank(*p)) ++p;
+        while (p != end && isBlank(end[-1])) --end;
+        if (p != end) parseLine(p, end, chunk.lines, chunk);
+
+        p = next;
+    }
+}
+
+void CsvLoader::parseLine(
+    const char *begin,
+    const char *end,
+    std::size_t line,
+    Chunk& chunk) const
+{
+    auto& fields = chunk.fields;
+    fields.clear();
+    for (auto p = begin; ; )
+    {
+        auto comma = static_cast<const char*>(std::memchr(p, ',', end - p));
+        fields.emplace_back(p, comma ? comma : end);
+        if (!comma) break;
+        p = comma + 1;
+    }
+
+    auto fail = [&](const std::string& message)
+    {
+        chunk.errors.push_back({ line, message });
+    };
+
+    /* Fields past the last property are ignored. */
+    auto expected = 4 + properties_.size();
+    if (fields.size() < expected)
+    {
+        std::ostringstream ss;
+        ss << "Expected " << expected << " fields but found "
+           << fields.size() << ".";
+        return fail(ss.str());
+    }
+    if (fields[0].first == fields[0].second) return fail("Missing name.");
+
+    double xyz[3];
+    for (int d = 0; d < 3; ++d)
+    {
+        if (!parseDouble(fields[d + 1], xyz[d]))
+        {
+            return fail(
+                "Bad coordinate: " +
+                std::string(fields[d + 1].first, fields[d + 1].second));
+        }
+    }
+
+    Star s(
+        std::string(fields[0].first, fields[0].second),
+        Coordinate(xyz[0], xyz[1], xyz[2])
+    );
+    for (std::size_t i = 0; i < properties_.size(); ++i)
+    {
+        auto& f = fields[i + 4];
+        s.setProperty(properties_[i], std::string(f.first, f.second));
+    }
+
+    chunk.stars.push_back(std::move(s));
+    chunk.star_lines.push_back(line);
+}
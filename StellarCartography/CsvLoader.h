@@ -0,0 +1,69 @@
+#ifndef SC_CSV_LOADER_H
+#define SC_CSV_LOADER_H
+
+#include "StellarCartography/StarMap.h"
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace StellarCartography
+{
+
+/*
+ * Reads stars from CSV, one per line: the name, x, y and z, and then a value
+ * for each of the property columns. Any further fields are ignored. Input is
+ * split into chunks at line breaks and the chunks are parsed in parallel.
+ * Blank lines are skipped.
+ * Lines that can't be parsed, and stars with the name or position of an
+ * earlier star, are left out of the map and reported in errors().
+ */
+class CsvLoader
+{
+public:
+    struct Error
+    {
+        std::size_t line;       /* Counting from 1. */
+        std::string message;
+    };
+
+    /*
+     * Called as parsing goes with the number of bytes parsed so far and the
+     * size of the input. It's called from the parsing threads, but never
+     * from two at once.
+     */
+    typedef std::function<void (std::size_t done, std::size_t total)>
+        Progress;
+
+    explicit CsvLoader(
+        const std::vector<std::string>& properties =
+            std::vector<std::string>());
+
+    /* Map a file and parse it. Throws std::runtime_error if unreadable. */
+    StarMap load(const std::string& path);
+    StarMap parse(const char *begin, const char *end);
+    StarMap parse(const std::string& text);
+
+    const std::vector<Error>& errors() const { return errors_; }
+
+    void setProgress(Progress progress) { progress_ = progress; }
+
+private:
+    struct Chunk;
+
+    void parseChunk(Chunk& chunk) const;
+    void parseLine(
+        const char *begin, 
+        const char *end, 
+        std::size_t line, 
+        Chunk& chunk) const;
+
+    std::vector<std::string> properties_;
+    std::vector<Error> errors_;
+    Progress progress_;
+};
+
+} /* namespace StellarCartography */
+
+#endif /* SC_CSV_LOADER_H */
@@ -0,0 +1,210 @@
+#include "StellarCartography/MapFile.h"
+
+#include <cerrno>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace StellarCartography;
+
+namespace
+{
+
+const char magic[8] = { 'S', 'C', 'M', 'A', 'P', '\r', '\n', '\0' };
+const std::uint32_t byte_order = 0x01020304;
+const std::size_t alignment = 8;
+
+struct Header
+{
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order;
+    std::uint64_t stars;
+    std::uint64_t table_offset;
+    std::uint64_t table_size;
+};
+
+struct TableEntry
+{
+    std::uint32_t kind;
+    std::uint32_t reserved;
+    std::uint64_t offset;
+    std::uint64_t size;
+};
+
+std::string systemError(const std::string& what, const std::string& path)
+{
+    std::ostringstream ss;
+    ss << what << " " << path << ": " << std::strerror(errno);
+    return ss.str();
+}
+
+}
+
+MapFile::MapFile(const std::string& path) :
+    path_(path), base_(nullptr), size_(0), stars_(0)
+{
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error(systemError("Can't open", path));
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0)
+    {
+        auto error = systemError("Can't stat", path);
+        ::close(fd);
+        throw std::runtime_error(error);
+    }
+    size_ = st.st_size;
+
+    if (size_ >= sizeof(Header))
+    {
+        /* The mapping outlives the descriptor. */
+        void *p = ::mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+        {
+            auto error = systemError("Can't map", path);
+            ::close(fd);
+            throw std::runtime_error(error);
+        }
+        base_ = static_cast<const char*>(p);
+    }
+    ::close(fd);
+
+    if (!base_) fail("too short for a header");
+
+    Header h;
+    std::memcpy(&h, base_, sizeof(h));
+    if (std::memcmp(h.magic, magic, sizeof(magic)) != 0)
+        fail("not a map file");
+    if (h.byte_order != byte_order)
+        fail("written with a different byte order");
+    if (h.version != version)
+    {
+        std::ostringstream ss;
+        ss << "unsupported version " << h.version;
+        fail(ss.str());
+    }
+    if (h.table_offset > size_ ||
+        h.table_size > (size_ - h.table_offset) / sizeof(TableEntry))
+    {
+        fail("section table out of bounds");
+    }
+    stars_ = h.stars;
+
+    for (std::size_t i = 0; i < h.table_size; ++i)
+    {
+        TableEntry e;
+        std::memcpy(
+            &e, base_ + h.table_offset + i * sizeof(TableEntry), sizeof(e));
+        if (e.offset % alignment || e.offset > size_ ||
+            e.size > size_ - e.offset)
+        {
+            fail("section out of bounds");
+        }
+        sections_.push_back({
+            static_cast<Section>(e.kind),
+            { base_ + e.offset, static_cast<std::size_t>(e.size) }
+        });
+    }
+}
+
+MapFile::~MapFile()
+{
+    if (base_) ::munmap(const_cast<char*>(base_), size_);
+}
+
+void MapFile::fail(const std::string& why) const
+{
+    if (base_) ::munmap(const_cast<char*>(base_), size_);
+
+    std::ostringstream ss;
+    ss << "Invalid map file " << path_ << ": " << why;
+    throw std::runtime_error(ss.str());
+}
+
+auto MapFile::section(Section kind) const
+    -> Blob
+{
+    for (auto& e : sections_)
+    {
+        if (e.kind == kind) return e.blob;
+    }
+    return { nullptr, 0 };
+}
+
+auto MapFile::sections(Section kind) const
+    -> std::vector<Blob>
+{
+    std::vector<Blob> result;
+    for (auto& e : sections_)
+    {
+        if (e.kind == kind) result.push_back(e.blob);
+    }
+    return result;
+}
+
+MapFileWriter::MapFileWriter(const std::string& path, std::size_t stars) :
+    path_(path),
+    os_(path, std::ios::binary | std::ios::trunc),
+    stars_(stars)
+{
+    if (!os_) throw std::runtime_error(systemError("Can't create", path));
+
+    /* Filled in by close(). */
+    Header h = Header();
+    os_.write(reinterpret_cast<const char*>(&h), sizeof(h));
+}
+
+void MapFileWriter::begin(MapFile::Section kind)
+{
+    pad();
+    table_.push_back({
+        static_cast<std::uint32_t>(kind),
+        0,
+        static_cast<std::uint64_t>(os_.tellp()),
+        0
+    });
+}
+
+void MapFileWriter::write(const void *data, std::size_t size)
+{
+    os_.write(static_cast<const char*>(data), size);
+}
+
+void MapFileWriter::end()
+{
+    auto& e = table_.back();
+    e.size = static_cast<std::uint64_t>(os_.tellp()) - e.offset;
+}
+
+void MapFileWriter::close()
+{
+    pad();
+
+    Header h;
+    std::memcpy(h.magic, magic, sizeof(magic));
+    h.version = MapFile::version;
+    h.byte_order = byte_order;
+    h.stars = stars_;
+    h.table_offset = os_.tellp();
+    h.table_size = table_.size();
+    static_assert(sizeof(Entry) == sizeof(TableEntry), "Table layout");
+
+    write(table_.data(), table_.size() * sizeof(Entry));
+    os_.seekp(0);
+    write(&h, sizeof(h));
+    os_.close();
+
+    if (!os_) throw std::runtime_error(systemError("Can't write", path_));
+}
+
+void MapFileWriter::pad()
+{
+    static const char zeros[alignment] = { };
+    auto misalignment = static_cast<std::size_t>(os_.tellp()) % alignment;
+    if (misalignment) write(zeros, alignment - misalignment);
+}
@@ -0,0 +1,120 @@
+#ifndef SC_MAP_FILE_H
+#define SC_MAP_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+namespace StellarCartography
+{
+
+/*
+ * A star map saved in binary. The file starts with a fixed header and ends
+ * with a table of sections, each of which starts on an 8-byte boundary so
+ * that it can be read in place once the file is mapped. StarMap checks and
+ * copies the sections rather than keeping the mapping:
+ *
+ *   Coordinates   x, y and z of each star as doubles.
+ *   Names         A string table of star names.
+ *   Properties    A string table of key\0value\0 runs, one per star.
+ *   SpatialIndex  The kd-tree, as serialized by FLANN.
+ *   Adjacency     A threshold graph in compressed sparse row form. There
+ *                 may be any number of these.
+ *
+ * A string table is star count + 1 offsets, as uint64_t, into the bytes
+ * that follow them. Everything is in the byte order of the machine that
+ * wrote the file; a file from a machine of the other order is rejected.
+ */
+class MapFile
+{
+public:
+    enum class Section : std::uint32_t
+    {
+        Coordinates = 1,
+        Names = 2,
+        Properties = 3,
+        SpatialIndex = 4,
+        Adjacency = 5
+    };
+
+    struct Blob
+    {
+        const char *data;
+        std::size_t size;
+    };
+
+    static const std::uint32_t version = 1;
+
+    /* Map a file read-only. Throws std::runtime_error if it isn't valid. */
+    explicit MapFile(const std::string& path);
+    ~MapFile();
+
+    MapFile(const MapFile&) = delete;
+    MapFile& operator=(const MapFile&) = delete;
+
+    const std::string& path() const { return path_; }
+    std::size_t starCount() const { return stars_; }
+
+    /* The first section of a kind, or an empty blob if there is none. */
+    Blob section(Section kind) const;
+    std::vector<Blob> sections(Section kind) const;
+
+private:
+    struct Entry
+    {
+        Section kind;
+        Blob blob;
+    };
+
+    void fail(const std::string& why) const;
+
+    std::string path_;
+    const char *base_;
+    std::size_t size_;
+    std::size_t stars_;
+    std::vector<Entry> sections_;
+};
+
+/*
+ * Writes a MapFile one section at a time. Sections are streamed straight
+ * to disk, and the table is written by close().
+ */
+class MapFileWriter
+{
+public:
+    MapFileWriter(const std::string& path, std::size_t stars);
+
+    void begin(MapFile::Section kind);
+    void write(const void *data, std::size_t size);
+    void end();
+
+    template<class T>
+    void write(const std::vector<T>& v)
+    {
+        write(v.data(), v.size() * sizeof(T));
+    }
+
+    void close();
+
+private:
+    void pad();
+
+    struct Entry
+    {
+        std::uint32_t kind;
+        std::uint32_t reserved;
+        std::uint64_t offset;
+        std::uint64_t size;
+    };
+
+    std::string path_;
+    std::ofstream os_;
+    std::size_t stars_;
+    std::vector<Entry> table_;
+};
+
+} /* namespace StellarCartography */
+
+#endif /* SC_MAP_FILE_H */
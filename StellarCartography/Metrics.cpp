@@ -0,0 +1,242 @@
+#include "StellarCartography/Metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <stdexcept>
+
+using namespace StellarCartography;
+using namespace StellarCartography::Metrics;
+
+std::uint64_t HistogramValue::quantile(double p) const
+{
+    if (count == 0) return 0;
+
+    auto rank = std::min(
+        std::uint64_t(std::max(0.0, std::min(p, 1.0)) * count), count - 1);
+    std::uint64_t seen = 0;
+    for (std::size_t b = 0; b < histogram_buckets; ++b)
+    {
+        if (seen + buckets[b] <= rank)
+        {
+            seen += buckets[b];
+            continue;
+        }
+        if (b == 0) return 0;
+
+        /* Spread the bucket's values evenly over [2^(b-1), 2^b). */
+        auto low = std::uint64_t(1) << (b - 1);
+        return low + std::uint64_t(low * (rank - seen + 0.5) / buckets[b]);
+    }
+    return 0;
+}
+
+#ifdef SC_METRICS
+
+namespace
+{
+
+/* Metrics are declared in the library, so there's a known number of them. */
+const std::size_t max_counters = 64;
+const std::size_t max_histograms = 32;
+
+template<class T>
+struct Totals
+{
+    struct Histogram
+    {
+        T count;
+        T sum;
+        std::array<T, histogram_buckets> buckets;
+    };
+
+    std::array<T, max_counters> counters;
+    std::array<Histogram, max_histograms> histograms;
+};
+
+/*
+ * One thread's metrics. Only the thread itself writes them, so an update is
+ * a relaxed load and store rather than a locked add, and snapshots read
+ * them concurrently.
+ */
+struct ThreadTotals : Totals<std::atomic<std::uint64_t>>
+{
+    ThreadTotals();
+    ~ThreadTotals();
+
+    static void bump(std::atomic<std::uint64_t>& a, std::uint64_t n)
+    {
+        a.store(a.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+    }
+};
+
+typedef Totals<std::uint64_t> Sums;
+
+void add(Sums& to, const ThreadTotals& from)
+{
+    for (std::size_t i = 0; i < max_counters; ++i)
+        to.counters[i] += from.counters[i].load(std::memory_order_relaxed);
+
+    for (std::size_t i = 0; i < max_histograms; ++i)
+    {
+        auto& h = to.histograms[i];
+        auto& f = from.histograms[i];
+        h.count += f.count.load(std::memory_order_relaxed);
+        h.sum += f.sum.load(std::memory_order_relaxed);
+        for (std::size_t b = 0; b < histogram_buckets; ++b)
+            h.buckets[b] += f.buckets[b].load(std::memory_order_relaxed);
+    }
+}
+
+/* Names of the metrics and the threads that are updating them. */
+struct Registry
+{
+    Registry() : retired(), baseline() { }
+
+    std::mutex mutex;
+    std::vector<const char*> counters;
+    std::vector<std::pair<const char*, const char*>> histograms;
+    std::vector<ThreadTotals*> threads;
+
+    /* Totals of exited threads, and of everything at the last reset. */
+    Sums retired;
+    Sums baseline;
+
+    Sums total()
+    {
+        Sums result = retired;
+        for (auto t : threads) add(result, *t);
+        return result;
+    }
+};
+
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+ThreadTotals::ThreadTotals()
+{
+    for (auto& c : counters) c.store(0, std::memory_order_relaxed);
+    for (auto& h : histograms)
+    {
+        h.count.store(0, std::memory_order_relaxed);
+        h.sum.store(0, std::memory_order_relaxed);
+        for (auto& b : h.buckets) b.store(0, std::memory_order_relaxed);
+    }
+
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.threads.push_back(this);
+}
+
+ThreadTotals::~ThreadTotals()
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    add(r.retired, *this);
+    r.threads.erase(std::find(r.threads.begin(), r.threads.end(), this));
+}
+
+ThreadTotals& local()
+{
+    static thread_local ThreadTotals totals;
+    return totals;
+}
+
+std::size_t bucket(std::uint64_t value)
+{
+    return value ? 64 - __builtin_clzll(value) - (value >> 63) : 0;
+}
+
+}
+
+void Counter::add(std::uint64_t n)
+{
+    auto id = id_.load(std::memory_order_acquire);
+    if (id < 0)
+    {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        id = id_.load(std::memory_order_relaxed);
+        if (id < 0)
+        {
+            if (r.counters.size() == max_counters)
+                throw std::length_error("Too many counters");
+            id = r.counters.size();
+            r.counters.push_back(name_);
+            id_.store(id, std::memory_order_release);
+        }
+    }
+    ThreadTotals::bump(local().counters[id], n);
+}
+
+void Histogram::record(std::uint64_t value)
+{
+    auto id = id_.load(std::memory_order_acquire);
+    if (id < 0)
+    {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        id = id_.load(std::memory_order_relaxed);
+        if (id < 0)
+        {
+            if (r.histograms.size() == max_histograms)
+                throw std::length_error("Too many histograms");
+            id = r.histograms.size();
+            r.histograms.emplace_back(name_, unit_);
+            id_.store(id, std::memory_order_release);
+        }
+    }
+
+    auto& h = local().histograms[id];
+    ThreadTotals::bump(h.count, 1);
+    ThreadTotals::bump(h.sum, value);
+    ThreadTotals::bump(h.buckets[bucket(value)], 1);
+}
+
+Snapshot Metrics::snapshot()
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    auto sums = r.total();
+
+    Snapshot result;
+    for (std::size_t i = 0; i < r.counters.size(); ++i)
+    {
+        result.counters.push_back({
+            r.counters[i], sums.counters[i] - r.baseline.counters[i]
+        });
+    }
+
+    for (std::size_t i = 0; i < r.histograms.size(); ++i)
+    {
+        auto& h = sums.histograms[i];
+        auto& base = r.baseline.histograms[i];
+
+        HistogramValue v;
+        v.name = r.histograms[i].first;
+        v.unit = r.histograms[i].second;
+        v.count = h.count - base.count;
+        v.sum = h.sum - base.sum;
+        for (std::size_t b = 0; b < histogram_buckets; ++b)
+            v.buckets[b] = h.buckets[b] - base.buckets[b];
+        result.histograms.push_back(v);
+    }
+    return result;
+}
+
+/*
+ * Threads own their totals, so rather than clearing them, remember where
+ * they stand and report changes from there.
+ */
+void Metrics::reset()
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.baseline = r.total();
+}
+
+#endif /* SC_METRICS */
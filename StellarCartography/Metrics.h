@@ -0,0 +1,152 @@
+#ifndef SC_METRICS_H
+#define SC_METRICS_H
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace StellarCartography
+{
+
+/*
+ * Counters and histograms on the library's hot paths. Each thread updates
+ * its own copy of every metric, with no locks or shared cache lines, and a
+ * snapshot adds up the copies of running threads and of threads that have
+ * exited. Metrics are declared once, at namespace scope, where they're used.
+ * They're constant-initialized, so they work during static initialization,
+ * and register themselves when first updated.
+ *
+ * Without SC_METRICS defined, this all compiles away: updates are empty
+ * inline functions, and snapshots are empty.
+ */
+namespace Metrics
+{
+
+/* Bucket 0 counts zeros, and bucket b counts values in [2^(b-1), 2^b). */
+const std::size_t histogram_buckets = 64;
+
+struct CounterValue
+{
+    std::string name;
+    std::uint64_t value;
+};
+
+struct HistogramValue
+{
+    std::string name;
+    std::string unit;
+    std::uint64_t count;
+    std::uint64_t sum;
+    std::array<std::uint64_t, histogram_buckets> buckets;
+
+    double mean() const { return count ? double(sum) / count : 0.0; }
+
+    /*
+     * An estimate of the pth quantile, 0 <= p <= 1, interpolated by rank
+     * within the bucket that holds it, so within a factor of two.
+     */
+    std::uint64_t quantile(double p) const;
+};
+
+struct Snapshot
+{
+    std::vector<CounterValue> counters;
+    std::vector<HistogramValue> histograms;
+};
+
+#ifdef SC_METRICS
+
+inline bool enabled() { return true; }
+
+/* Every metric's total since the last reset(). */
+Snapshot snapshot();
+void reset();
+
+class Counter
+{
+public:
+    constexpr explicit Counter(const char *name) : name_(name), id_(-1) { }
+    void add(std::uint64_t n = 1);
+
+private:
+    const char *name_;
+    std::atomic<int> id_;
+};
+
+class Histogram
+{
+public:
+    constexpr Histogram(const char *name, const char *unit) :
+        name_(name), unit_(unit), id_(-1)
+    {
+    }
+
+    void record(std::uint64_t value);
+
+private:
+    const char *name_;
+    const char *unit_;
+    std::atomic<int> id_;
+};
+
+/* Records the nanoseconds until it's destroyed. */
+class Timer
+{
+public:
+    explicit Timer(Histogram& h) :
+        histogram_(h), start_(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~Timer()
+    {
+        histogram_.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start_).count());
+    }
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
+private:
+    Histogram& histogram_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+#else
+
+inline bool enabled() { return false; }
+inline Snapshot snapshot() { return Snapshot(); }
+inline void reset() { }
+
+class Counter
+{
+public:
+    constexpr explicit Counter(const char *) { }
+    void add(std::uint64_t = 1) { }
+};
+
+class Histogram
+{
+public:
+    constexpr Histogram(const char *, const char *) { }
+    void record(std::uint64_t) { }
+};
+
+class Timer
+{
+public:
+    explicit Timer(Histogram&) { }
+};
+
+#endif /* SC_METRICS */
+
+} /* namespace Metrics */
+
+} /* namespace StellarCartography */
+
+#endif /* SC_METRICS_H */
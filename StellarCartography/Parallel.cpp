@@ -0,0 +1,21 @@
+#include "StellarCartography/Parallel.h"
+
+using namespace StellarCartography;
+
+namespace
+{
+
+std::atomic<std::size_t> thread_count(0);
+
+}
+
+std::size_t StellarCartography::threadCount()
+{
+    if (auto n = thread_count.load()) return n;
+    return std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+}
+
+void StellarCartography::setThreadCount(std::size_t n)
+{
+    thread_count = n;
+}
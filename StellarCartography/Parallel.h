@@ -0,0 +1,73 @@
+#ifndef SC_PARALLEL_H
+#define SC_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <thread>
+#include <vector>
+
+namespace StellarCartography
+{
+
+/*
+ * Number of worker threads used by the library's parallel algorithms. 
+ * Defaults to the number of hardware threads; 0 restores the default.
+ */
+std::size_t threadCount();
+void setThreadCount(std::size_t n);
+
+/*
+ * Call f(begin, end) on consecutive chunks of [0, n), each at most grain
+ * long, from up to threadCount() threads. Chunks are handed out on demand
+ * so uneven work still balances. The calling thread takes part, and the
+ * first exception thrown by f is rethrown once all threads are done.
+ */
+template<class F>
+void parallelFor(std::size_t n, std::size_t grain, F f)
+{
+    grain = std::max<std::size_t>(grain, 1);
+    auto chunks = (n + grain - 1) / grain;
+    auto threads = std::min(threadCount(), chunks);
+
+    if (threads <= 1)
+    {
+        for (std::size_t b = 0; b < n; b += grain) f(b, std::min(b + grain, n));
+        return;
+    }
+
+    std::atomic<std::size_t> next(0);
+    std::vector<std::exception_ptr> errors(threads);
+
+    auto worker = [&](std::size_t t)
+    {
+        try
+        {
+            for (auto c = next++; c < chunks; c = next++)
+            {
+                f(c * grain, std::min(c * grain + grain, n));
+            }
+        }
+        catch (...)
+        {
+            errors[t] = std::current_exception();
+            next = chunks;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    pool.reserve(threads - 1);
+    for (std::size_t t = 1; t < threads; ++t) pool.emplace_back(worker, t);
+    worker(0);
+    for (auto& t : pool) t.join();
+
+    for (auto& e : errors)
+    {
+        if (e) std::rethrow_exception(e);
+    }
+}
+
+} /* namespace StellarCartography */
+
+#endif /* SC_PARALLEL_H */
@@ -1,10 +1,22 @@
 #include "StellarCartography/StarMap.h"
 
+#include "StellarCartography/ConnectivityHierarchy.h"
+#include "StellarCartography/Metrics.h"
+#include "StellarCartography/Parallel.h"
+#include "StellarCartography/Trace.h"
+#include "StellarCartography/UniformGrid.h"
+
 #include <boost/concept_check.hpp>
 #include <boost/graph/graph_concepts.hpp>
 #include <boost/graph/breadth_first_search.hpp>
 #include <boost/graph/connected_components.hpp>
 #include <boost/property_map/property_map.hpp>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <numeric>
+#include <queue>
 
 using namespace StellarCartography;
 using namespace boost;
@@ -12,6 +24,18 @@ using namespace boost;
 namespace
 {
 
+Metrics::Histogram tree_build_time("spatial.tree_build", "ns");
+Metrics::Counter radius_queries("spatial.radius_queries");
+Metrics::Histogram radius_hits("spatial.radius_hits", "stars");
+Metrics::Histogram index_build_time("graph.index_build", "ns");
+Metrics::Histogram index_derive_time("graph.index_derive", "ns");
+Metrics::Counter cache_hits("graph.cache_hits");
+Metrics::Counter cache_misses("graph.cache_misses");
+Metrics::Histogram path_visited("search.path_visited", "stars");
+Metrics::Histogram shortest_path_visited(
+    "search.shortest_path_visited", "stars");
+Metrics::Histogram reachable_visited("search.reachable_visited", "stars");
+
 void concept_check [[gnu::unused]]() 
 {
     std::vector<Star> v;
@@ -66,27 +90,157 @@ flann::Matrix<double> toMatrix(const Coordinate *c)
     return flann::Matrix<double>(const_cast<double*>(c->data()), 1, 3);
 }
 
+/* Stars per unit of parallel work when building a dist_index. */
+const std::size_t rows_per_chunk = 1024;
+
+/* Same evaluation order as flann::L2, so results agree exactly. */
+double distanceSquared(const double *p, const double *q)
+{
+    double d = 0.0;
+    for (int i = 0; i < 3; ++i) d += (p[i] - q[i]) * (p[i] - q[i]);
+    return d;
+}
+
+/* 
+ * FLANN takes the search radius as a float. Round it up so that nothing 
+ * within the exact threshold is lost, and filter the results on the double.
+ */
+float searchRadius(double t2)
+{
+    float r = t2;
+    return (r < t2) ? 
+        std::nextafter(r, std::numeric_limits<float>::infinity()) : r;
+}
+
+/* Pack query points into rows for FLANN. */
+std::vector<double> pack(
+    const std::vector<double>& storage, 
+    const std::vector<StarId>& ids)
+{
+    std::vector<double> result;
+    result.reserve(3 * ids.size());
+    for (auto id : ids)
+    {
+        if (3 * std::size_t(id) >= storage.size())
+        {
+            std::ostringstream ss;
+            ss << "Star " << id << " not in graph.";
+            throw std::invalid_argument(ss.str());
+        }
+        result.insert(result.end(), &storage[3 * id], &storage[3 * id + 3]);
+    }
+    return result;
+}
+
+std::vector<double> pack(const std::vector<Coordinate>& coords)
+{
+    std::vector<double> result;
+    result.reserve(3 * coords.size());
+    for (auto& c : coords) result.insert(result.end(), c.data(), c.data() + 3);
+    return result;
+}
+
+void corrupt(const std::string& what)
+{
+    throw std::runtime_error("Corrupt map file: " + what);
+}
+
+/* A MapFile string table, checked when opened. */
+class StringTable
+{
+public:
+    StringTable(const MapFile::Blob& blob, std::size_t n) : 
+        offsets_(reinterpret_cast<const std::uint64_t*>(blob.data))
+    {
+        /* Divide rather than multiply, so a huge count can't overflow. */
+        if (n >= blob.size / sizeof(std::uint64_t)) 
+            corrupt("string table too short");
+        auto header = (n + 1) * sizeof(std::uint64_t);
+
+        bytes_ = blob.data + header;
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            if (offsets_[i] > offsets_[i + 1]) corrupt("string table order");
+        }
+        if (offsets_[0] != 0 || offsets_[n] != blob.size - header)
+            corrupt("string table size");
+    }
+
+    const char *begin(std::size_t i) const { return bytes_ + offsets_[i]; }
+    const char *end(std::size_t i) const { return bytes_ + offsets_[i + 1]; }
+
+private:
+    const std::uint64_t *offsets_;
+    const char *bytes_;
+};
+
+/* The start of the nul-terminated field after the one at p. */
+const char *skipField(const char *p, const char *end)
+{
+    auto nul = static_cast<const char*>(std::memchr(p, 0, end - p));
+    if (!nul) corrupt("unterminated field");
+    return nul + 1;
+}
+
+/* Write a string table of f(i) for the first n of something. */
+template<class F>
+void writeStrings(MapFileWriter& out, std::size_t n, F f)
+{
+    std::vector<std::uint64_t> offsets(1, 0);
+    offsets.reserve(n + 1);
+    for (std::size_t i = 0; i < n; ++i) 
+        offsets.push_back(offsets.back() + f(i).size());
+    out.write(offsets);
+    for (std::size_t i = 0; i < n; ++i) 
+    {
+        auto s = f(i);
+        out.write(s.data(), s.size());
+    }
+}
+
+/* The fixed part of an adjacency section. */
+struct GraphHeader
+{
+    double t2;
+    std::uint64_t stars;
+    std::uint64_t entries;
+    std::uint32_t lengths;
+    std::uint32_t reserved;
+};
+
 }
 
+/*
+ * One edit, as needed to patch the threshold graphs. Ids are those after 
+ * the edit, except that erased and last are from before it: star erased was
+ * removed, and star last took its id. The dirty stars, sorted by id, are the
+ * ones whose position or id changed.
+ */
+struct StarMap::Edit
+{
+    StarId erased;
+    StarId last;
+    std::vector<StarId> dirty;
+};
+
 StarMap::StarMap() : 
-    StarMap((Star*)nullptr, (Star*)nullptr)
+    data_(emptyData()),
+    backend_(SpatialBackend::KdTree)
 {
 }
 
+/* Copies share everything until one of them is edited. */
 StarMap::StarMap(const StarMap& m) : 
-    stars_(m.stars_),
-    spatial_storage_(m.spatial_storage_),
-    spatial_index_(initIndex()),
-    dist_index_cache_(m.dist_index_cache_)
+    data_(m.data_),
+    backend_(m.backend_)
 {
 }
 
 StarMap::StarMap(StarMap&& m) : 
-    stars_(std::move(m.stars_)),
-    spatial_storage_(std::move(m.spatial_storage_)),
-    spatial_index_(initIndex()),
-    dist_index_cache_(std::move(m.dist_index_cache_))
+    data_(std::move(m.data_)),
+    backend_(m.backend_)
 {
+    m.data_ = emptyData();
 }
 
 StarMap::StarMap(const std::initializer_list<Star>& l) :
@@ -95,97 +249,1088 @@ StarMap::StarMap(const std::initializer_list<Star>& l) :
 
 }
 
-StarMap& StarMap::operator=(const StarMap& m) 
+StarMap::StarMap(const MapFile& file) : 
+    data_(std::make_shared<Data>(file)),
+    backend_(SpatialBackend::KdTree)
+{
+    for (auto& saved : file.sections(MapFile::Section::Adjacency))
+    {
+        auto g = std::make_shared<dist_index>(saved, this);
+        data_->dist_indexes.insert(g->thresholdSquared(), g);
+    }
+}
+
+StarMap::StarMap(
+    std::vector<Star>&& stars,
+    std::vector<std::size_t>& dropped) :
+    data_(std::make_shared<Data>(std::move(stars), dropped)),
+    backend_(SpatialBackend::KdTree)
+{
+}
+
+StarMap& StarMap::operator=(const StarMap& m) 
+{
+    if (&m != this)
+        *this = std::move(StarMap(m));
+    return *this;
+}
+
+StarMap& StarMap::operator=(StarMap&& m)
+{
+    std::swap(data_, m.data_);
+    backend_ = m.backend_;
+    m.data_ = emptyData();
+
+    return *this;
+}
+
+/* Empty maps all share one, which any edit will clone. */
+auto StarMap::emptyData()
+    -> std::shared_ptr<Data>
+{
+    static auto empty = std::make_shared<Data>((Star*)nullptr, (Star*)nullptr);
+    return empty;
+}
+
+StarMap::SpatialTree::SpatialTree(coords_ptr c) :
+    coords(c),
+    index(
+        matrix_type(const_cast<double*>(c->data()), c->size() / 3, 3),
+        flann::KDTreeSingleIndexParams(10, true)
+    )
+{
+    Trace::Scope scope("SpatialTree::build");
+    Metrics::Timer timer(tree_build_time);
+    if (!c->empty()) index.buildIndex();
+}
+
+StarMap::SpatialTree::SpatialTree(coords_ptr c, const MapFile::Blob& saved) :
+    coords(c),
+    index(
+        matrix_type(const_cast<double*>(c->data()), c->size() / 3, 3),
+        flann::KDTreeSingleIndexParams(10, true)
+    )
+{
+    FILE *stream = fmemopen(const_cast<char*>(saved.data), saved.size, "rb");
+    if (!stream) corrupt("can't read kd-tree");
+
+    try
+    {
+        index.loadIndex(stream);
+    }
+    catch (...)
+    {
+        std::fclose(stream);
+        throw;
+    }
+    std::fclose(stream);
+
+    if (index.size() != c->size() / 3) corrupt("kd-tree size");
+}
+
+/* 
+ * Stars are copied out of the file, but the kd-tree only has to be read
+ * rather than built.
+ */
+StarMap::Data::Data(const MapFile& file) : grid_t2(0)
+{
+    Trace::Scope scope("StarMap::load");
+    typedef MapFile::Section Section;
+
+    auto n = file.starCount();
+    auto xyz = file.section(Section::Coordinates);
+    if (n > xyz.size / (3 * sizeof(double)) || 
+        xyz.size != 3 * n * sizeof(double))
+    {
+        corrupt("coordinates size");
+    }
+
+    auto p = reinterpret_cast<const double*>(xyz.data);
+    coords = std::make_shared<spatial_storage_type>(p, p + 3 * n);
+
+    StringTable names(file.section(Section::Names), n);
+    StringTable properties(file.section(Section::Properties), n);
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        Star s(
+            std::string(names.begin(i), names.end(i)), 
+            Coordinate(p[3 * i], p[3 * i + 1], p[3 * i + 2])
+        );
+
+        /* Keys and values alternate. */
+        auto end = properties.end(i);
+        for (auto k = properties.begin(i); k != end; )
+        {
+            auto v = skipField(k, end);
+            auto next = skipField(v, end);
+            s.setProperty(std::string(k, v - 1), std::string(v, next - 1));
+            k = next;
+        }
+
+        if (!stars.push_back(s).second) corrupt("duplicate star");
+    }
+
+    auto index = file.section(Section::SpatialIndex);
+    spatial = std::make_shared<SpatialState>(
+        index.size ? 
+            std::make_shared<SpatialTree>(coords, index) : 
+            std::make_shared<SpatialTree>(coords)
+    );
+}
+
+/* A star that fails to go in isn't moved from. */
+StarMap::Data::Data(
+    std::vector<Star>&& in,
+    std::vector<std::size_t>& dropped) :
+    grid_t2(0)
+{
+    Trace::Scope scope("StarMap::StarMap");
+    for (std::size_t i = 0; i < in.size(); ++i)
+    {
+        if (!stars.push_back(std::move(in[i])).second) dropped.push_back(i);
+    }
+
+    coords = std::make_shared<spatial_storage_type>(
+        initSpatialStorage(stars.begin(), stars.end()));
+    spatial = std::make_shared<SpatialState>(
+        std::make_shared<SpatialTree>(coords));
+}
+
+/*
+ * Call f(i, hits) for each of n packed query points, where hits holds every
+ * star closer than sqrt(t2) to query i along with its squared distance. The
+ * grid is used if given; otherwise all n rows go to the kd-tree at once, and 
+ * then to any stars added since it was built.
+ */
+template<class F>
+void StarMap::radiusSearch(
+    const double *queries, 
+    std::size_t n, 
+    double t2, 
+    const UniformGrid *grid,
+    F f) const
+{
+    hit_list hits;
+    std::vector<std::vector<int>> idx;
+    std::vector<std::vector<double>> dists;
+
+    auto state = spatial();
+    auto& p = state->pending;
+    auto tree_size = p.detached ? p.ids.size() : size();
+    radius_queries.add(n);
+
+    if (!grid && n > 0 && tree_size > 0)
+    {
+        flann::SearchParams params;
+        params.sorted = false;
+
+        state->tree->index.radiusSearch(
+            matrix_type(const_cast<double*>(queries), n, 3),
+            idx,
+            dists,
+            searchRadius(t2),
+            params
+        );
+    }
+
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto q = queries + 3 * i;
+
+        hits.clear();
+        if (grid)
+        {
+            grid->near(q, t2, [&hits](StarId v, double d2)
+            {
+                hits.emplace_back(v, d2);
+            });
+            radius_hits.record(hits.size());
+            f(i, hits);
+            continue;
+        }
+
+        for (std::size_t j = 0; !idx.empty() && j < idx[i].size(); ++j)
+        {
+            StarId v = p.detached ? p.ids[idx[i][j]] : idx[i][j];
+            if (v != null_vertex() && dists[i][j] < t2) 
+                hits.emplace_back(v, dists[i][j]);
+        }
+        for (auto v : p.added)
+        {
+            auto d2 = distanceSquared(q, &(*data_->coords)[3 * v]);
+            if (d2 < t2) hits.emplace_back(v, d2);
+        }
+        radius_hits.record(hits.size());
+        f(i, hits);
+    }
+}
+
+StarMap::dist_index::dist_index(double t2, const StarMap *m, bool lengths) :
+    t2_(t2)
+{
+    Trace::Scope scope("dist_index::init");
+    Metrics::Timer timer(index_build_time);
+    init(*m, lengths);
+}
+
+void StarMap::dist_index::init(const StarMap& m, bool lengths)
+{
+    /* 
+     * Rows are independent, so stars are searched in parallel chunks that
+     * each collect their rows in their own buffers. The search is exact and
+     * distances are computed identically in both directions, so every edge
+     * shows up in both of its rows. Once every row's length is known, the
+     * buffers are copied into place, also in parallel.
+     */
+    struct Chunk
+    {
+        neighbor_container neighbors;
+        length_container lengths;
+    };
+
+    auto n = m.size();
+    auto storage = m.data_->coords->data();
+    auto grid = m.grid(t2_, true);
+    if (!grid) m.merge();
+
+    std::vector<Chunk> chunks((n + rows_per_chunk - 1) / rows_per_chunk);
+    offsets_.assign(n + 1, 0);
+
+    parallelFor(n, rows_per_chunk, [&](std::size_t begin, std::size_t end)
+    {
+        Trace::Scope scope("dist_index::search");
+        auto& chunk = chunks[begin / rows_per_chunk];
+        std::vector<std::pair<StarId, float>> row;
+
+        auto visit = [&](std::size_t i, const hit_list& hits)
+        {
+            StarId u = begin + i;
+
+            row.clear();
+            for (auto& h : hits)
+            {
+                if (h.first == u) continue;
+                row.emplace_back(h.first, std::sqrt(h.second));
+            }
+            std::sort(row.begin(), row.end());
+
+            offsets_[u + 1] = row.size();
+            for (auto& e : row)
+            {
+                chunk.neighbors.push_back(e.first);
+                if (lengths) chunk.lengths.push_back(e.second);
+            }
+        };
+
+        m.radiusSearch(
+            storage + 3 * begin, end - begin, t2_, grid.get(), visit);
+    });
+
+    Trace::Scope offsets_scope("dist_index::offsets");
+    std::partial_sum(offsets_.begin(), offsets_.end(), offsets_.begin());
+    neighbors_.resize(offsets_.back());
+    if (lengths) lengths_.resize(offsets_.back());
+
+    parallelFor(chunks.size(), 1, [&](std::size_t c, std::size_t)
+    {
+        Trace::Scope scope("dist_index::fill");
+        auto& chunk = chunks[c];
+        auto first = offsets_[c * rows_per_chunk];
+
+        std::copy(
+            chunk.neighbors.begin(), chunk.neighbors.end(), 
+            neighbors_.begin() + first
+        );
+        std::copy(
+            chunk.lengths.begin(), chunk.lengths.end(), 
+            lengths_.begin() + first
+        );
+        chunk = Chunk();
+    });
+}
+
+StarMap::dist_index::dist_index(
+    double t2, 
+    const dist_index& o, 
+    const StarMap& m) :
+    t2_(t2)
+{
+    Trace::Scope scope("dist_index::derive");
+    Metrics::Timer timer(index_derive_time);
+
+    /* 
+     * The edge set only grows with the threshold, so every edge of this 
+     * index is an edge of o. Rows stay sorted when filtered. Distances are 
+     * recomputed in double precision the same way the radius search does, 
+     * so the result is identical to a fresh build. Rows are counted and 
+     * then filled in parallel. o is one of m's cached graphs, so m's
+     * coordinates are the ones it was built from.
+     */
+    assert(t2 <= o.t2_);
+
+    auto n = o.numVertices();
+    auto c = m.data_->coords->data();
+    auto inside = [this, c](StarId u, StarId v)
+    {
+        return distanceSquared(c + 3 * u, c + 3 * v) < t2_;
+    };
+
+    offsets_.assign(n + 1, 0);
+    parallelFor(n, rows_per_chunk, [&](std::size_t begin, std::size_t end)
+    {
+        for (StarId u = begin; u < end; ++u)
+        {
+            for (auto i = o.offsets_[u]; i < o.offsets_[u + 1]; ++i)
+            {
+                if (inside(u, o.neighbors_[i])) ++offsets_[u + 1];
+            }
+        }
+    });
+
+    std::partial_sum(offsets_.begin(), offsets_.end(), offsets_.begin());
+    neighbors_.resize(offsets_.back());
+    if (o.hasLengths()) lengths_.resize(offsets_.back());
+
+    parallelFor(n, rows_per_chunk, [&](std::size_t begin, std::size_t end)
+    {
+        for (StarId u = begin; u < end; ++u)
+        {
+            auto k = offsets_[u];
+            for (auto i = o.offsets_[u]; i < o.offsets_[u + 1]; ++i)
+            {
+                if (!inside(u, o.neighbors_[i])) continue;
+
+                neighbors_[k] = o.neighbors_[i];
+                if (o.hasLengths()) lengths_[k] = o.lengths_[i];
+                ++k;
+            }
+        }
+    });
+}
+
+StarMap::dist_index::dist_index(
+    const dist_index& o, 
+    const Edit& e, 
+    const StarMap& m) :
+    t2_(o.t2_)
+{
+    Trace::Scope scope("dist_index::patch");
+
+    /*
+     * Only the rows of dirty stars and of their neighbors before and after 
+     * the edit can change. Dirty rows are searched afresh and each edge 
+     * found is mirrored into the other star's row. Every other row is 
+     * copied, less its edges to stars that were erased or are dirty.
+     */
+    typedef std::pair<StarId, float> Entry;
+
+    auto n = m.size();
+    auto lengths = o.hasLengths();
+    auto& dirty = e.dirty;
+    auto isDirty = [&dirty](StarId v)
+    {
+        return std::binary_search(dirty.begin(), dirty.end(), v);
+    };
+    auto renumber = [&e](StarId v)
+    {
+        if (v == e.erased) return null_vertex();
+        return (v == e.last) ? e.erased : v;
+    };
+
+    std::vector<double> queries;
+    for (auto d : dirty)
+    {
+        auto c = &(*m.data_->coords)[3 * d];
+        queries.insert(queries.end(), c, c + 3);
+    }
+
+    std::vector<std::vector<Entry>> fresh(dirty.size());
+    std::vector<std::pair<StarId, Entry>> mirrored;
+    auto visit = [&](std::size_t i, const hit_list& hits)
+    {
+        for (auto& h : hits)
+        {
+            if (h.first == dirty[i]) continue;
+
+            Entry entry(h.first, std::sqrt(h.second));
+            fresh[i].push_back(entry);
+            if (!isDirty(h.first)) 
+                mirrored.emplace_back(h.first, Entry(dirty[i], entry.second));
+        }
+        std::sort(fresh[i].begin(), fresh[i].end());
+    };
+    m.radiusSearch(queries.data(), dirty.size(), t2_, nullptr, visit);
+    std::sort(mirrored.begin(), mirrored.end());
+
+    offsets_.reserve(n + 1);
+    offsets_.push_back(0);
+    neighbors_.reserve(o.neighbors_.size() + mirrored.size());
+    if (lengths) lengths_.reserve(neighbors_.capacity());
+
+    std::vector<Entry> row;
+    auto mirror = mirrored.begin();
+    auto d = dirty.begin();
+    for (StarId u = 0; u < n; ++u)
+    {
+        row.clear();
+        if (d != dirty.end() && *d == u)
+        {
+            row = fresh[d++ - dirty.begin()];
+        }
+        else
+        {
+            /* Stars that aren't dirty kept their ids. */
+            for (auto i = o.offsets_[u]; i < o.offsets_[u + 1]; ++i)
+            {
+                auto v = renumber(o.neighbors_[i]);
+                if (v == null_vertex() || isDirty(v)) continue;
+                row.emplace_back(v, lengths ? o.lengths_[i] : 0.0f);
+            }
+
+            auto first = mirror;
+            for (; mirror != mirrored.end() && mirror->first == u; ++mirror)
+                row.push_back(mirror->second);
+            if (first != mirror) std::sort(row.begin(), row.end());
+        }
+
+        for (auto& entry : row)
+        {
+            neighbors_.push_back(entry.first);
+            if (lengths) lengths_.push_back(entry.second);
+        }
+        offsets_.push_back(neighbors_.size());
+    }
+}
+
+void StarMap::dist_index::checkId(StarId s) const
+{
+    if (s >= numVertices())
+    {
+        std::ostringstream ss;
+        ss << "Star " << s << " not in graph.";
+        throw std::invalid_argument(ss.str());
+    }
+}
+
+auto StarMap::dist_index::edges() const
+    -> decltype(edges())
+{
+    return { 
+        edge_iterator(this, 0), 
+        edge_iterator(this, neighbors_.size()) 
+    };
+}
+
+auto StarMap::dist_index::neighbors(StarId s) const
+    -> decltype(neighbors(s))
+{
+    checkId(s);
+    return { 
+        neighbors_.begin() + offsets_[s], 
+        neighbors_.begin() + offsets_[s + 1] 
+    };
+}
+
+auto StarMap::dist_index::lengths(StarId s) const
+    -> decltype(lengths(s))
+{
+    checkId(s);
+    if (!hasLengths()) return { lengths_.end(), lengths_.end() };
+    return { 
+        lengths_.begin() + offsets_[s], 
+        lengths_.begin() + offsets_[s + 1] 
+    };
+}
+
+StarMap::dist_index::edge_iterator::edge_iterator(
+    const dist_index *g, std::size_t i) :
+    g_(g), u_(0), i_(i)
+{
+    skip();
+}
+
+void StarMap::dist_index::edge_iterator::increment()
+{
+    ++i_;
+    skip();
+}
+
+void StarMap::dist_index::edge_iterator::skip()
+{
+    /* Advance to the next entry (u, v) with u < v. */
+    auto& offsets = g_->offsets_;
+    auto& neighbors = g_->neighbors_;
+
+    while (i_ < neighbors.size())
+    {
+        while (offsets[u_ + 1] <= i_) ++u_;
+        if (neighbors[i_] > u_) return;
+        i_ = std::upper_bound(
+            neighbors.begin() + i_, 
+            neighbors.begin() + offsets[u_ + 1], 
+            u_
+        ) - neighbors.begin();
+    }
+}
+
+std::size_t StarMap::dist_index::memoryUsage() const
+{
+    return sizeof(*this) + 
+        offsets_.capacity() * sizeof(offset_container::value_type) +
+        neighbors_.capacity() * sizeof(neighbor_container::value_type) +
+        lengths_.capacity() * sizeof(length_container::value_type);
+}
+
+StarMap::dist_index::dist_index(const MapFile::Blob& saved, const StarMap *m)
+{
+    GraphHeader h;
+    if (saved.size < sizeof(h)) corrupt("graph too short");
+    std::memcpy(&h, saved.data, sizeof(h));
+
+    /* n is the map's own, but entries could be anything. */
+    auto n = m->size();
+    auto entries = h.entries;
+    auto header = sizeof(h) + (n + 1) * sizeof(std::uint64_t);
+    auto entry = sizeof(StarId) + (h.lengths ? sizeof(float) : 0);
+    if (h.stars != n || saved.size < header || 
+        entries > (saved.size - header) / entry ||
+        saved.size != header + entries * entry)
+    {
+        corrupt("graph size");
+    }
+
+    auto offsets = 
+        reinterpret_cast<const std::uint64_t*>(saved.data + sizeof(h));
+    auto neighbors = reinterpret_cast<const StarId*>(offsets + n + 1);
+    auto lengths = reinterpret_cast<const float*>(neighbors + entries);
+
+    t2_ = h.t2;
+    offsets_.assign(offsets, offsets + n + 1);
+    neighbors_.assign(neighbors, neighbors + entries);
+    if (h.lengths) lengths_.assign(lengths, lengths + entries);
+
+    /* Lookups assume rows are in bounds and strictly increasing. */
+    if (offsets_[0] != 0 || offsets_[n] != entries) corrupt("graph offsets");
+    for (std::size_t u = 0; u < n; ++u)
+    {
+        if (offsets_[u] > offsets_[u + 1]) corrupt("graph offsets");
+        for (auto i = offsets_[u]; i < offsets_[u + 1]; ++i)
+        {
+            if (neighbors_[i] >= n || neighbors_[i] == u) 
+                corrupt("graph neighbors");
+            if (i > offsets_[u] && neighbors_[i - 1] >= neighbors_[i]) 
+                corrupt("graph row order");
+        }
+    }
+}
+
+void StarMap::dist_index::write(MapFileWriter& out) const
+{
+    GraphHeader h = GraphHeader();
+    h.t2 = t2_;
+    h.stars = numVertices();
+    h.entries = neighbors_.size();
+    h.lengths = hasLengths();
+
+    out.begin(MapFile::Section::Adjacency);
+    out.write(&h, sizeof(h));
+    out.write(
+        std::vector<std::uint64_t>(offsets_.begin(), offsets_.end()));
+    out.write(neighbors_);
+    out.write(lengths_);
+    out.end();
+}
+
+auto StarMap::byDistance(double d) const
+    -> dist_index_ptr
+{
+    /* 
+     * Filtering a cached index with a larger threshold beats a fresh radius 
+     * search as long as it doesn't have too many more edges to scan. Edge 
+     * counts grow with the cube of the threshold, so cap the ratio.
+     *
+     * Only larger cached thresholds are used. Extending a smaller one would
+     * need a search of just the shell between the two radii, but the grid
+     * and the kd-tree both visit the whole ball, so it would cost as much
+     * as a fresh build plus a merge with the cached rows.
+     */
+    static const double max_derive_ratio = 2.0;
+
+    auto t2 = d*d;
+    auto& sync = data_->sync;
+    std::unique_lock<std::mutex> lock(sync.mutex);
+
+    /* Wait for any other thread building the same index to finish. */
+    sync.done.wait(lock, [&sync, t2] { return !sync.building.count(t2); });
+    if (auto result = data_->dist_indexes.find(t2)) 
+    {
+        cache_hits.add();
+        return result;
+    }
+    cache_misses.add();
+
+    auto superset = data_->dist_indexes.ceiling(t2);
+    sync.building.insert(t2);
+    lock.unlock();
+
+    dist_index_ptr result;
+    try
+    {
+        if (superset && 
+            superset->thresholdSquared() <= 
+                t2 * max_derive_ratio * max_derive_ratio)
+        {
+            result = std::make_shared<dist_index>(t2, *superset, *this);
+        }
+        else
+        {
+            result = std::make_shared<dist_index>(t2, this);
+        }
+    }
+    catch (...)
+    {
+        lock.lock();
+        sync.building.erase(t2);
+        sync.done.notify_all();
+        throw;
+    }
+
+    lock.lock();
+    sync.building.erase(t2);
+    sync.done.notify_all();
+    return data_->dist_indexes.insert(t2, result);
+}
+
+/* The cache is shared with copies, which may be in use elsewhere. */
+void StarMap::setCacheBudget(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(data_->sync.mutex);
+    data_->dist_indexes.setBudget(bytes);
+}
+
+void StarMap::setCachePolicy(EvictionPolicy policy)
+{
+    std::lock_guard<std::mutex> lock(data_->sync.mutex);
+    data_->dist_indexes.setPolicy(policy);
+}
+
+CacheStats StarMap::cacheStats() const
+{
+    std::lock_guard<std::mutex> lock(data_->sync.mutex);
+    return data_->dist_indexes.stats();
+}
+
+void StarMap::clearCache()
+{
+    std::lock_guard<std::mutex> lock(data_->sync.mutex);
+    data_->dist_indexes.clear();
+    data_->grid.reset();
+}
+
+MemoryUsage StarMap::memoryUsage() const
+{
+    /* Heap bytes of a string, unless it's short enough to keep in place. */
+    auto heap = [](const std::string& s) -> std::size_t
+    {
+        return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+    };
+
+    MemoryUsage result = MemoryUsage();
+    auto& stars = data_->stars;
+    for (auto& s : stars)
+    {
+        result.stars += sizeof(Star) + heap(s.getName());
+
+        /* Each entry is a node with a link and a cached hash. */
+        auto& props = s.properties();
+        if (props.bucket_count() > 1)
+            result.properties += props.bucket_count() * sizeof(void*);
+        for (auto& p : props)
+        {
+            result.properties += sizeof(void*) + sizeof(p) + 
+                sizeof(std::size_t) + heap(p.first) + heap(p.second);
+        }
+    }
+
+    /*
+     * Every node links into the four indexes: one pointer for the sequence,
+     * three for the ordered index and two for each hashed one. The sequence
+     * and the hashed indexes also have arrays of pointers.
+     */
+    result.star_indexes = stars.size() * 8 * sizeof(void*) + sizeof(void*) * (
+        stars.get<SeqIndex>().capacity() + 1 +
+        stars.get<NameMapIndex>().bucket_count() + 1 +
+        stars.get<CoordinateIndex>().bucket_count() + 1);
+
+    result.coordinates = 
+        data_->coords->capacity() * sizeof(spatial_storage_type::value_type);
+
+    auto state = spatial();
+    result.spatial_tree = 
+        static_cast<std::size_t>(state->tree->index.usedMemory());
+    if (state->tree->coords != data_->coords)
+    {
+        result.spatial_tree += state->tree->coords->capacity() * 
+            sizeof(spatial_storage_type::value_type);
+    }
+
+    auto& p = state->pending;
+    result.pending_edits = sizeof(StarId) * 
+        (p.ids.capacity() + p.slots.capacity() + p.added.capacity());
+
+    std::lock_guard<std::mutex> lock(data_->sync.mutex);
+    if (data_->grid) result.grid = data_->grid->memoryUsage();
+    if (data_->hierarchy) result.hierarchy = data_->hierarchy->memoryUsage();
+
+    /* The cache is keyed by squared threshold. */
+    for (auto& e : data_->dist_indexes.sizes())
+        result.graphs.emplace_back(std::sqrt(e.first), e.second);
+
+    return result;
+}
+
+/* Copies may still be using the grid, so it's left for clearCache(). */
+void StarMap::setSpatialBackend(SpatialBackend backend)
+{
+    backend_ = backend;
+}
+
+/*
+ * The grid for a threshold, or null if the kd-tree should be used instead.
+ * Only the most recent grid is kept: it costs about as much to build as one
+ * radius search per star, so it only pays off when reused for a whole index 
+ * or a run of queries at the same threshold. Threads that miss at once may
+ * each build a grid; the last one built is kept. Under Auto, a threshold too
+ * small for tight cells is turned down from the stars' bounds alone, before
+ * anything is built.
+ */
+auto StarMap::grid(double t2, bool build) const
+    -> std::shared_ptr<const UniformGrid>
+{
+    if (backend_ == SpatialBackend::KdTree) return nullptr;
+    {
+        std::lock_guard<std::mutex> lock(data_->sync.mutex);
+        if (data_->grid && data_->grid_t2 == t2) return data_->grid;
+    }
+    if (!build && backend_ == SpatialBackend::Auto) return nullptr;
+
+    auto coords = data_->coords->data();
+    if (backend_ == SpatialBackend::Auto &&
+        !UniformGrid::tight(coords, size(), std::sqrt(t2)))
+    {
+        return nullptr;
+    }
+
+    auto result = std::make_shared<UniformGrid>(coords, size(), std::sqrt(t2));
+
+    std::lock_guard<std::mutex> lock(data_->sync.mutex);
+    data_->grid_t2 = t2;
+    data_->grid = result;
+    return result;
+}
+
+StarId StarMap::insert(const Star& star)
+{
+    /* Check before anything changes, so a failed insert changes nothing. */
+    if (byName().count(star.getName()) || 
+        byCoordinate().count(star.getCoords()))
+    {
+        std::ostringstream os;
+        os << "Star " << star.getName() 
+           << " has the name or position of another star.";
+        throw std::invalid_argument(os.str());
+    }
+
+    auto& d = mutate();
+    detach();
+    d.stars.push_back(star);
+
+    StarId s = size() - 1;
+    auto c = star.getCoords();
+    auto& coords = writableCoords();
+    coords.insert(coords.end(), c.data(), c.data() + 3);
+    auto& p = writablePending();
+    p.slots.push_back(null_vertex());
+    p.added.push_back(s);
+
+    commit({ null_vertex(), null_vertex(), { s } });
+    return s;
+}
+
+void StarMap::erase(const std::string& name)
+{
+    StarId s = getId(name);
+    StarId last = size() - 1;
+    auto& d = mutate();
+    auto& seq = d.stars.get<SeqIndex>();
+
+    detach();
+    retire(s);
+
+    auto& p = writablePending();
+    auto& coords = writableCoords();
+    Edit e { s, last, { } };
+    if (s != last)
+    {
+        /* The last star takes over the erased star's id. */
+        auto slot = p.slots[s] = p.slots[last];
+        if (slot != null_vertex()) 
+            p.ids[slot] = s;
+        else 
+            *std::find(p.added.begin(), p.added.end(), last) = s;
+
+        std::copy(
+            coords.begin() + 3 * last, 
+            coords.begin() + 3 * last + 3, 
+            coords.begin() + 3 * s
+        );
+        seq.relocate(seq.begin() + s, seq.end() - 1);
+        e.dirty.push_back(s);
+    }
+    seq.erase(seq.begin() + s + (s != last));
+    p.slots.pop_back();
+    coords.resize(3 * last);
+
+    commit(e);
+}
+
+void StarMap::erase(const Star& star)
+{
+    getId(star);
+    erase(star.getName());
+}
+
+void StarMap::moveStar(const std::string& name, const Coordinate& to)
+{
+    StarId s = getId(name);
+    auto other = byCoordinate().find(to);
+    if (other != byCoordinate().end() && other->getName() != name)
+    {
+        std::ostringstream os;
+        os << "Can't move " << name << " onto another star.";
+        throw std::invalid_argument(os.str());
+    }
+
+    auto& d = mutate();
+    auto& seq = d.stars.get<SeqIndex>();
+
+    Star moved(name, to);
+    for (auto& prop : seq[s].properties())
+        moved.setProperty(prop.first, prop.second);
+    seq.replace(seq.begin() + s, moved);
+
+    detach();
+    retire(s);
+    std::copy(to.data(), to.data() + 3, writableCoords().begin() + 3 * s);
+    writablePending().added.push_back(s);
+
+    commit({ null_vertex(), null_vertex(), { s } });
+}
+
+void StarMap::moveStar(const Star& star, const Coordinate& to)
+{
+    getId(star);
+    moveStar(star.getName(), to);
+}
+
+/* 
+ * The data of this map alone, cloned first if it's shared with a copy. The
+ * copy may be being queried, so clone under its lock.
+ */
+auto StarMap::mutate()
+    -> Data&
+{
+    if (data_.use_count() > 1)
+    {
+        std::shared_ptr<Data> clone;
+        {
+            std::lock_guard<std::mutex> lock(data_->sync.mutex);
+            clone = std::make_shared<Data>(*data_);
+        }
+        data_ = clone;
+    }
+    return *data_;
+}
+
+/* The live coordinates, cloned first if the kd-tree or a copy uses them. */
+auto StarMap::writableCoords()
+    -> spatial_storage_type&
+{
+    auto& coords = mutate().coords;
+    if (coords.use_count() > 1) 
+        coords = std::make_shared<spatial_storage_type>(*coords);
+    return *coords;
+}
+
+/* The pending edits, cloned first if a copy shares them. */
+auto StarMap::writablePending()
+    -> PendingEdits&
+{
+    auto& state = mutate().spatial;
+    if (state.use_count() > 1) 
+        state = std::make_shared<SpatialState>(*state);
+    return state->pending;
+}
+
+/* The kd-tree and pending edits as they are now. */
+auto StarMap::spatial() const
+    -> std::shared_ptr<const SpatialState>
 {
-    if (&m != this)
-        *this = std::move(StarMap(m));
-    return *this;
+    return std::atomic_load(&data_->spatial);
 }
 
-StarMap& StarMap::operator=(StarMap&& m)
+/* Start tracking edits against the kd-tree as built. */
+void StarMap::detach()
 {
-    stars_ = std::move(m.stars_);
-    spatial_storage_ = std::move(m.spatial_storage_);
-    spatial_index_ = initIndex();
-    dist_index_cache_ = std::move(m.dist_index_cache_);
+    auto& p = writablePending();
+    if (p.detached) return;
 
-    return *this;
+    p.ids.resize(size());
+    std::iota(p.ids.begin(), p.ids.end(), 0);
+    p.slots = p.ids;
+    p.detached = true;
 }
 
-void StarMap::dist_index::init()
+/* Take a star out of the kd-tree and the added list before it changes. */
+void StarMap::retire(StarId s)
 {
-    std::vector<double> c(m_->size() * 3);
-
-    auto p = c.data();
-    for (auto v : *m_)
+    auto& p = writablePending();
+    auto slot = p.slots[s];
+    if (slot != null_vertex())
     {
-        neighbors_[v] = JumpSet();
-        Coordinate c(v.getCoords());
-        std::copy(c.data(), c.data() + 3, p);
-        p += 3;
+        p.ids[slot] = null_vertex();
+        ++p.dead;
     }
+    else
+    {
+        p.added.erase(std::find(p.added.begin(), p.added.end(), s));
+    }
+    p.slots[s] = null_vertex();
+}
 
-    std::vector<std::vector<int>> idx;
-    std::vector<std::vector<double>> dists;
-
-    m_->spatial_index_->radiusSearch(
-        matrix_type(c.data(), m_->size(), 3),
-        idx,
-        dists,
-        t2_,
-        flann::SearchParams()
-    );
+/*
+ * Bring everything derived from the map up to date after an edit. Cached
+ * threshold graphs are patched; the grid and hierarchy are cheap enough to
+ * rebuild when next needed. Pending edits cost every kd-tree search a 
+ * linear scan, so the tree is rebuilt once there are about sqrt(n) of them.
+ */
+void StarMap::commit(const Edit& e)
+{
+    static const std::size_t min_pending = 64;
 
-    for (size_t from = 0; from < idx.size(); ++from)
-    {
-        auto& r = idx[from];
-        for (size_t j = 0; j < r.size(); ++j)
-        {
-            size_t to = r[j]; 
+    auto& d = mutate();
+    d.grid.reset();
+    d.hierarchy.reset();
 
-            if (to > from) edges_.emplace((*m_)[from], (*m_)[to]);
-        }
-    }
+    auto& p = d.spatial->pending;
+    auto limit = std::max<std::size_t>(min_pending, std::sqrt(size()));
+    if (p.added.size() + p.dead > limit) merge();
 
-    for (auto j : edges_)
+    d.dist_indexes.transform([this, &e](const dist_index& g)
     {
-        neighbors_[j.source()].emplace(j.source(), j.target());
-        neighbors_[j.target()].emplace(j.target(), j.source());
-    }
+        return std::make_shared<dist_index>(g, e, *this);
+    });
 }
 
-auto StarMap::dist_index::neighbors(const Star& s) const
-    -> decltype(neighbors(s))
+/* 
+ * Rebuild the kd-tree from the live coordinates. Searches already underway
+ * carry on with the old tree.
+ */
+void StarMap::merge() const
 {
-    auto it = neighbors_.find(s);
-    if (it == neighbors_.end())
+    auto& sync = data_->sync;
+    std::unique_lock<std::mutex> lock(sync.mutex);
+    sync.done.wait(lock, [&sync] { return !sync.merging; });
+    if (!data_->spatial->pending.detached) return;
+
+    sync.merging = true;
+    lock.unlock();
+
+    std::shared_ptr<SpatialState> merged;
+    try
     {
-        std::ostringstream ss;
-        ss << "Star " << s.getName() << " not in graph.";
-        throw std::invalid_argument(ss.str());
+        merged = std::make_shared<SpatialState>(
+            std::make_shared<SpatialTree>(data_->coords));
+    }
+    catch (...)
+    {
+        lock.lock();
+        sync.merging = false;
+        sync.done.notify_all();
+        throw;
     }
 
-    return it->second;
+    lock.lock();
+    std::atomic_store(&data_->spatial, merged);
+    sync.merging = false;
+    sync.done.notify_all();
 }
 
-auto StarMap::byDistance(double d) const
-    -> decltype(byDistance(0.0))
+void StarMap::save(
+    const std::string& path, 
+    const std::vector<double>& thresholds) const
 {
-    auto t2 = d*d;
-    auto it = dist_index_cache_.find(t2);
+    typedef MapFile::Section Section;
 
-    return (it != dist_index_cache_.end()) ? 
-        it->second : 
-        dist_index_cache_.emplace_hint(it, t2, dist_index(t2, this))->second;
+    merge();
+    auto n = size();
+    auto& seq = byIndex();
+    MapFileWriter out(path, n);
+
+    out.begin(Section::Coordinates);
+    out.write(*data_->coords);
+    out.end();
+
+    out.begin(Section::Names);
+    writeStrings(out, n, [&seq](std::size_t i) { return seq[i].getName(); });
+    out.end();
+
+    out.begin(Section::Properties);
+    writeStrings(out, n, [&seq](std::size_t i)
+    {
+        std::string result;
+        for (auto& kv : seq[i].properties())
+        {
+            result.append(kv.first).push_back('\0');
+            result.append(kv.second).push_back('\0');
+        }
+        return result;
+    });
+    out.end();
+
+    if (n > 0)
+    {
+        /* FLANN only writes to a FILE, so go through a temporary one. */
+        FILE *tmp = std::tmpfile();
+        if (!tmp) throw std::runtime_error("Can't create a temporary file");
+        const_cast<spatial_type&>(spatial()->tree->index).saveIndex(tmp);
+
+        char buf[1 << 16];
+        std::rewind(tmp);
+        out.begin(Section::SpatialIndex);
+        while (auto got = std::fread(buf, 1, sizeof(buf), tmp)) 
+            out.write(buf, got);
+        out.end();
+        std::fclose(tmp);
+    }
+
+    for (auto t : thresholds) byDistance(t)->write(out);
+    out.close();
 }
 
 auto StarMap::vertexIndexMap() const
     -> vertex_index_map
 {
-    return { bind(&StarMap::getIndex, this, _1) };
+    return vertex_index_map();
 }
 
 Star StarMap::getStar(const std::string& name) const
+{
+    return byIndex()[getId(name)];
+}
+
+StarId StarMap::getId(const std::string& name) const
 {
     auto it = byName().find(name);
     if (it == byName().end())
@@ -194,14 +1339,39 @@ Star StarMap::getStar(const std::string& name) const
         os << "Unknown star: " << name;
         throw std::invalid_argument(os.str());
     }
-    return *it;
+    return data_->stars.project<SeqIndex>(it) - byIndex().begin();
 }
 
-auto StarMap::getIndex(const Star& v) const
-    -> size_type
+StarId StarMap::getId(const Star& star) const
+{
+    StarId id = getId(star.getName());
+    if (byIndex()[id] != star)
+    {
+        std::ostringstream os;
+        os << "Unknown star: " << star.getName();
+        throw std::invalid_argument(os.str());
+    }
+    return id;
+}
+
+Jump StarMap::getJump(const JumpId& j) const
+{
+    return { byIndex()[j.first], byIndex()[j.second] };
+}
+
+StarSet StarMap::toStarSet(const std::vector<StarId>& ids) const
+{
+    StarSet result;
+    for (auto id : ids) result.insert(byIndex()[id]);
+    return result;
+}
+
+/* The id of a star, or null_vertex() if it isn't in the map. */
+StarId StarMap::find(const Star& star) const
 {
-    auto it = bySortedIndex().find(v);
-    return stars_.project<SeqIndex>(it) - byIndex().begin();
+    auto it = byName().find(star.getName());
+    if (it == byName().end() || *it != star) return null_vertex();
+    return data_->stars.project<SeqIndex>(it) - byIndex().begin();
 }
 
 Star StarMap::nearestNeighbor(const std::string& name, double threshold) const
@@ -211,15 +1381,133 @@ Star StarMap::nearestNeighbor(const std::string& name, double threshold) const
 
 Star StarMap::nearestNeighbor(const Star& star, double threshold) const
 {
-    auto c = star.getCoords();
-    int index[2] = { 0 };
-    double dist[2] = { 0 };
-    flann::Matrix<int> i = toMatrix(index, 1, 2);
-    flann::Matrix<double> d = toMatrix(dist, 1, 2);
+    auto r = closest(
+        star.getCoords(), find(star), 1, threshold * threshold);
+    return r.empty() ? Star() : byIndex()[r.front().first];
+}
 
-    spatial_index_->knnSearch(toMatrix(&c), i, d, 2, flann::SearchParams());
+NeighborList StarMap::knn(const std::string& name, std::size_t k) const
+{
+    return knn(getStar(name), k);
+}
+
+NeighborList StarMap::knn(const Star& star, std::size_t k) const
+{
+    return closest(star.getCoords(), find(star), k, 
+        std::numeric_limits<double>::infinity());
+}
+
+NeighborList StarMap::knn(const Coordinate& c, std::size_t k) const
+{
+    return closest(c, null_vertex(), k, 
+        std::numeric_limits<double>::infinity());
+}
+
+NeighborList StarMap::neighborsSorted(
+    const std::string& name, 
+    double threshold, 
+    std::size_t limit) const
+{
+    return neighborsSorted(getStar(name), threshold, limit);
+}
+
+NeighborList StarMap::neighborsSorted(
+    const Star& star, 
+    double threshold, 
+    std::size_t limit) const
+{
+    return closest(
+        star.getCoords(), find(star), limit, threshold * threshold);
+}
+
+NeighborList StarMap::neighborsSorted(
+    const Coordinate& c, 
+    double threshold, 
+    std::size_t limit) const
+{
+    return closest(c, null_vertex(), limit, threshold * threshold);
+}
+
+/*
+ * The at most k stars other than self closer than sqrt(t2) to c, nearest 
+ * first with ties broken by id. Only the best k are ever held: FLANN bounds 
+ * its own result set, and everything else goes through a heap.
+ */
+NeighborList StarMap::closest(
+    const Coordinate& c, 
+    StarId self, 
+    std::size_t k, 
+    double t2) const
+{
+    typedef std::pair<double, StarId> Candidate;
+    std::vector<Candidate> best;
+
+    k = std::min(k, size());
+    if (k == 0) return NeighborList();
+
+    auto offer = [&](StarId v, double d2)
+    {
+        Candidate e(d2, v);
+        if (v == self || v == null_vertex() || !(d2 < t2)) return;
+        if (best.size() == k)
+        {
+            if (!(e < best.front())) return;
+            std::pop_heap(best.begin(), best.end());
+            best.pop_back();
+        }
+        best.push_back(e);
+        std::push_heap(best.begin(), best.end());
+    };
+
+    auto state = spatial();
+    auto& p = state->pending;
+    auto tree_size = p.detached ? p.ids.size() : size();
+    auto g = std::isinf(t2) ? nullptr : grid(t2, false);
+    if (g)
+    {
+        g->near(c.data(), t2, offer);
+    }
+    else if (tree_size > 0)
+    {
+        /* The star itself and any dead entries can take up results. */
+        std::size_t n = std::min(
+            k + (self != null_vertex()) + p.dead, tree_size);
+        std::vector<std::vector<int>> idx;
+        std::vector<std::vector<double>> dists;
+
+        if (std::isinf(t2))
+        {
+            state->tree->index.knnSearch(
+                toMatrix(&c), idx, dists, n, flann::SearchParams());
+        }
+        else
+        {
+            flann::SearchParams params;
+            if (n < tree_size) params.max_neighbors = static_cast<int>(n);
+
+            state->tree->index.radiusSearch(
+                toMatrix(&c), idx, dists, searchRadius(t2), params);
+        }
+
+        for (std::size_t j = 0; j < idx.front().size(); ++j)
+        {
+            int slot = idx.front()[j];
+            offer(p.detached ? p.ids[slot] : slot, dists.front()[j]);
+        }
+    }
+
+    if (!g)
+    {
+        for (auto v : p.added)
+            offer(v, distanceSquared(c.data(), &(*data_->coords)[3 * v]));
+    }
 
-    return (dist[1] < threshold*threshold) ? byIndex().at(index[1]) : Star();
+    std::sort_heap(best.begin(), best.end());
+
+    NeighborList result;
+    result.reserve(best.size());
+    for (auto& e : best) result.emplace_back(e.second, std::sqrt(e.first));
+    return result;
 }
 
 StarSet StarMap::neighbors(const std::string& name, double threshold) const
@@ -230,35 +1518,164 @@ StarSet StarMap::neighbors(const std::string& name, double threshold) const
 StarSet StarMap::neighbors(const Star& star, double threshold) const
 {
     auto c = star.getCoords();
-    std::vector<std::vector<int>> idx;
-    std::vector<std::vector<double>> dists;
     double t2 = threshold * threshold;
+    std::vector<StarId> ids;
 
-    spatial_index_->radiusSearch(
-        toMatrix(&c),
-        idx,
-        dists,
-        t2,
-        flann::SearchParams()
-    );
-
-    auto pred = [star](const Star& v)
+    auto visit = [&](std::size_t, const hit_list& hits)
     {
-        return v != star;
+        for (auto& h : hits)
+        {
+            if (byIndex()[h.first] != star) ids.push_back(h.first);
+        }
     };
-    auto xform = [this](int i)
+    radiusSearch(c.data(), 1, t2, grid(t2, false).get(), visit);
+
+    return toStarSet(ids);
+}
+
+NeighborTable StarMap::nearestNeighbors(
+    const std::vector<StarId>& stars, 
+    double threshold) const
+{
+    return batchSearch(
+        pack(*data_->coords, stars), stars.data(), threshold, true);
+}
+
+NeighborTable StarMap::nearestNeighbors(
+    const std::vector<Coordinate>& coords, 
+    double threshold) const
+{
+    return batchSearch(pack(coords), nullptr, threshold, true);
+}
+
+NeighborTable StarMap::neighbors(
+    const std::vector<StarId>& stars, 
+    double threshold) const
+{
+    return batchSearch(
+        pack(*data_->coords, stars), stars.data(), threshold, false);
+}
+
+NeighborTable StarMap::neighbors(
+    const std::vector<Coordinate>& coords, 
+    double threshold) const
+{
+    return batchSearch(pack(coords), nullptr, threshold, false);
+}
+
+/*
+ * Queries are answered in parallel chunks of rows, each with one search
+ * call, and the rows are then stitched together the same way as the rows
+ * of a dist_index. If self is given, self[i] is left out of row i.
+ */
+NeighborTable StarMap::batchSearch(
+    const std::vector<double>& queries, 
+    const StarId *self, 
+    double threshold,
+    bool nearest) const
+{
+    struct Chunk
     {
-        return byIndex().at(i);
+        std::vector<StarId> neighbors;
+        std::vector<double> distances;
     };
-    
-    /* lol, iterators */
-    auto xbegin = make_transform_iterator(idx.front().begin(), xform);
-    auto xend = make_transform_iterator(idx.front().end(), xform);
 
-    auto begin = make_filter_iterator(pred, xbegin, xend);
-    auto end = make_filter_iterator(pred, xend, xend);
+    auto n = queries.size() / 3;
+    auto t2 = threshold * threshold;
+    auto g = nearest ? nullptr : grid(t2, false);
+    if (!g) merge();
+    auto tree = spatial()->tree;
+
+    std::vector<Chunk> chunks((n + rows_per_chunk - 1) / rows_per_chunk);
+
+    NeighborTable result;
+    result.offsets_.assign(n + 1, 0);
+
+    parallelFor(n, rows_per_chunk, [&](std::size_t begin, std::size_t end)
+    {
+        auto& chunk = chunks[begin / rows_per_chunk];
+        auto rows = queries.data() + 3 * begin;
+        hit_list row;
+
+        auto add = [&](std::size_t i)
+        {
+            std::sort(row.begin(), row.end());
+            result.offsets_[begin + i + 1] = row.size();
+            for (auto& e : row)
+            {
+                chunk.neighbors.push_back(e.first);
+                chunk.distances.push_back(std::sqrt(e.second));
+            }
+        };
+
+        if (!nearest)
+        {
+            radiusSearch(rows, end - begin, t2, g.get(), 
+                [&](std::size_t i, const hit_list& hits)
+            {
+                row.clear();
+                for (auto& h : hits)
+                {
+                    if (!self || h.first != self[begin + i]) row.push_back(h);
+                }
+                add(i);
+            });
+            return;
+        }
+
+        /* The query star itself can take up one of the k results. */
+        std::size_t k = std::min<std::size_t>(self ? 2 : 1, size());
+        std::vector<std::vector<int>> idx(end - begin);
+        std::vector<std::vector<double>> dists(end - begin);
+        if (k > 0)
+        {
+            tree->index.knnSearch(
+                matrix_type(const_cast<double*>(rows), end - begin, 3),
+                idx,
+                dists,
+                k,
+                flann::SearchParams()
+            );
+        }
+
+        for (std::size_t i = 0; i < end - begin; ++i)
+        {
+            row.clear();
+            for (std::size_t j = 0; j < idx[i].size(); ++j)
+            {
+                StarId v = idx[i][j];
+                if (self && v == self[begin + i]) continue;
+                if (dists[i][j] < t2) row.emplace_back(v, dists[i][j]);
+                break;
+            }
+            add(i);
+        }
+    });
+
+    std::partial_sum(
+        result.offsets_.begin(), result.offsets_.end(), 
+        result.offsets_.begin()
+    );
+    result.neighbors_.resize(result.offsets_.back());
+    result.distances_.resize(result.offsets_.back());
+
+    parallelFor(chunks.size(), 1, [&](std::size_t c, std::size_t)
+    {
+        auto& chunk = chunks[c];
+        auto first = result.offsets_[c * rows_per_chunk];
+
+        std::copy(
+            chunk.neighbors.begin(), chunk.neighbors.end(), 
+            result.neighbors_.begin() + first
+        );
+        std::copy(
+            chunk.distances.begin(), chunk.distances.end(), 
+            result.distances_.begin() + first
+        );
+        chunk = Chunk();
+    });
 
-    return StarSet(begin, end);
+    return result;
 }
 
 StarList StarMap::path(
@@ -274,28 +1691,161 @@ StarList StarMap::path(
     const Star& to, 
     double threshold) const
 {
-    vector_property_map<Star, vertex_index_map> prev_pa(vertexIndexMap());
+    Trace::Scope scope("StarMap::path");
+
+    /* 
+     * Bidirectional breadth first search: grow whichever frontier is smaller
+     * by one whole level at a time until the two searches meet. Finishing 
+     * the level before stopping keeps the best meeting point, so the route 
+     * has the fewest possible jumps. Only visited stars are recorded.
+     */
+    struct Visit
+    {
+        StarId prev;
+        std::uint32_t depth;
+    };
+    typedef std::unordered_map<StarId, Visit> visit_map;
 
-    breadth_first_search(
-        byDistance(threshold),
-        from,
-        visitor(
-            make_bfs_visitor(
-                record_predecessors(prev_pa, on_tree_edge())
-            )
-        )
-    );
+    StarId src = getId(from);
+    StarId dst = getId(to);
+    if (src == dst) return StarList { from };
+
+    auto idx = byDistance(threshold);
+
+    visit_map fwd { { src, { null_vertex(), 0 } } };
+    visit_map bwd { { dst, { null_vertex(), 0 } } };
+    std::vector<StarId> fwd_frontier { src };
+    std::vector<StarId> bwd_frontier { dst };
+    std::vector<StarId> next;
+
+    StarId meet = null_vertex();
+    auto best = std::numeric_limits<std::uint32_t>::max();
+
+    while (meet == null_vertex() && 
+           !fwd_frontier.empty() && !bwd_frontier.empty())
+    {
+        bool forward = fwd_frontier.size() <= bwd_frontier.size();
+        auto& frontier = forward ? fwd_frontier : bwd_frontier;
+        auto& mine = forward ? fwd : bwd;
+        auto& other = forward ? bwd : fwd;
+
+        next.clear();
+        for (auto u : frontier)
+        {
+            auto depth = mine[u].depth + 1;
+            for (auto v : idx->neighbors(u))
+            {
+                if (!mine.emplace(v, Visit { u, depth }).second) continue;
+                next.push_back(v);
+
+                auto it = other.find(v);
+                if (it != other.end() && depth + it->second.depth < best)
+                {
+                    best = depth + it->second.depth;
+                    meet = v;
+                }
+            }
+        }
+        frontier.swap(next);
+    }
+
+    path_visited.record(fwd.size() + bwd.size());
+    if (meet == null_vertex()) return StarList();
 
-    Star s = to;
     StarList result;
+    for (StarId s = meet; s != null_vertex(); s = fwd[s].prev)
+    {
+        result.push_front(byIndex()[s]);
+    }
+    for (StarId s = bwd[meet].prev; s != null_vertex(); s = bwd[s].prev)
+    {
+        result.push_back(byIndex()[s]);
+    }
+    return result;
+}
+
+StarList StarMap::shortestPath(
+    const std::string& from, 
+    const std::string& to, 
+    double threshold) const
+{
+    return shortestPath(getStar(from), getStar(to), threshold);
+}
+
+StarList StarMap::shortestPath(
+    const Star& from, 
+    const Star& to, 
+    double threshold) const
+{
+    Trace::Scope scope("StarMap::shortestPath");
+
+    /* 
+     * A* search using the straight-line distance to the target as the 
+     * heuristic. It is consistent, so each star is settled at most once and
+     * the search stops as soon as the target is settled. Labels are kept
+     * only for the stars the search actually touches.
+     */
+    struct Label
+    {
+        double g;
+        StarId prev;
+        bool settled;
+    };
+    typedef std::pair<double, StarId> Entry;
 
-    do
+    StarId src = getId(from);
+    StarId dst = getId(to);
+    auto idx = byDistance(threshold);
+
+    auto c = data_->coords->data();
+    auto dist = [c](StarId u, StarId v)
+    {
+        return std::sqrt(distanceSquared(c + 3 * u, c + 3 * v));
+    };
+
+    std::unordered_map<StarId, Label> labels;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> open;
+
+    labels[src] = { 0.0, null_vertex(), false };
+    open.emplace(dist(src, dst), src);
+
+    while (!open.empty())
     {
-        result.push_front(s);
-        s = prev_pa[s];
-    } while (s != Star());
+        StarId u = open.top().second;
+        open.pop();
+
+        auto& lu = labels[u];
+        if (lu.settled) continue;
+        lu.settled = true;
+        if (u == dst) break;
+
+        double gu = lu.g;
+        for (auto v : idx->neighbors(u))
+        {
+            double gv = gu + dist(u, v);
+            auto it = labels.emplace(
+                v, Label { std::numeric_limits<double>::infinity(), u, false }
+            ).first;
+
+            auto& lv = it->second;
+            if (lv.settled || gv >= lv.g) continue;
+
+            lv.g = gv;
+            lv.prev = u;
+            open.emplace(gv + dist(v, dst), v);
+        }
+    }
+
+    shortest_path_visited.record(labels.size());
+    auto it = labels.find(dst);
+    if (it == labels.end() || !it->second.settled) return StarList();
 
-    return (!result.empty() && result.front() == from) ? result : StarList();
+    StarList result;
+    for (StarId s = dst; s != null_vertex(); s = labels[s].prev)
+    {
+        result.push_front(byIndex()[s]);
+    }
+    return result;
 }
 
 StarSet StarMap::reachable(const std::string& name, double threshold) const
@@ -305,45 +1855,113 @@ StarSet StarMap::reachable(const std::string& name, double threshold) const
 
 StarSet StarMap::reachable(const Star& star, double threshold) const
 {
-    StarSet result;
+    Trace::Scope scope("StarMap::reachable");
+    std::vector<StarId> result;
+    auto idx = byDistance(threshold);
+
     breadth_first_search(
-        byDistance(threshold),
-        star,
+        *idx,
+        getId(star),
         visitor(
             make_bfs_visitor(
                 write_property(
-                    typed_identity_property_map<Star>(),
-                    inserter(result, result.begin()), 
+                    typed_identity_property_map<StarId>(),
+                    std::back_inserter(result), 
                     on_discover_vertex()
                 )
             )
         )
     );
 
-    return result; 
+    reachable_visited.record(result.size());
+    return toStarSet(result); 
 }
 
 std::vector<StarSet> StarMap::connectedComponents(double threshold) const
 { 
-    typedef std::vector<size_type> idx_vector;
-    idx_vector c(size());
-    iterator_property_map<idx_vector::iterator, vertex_index_map> 
-        pa(c.begin(), vertexIndexMap());
+    Trace::Scope scope("StarMap::connectedComponents");
+    std::vector<size_type> c(size());
+    auto idx = byDistance(threshold);
 
-    auto count = connected_components(byDistance(threshold), pa);
+    auto count = connected_components(*idx, c.data());
 
-    std::vector<StarSet> result(count);
-    for (size_type i = 0; i < c.size(); ++i)
+    std::vector<std::vector<StarId>> ids(count);
+    for (StarId i = 0; i < c.size(); ++i)
     {
-        Star s = byIndex().at(i);
-        size_type component = c[i];
+        ids[c[i]].push_back(i);
+    }
+
+    std::vector<StarSet> result;
+    result.reserve(count);
+    for (auto& cc : ids)
+    {
+        result.push_back(toStarSet(cc));
+    }
 
-        result[component].insert(s);
+    return result;
+}
+
+auto StarMap::hierarchy() const
+    -> std::shared_ptr<const ConnectivityHierarchy>
+{
+    auto& sync = data_->sync;
+    std::unique_lock<std::mutex> lock(sync.mutex);
+    sync.done.wait(lock, [&sync] { return !sync.building_hierarchy; });
+    if (data_->hierarchy) return data_->hierarchy;
+
+    sync.building_hierarchy = true;
+    lock.unlock();
+
+    std::shared_ptr<const ConnectivityHierarchy> result;
+    try
+    {
+        Trace::Scope scope("ConnectivityHierarchy::build");
+        result = std::make_shared<ConnectivityHierarchy>(*this);
+    }
+    catch (...)
+    {
+        lock.lock();
+        sync.building_hierarchy = false;
+        sync.done.notify_all();
+        throw;
     }
 
+    lock.lock();
+    data_->hierarchy = result;
+    sync.building_hierarchy = false;
+    sync.done.notify_all();
     return result;
 }
 
+double StarMap::minimumJumpRange(
+    const std::string& from, 
+    const std::string& to) const
+{
+    return minimumJumpRange(getStar(from), getStar(to));
+}
+
+double StarMap::minimumJumpRange(const Star& from, const Star& to) const
+{
+    return hierarchy()->bottleneck(getId(from), getId(to));
+}
+
+auto StarMap::componentCount(double threshold) const
+    -> size_type
+{
+    return hierarchy()->componentCount(threshold);
+}
+
+StarSet StarMap::component(const std::string& name, double threshold) const
+{
+    return component(getStar(name), threshold);
+}
+
+StarSet StarMap::component(const Star& star, double threshold) const
+{
+    auto r = hierarchy()->component(getId(star), threshold);
+    return toStarSet(std::vector<StarId>(r.begin(), r.end()));
+}
+
 Coordinate StarMap::centerOfMass() const
 {
     typedef container::flat_set<double> DimensionSet;
@@ -385,32 +2003,22 @@ double StarMap::extent() const
     });
 }
         
-auto StarMap::initIndex() 
-    -> spatial_ptr_type
-{
-    /* No make_unique in C++11 :( */
-    spatial_ptr_type result(
-        new spatial_type(
-            matrix_type(spatial_storage_.data(), stars_.size(), 3),
-            flann::KDTreeSingleIndexParams(10, true)
-        )
-    );
-
-    if (stars_.size() > 0) result->buildIndex();
-
-    return result;
-}
-
 std::pair<StarMap::vertex_iterator,StarMap::vertex_iterator>
 StellarCartography::vertices(const StarMap& g)
 {
-    return std::make_pair(g.begin(), g.end());
+    return std::make_pair(
+        StarMap::vertex_iterator(0), 
+        StarMap::vertex_iterator(g.size())
+    );
 }
 
 auto StellarCartography::vertices(const StarMap::dist_index& g)
     -> decltype(vertices(g))
 {
-    return vertices(g.parent());
+    return std::make_pair(
+        StarMap::vertex_iterator(0), 
+        StarMap::vertex_iterator(g.numVertices())
+    );
 }
 
 StarMap::vertices_size_type
@@ -423,46 +2031,47 @@ StellarCartography::num_vertices(const StarMap& g)
 auto StellarCartography::num_vertices(const StarMap::dist_index& g)
     -> decltype(num_vertices(g))
 {
-    return num_vertices(g.parent());
+    return g.numVertices();
 }
 
-Star StellarCartography::source(const Jump& j, const StarMap&)
+StarId StellarCartography::source(const JumpId& j, const StarMap&)
 {
-    return j.source();
+    return j.first;
 }
 
-Star StellarCartography::source(const Jump& j, const StarMap::dist_index&)
+StarId StellarCartography::source(const JumpId& j, const StarMap::dist_index&)
 {
-    return j.source();
+    return j.first;
 }
 
-Star StellarCartography::target(const Jump& j, const StarMap&)
+StarId StellarCartography::target(const JumpId& j, const StarMap&)
 {
-    return j.target();
+    return j.second;
 }
 
-Star StellarCartography::target(const Jump& j, const StarMap::dist_index&)
+StarId StellarCartography::target(const JumpId& j, const StarMap::dist_index&)
 {
-    return j.target();
+    return j.second;
 }
 
 std::pair<StarMap::out_edge_iterator, StarMap::out_edge_iterator>
-StellarCartography::out_edges(const Star& u, const StarMap& g)
+StellarCartography::out_edges(StarId u, const StarMap& g)
 {
     StarMap::out_edge_filter_fcn p = 
-    [u](const Star& v)
+    [u](StarId v)
     {
         return u != v;
     };
 
     StarMap::out_edge_iterator_fcn t = 
-    [u](const Star& v)
+    [u](StarId v)
     {
-        return Jump(u, v);
+        return JumpId(u, v);
     };
 
-    auto begin_filt = StarMap::out_edge_iterator_base(p, g.begin());
-    auto end_filt = StarMap::out_edge_iterator_base(p, g.end());
+    auto r = vertices(g);
+    auto begin_filt = StarMap::out_edge_iterator_base(p, r.first, r.second);
+    auto end_filt = StarMap::out_edge_iterator_base(p, r.second, r.second);
 
     auto begin = StarMap::out_edge_iterator(begin_filt, t);
     auto end = StarMap::out_edge_iterator(end_filt, t);
@@ -471,19 +2080,23 @@ StellarCartography::out_edges(const Star& u, const StarMap& g)
 }
 
 StarMap::degree_size_type
-StellarCartography::out_degree(const Star& u, const StarMap& g)
+StellarCartography::out_degree(StarId, const StarMap& g)
 {
     return g.size() - 1; 
 }
 
-auto StellarCartography::out_edges(const Star& u, const StarMap::dist_index& g)
+auto StellarCartography::out_edges(StarId u, const StarMap::dist_index& g)
     -> decltype(out_edges(u, g ))
 {
-    auto& n = g.neighbors(u);
-    return { n.begin(), n.end() };
+    auto n = g.neighbors(u);
+    StarMap::dist_index::out_edge_fcn f { u };
+    return { 
+        make_transform_iterator(n.begin(), f), 
+        make_transform_iterator(n.end(), f) 
+    };
 }
 
-auto StellarCartography::out_degree(const Star& u, const StarMap::dist_index& g)
+auto StellarCartography::out_degree(StarId u, const StarMap::dist_index& g)
     -> decltype(out_degree(u, g))
 {
     return g.neighbors(u).size();
@@ -492,9 +2105,10 @@ auto StellarCartography::out_degree(const Star& u, const StarMap::dist_index& g)
 std::pair<StarMap::edge_iterator, StarMap::edge_iterator>
 StellarCartography::edges(const StarMap& g)
 {
+    auto r = vertices(g);
     return std::make_pair(
-        StarMap::edge_iterator(g.begin(), g.end()),
-        StarMap::edge_iterator(g.end(), g.end())
+        StarMap::edge_iterator(r.first, r.second),
+        StarMap::edge_iterator(r.second, r.second)
     );
 }
 
@@ -508,13 +2122,13 @@ StellarCartography::num_edges(const StarMap& g)
 auto StellarCartography::edges(const StarMap::dist_index& g)
     -> decltype(edges(g))
 {
-    return { g.edges().begin(), g.edges().end() };
+    return g.edges();
 }
 
 auto StellarCartography::num_edges(const StarMap::dist_index& g)
     -> decltype(num_edges(g))
 {
-    return g.edges().size();
+    return g.numEdges();
 }
 
 auto StellarCartography::get(vertex_index_t, const StarMap& g)
@@ -523,25 +2137,20 @@ auto StellarCartography::get(vertex_index_t, const StarMap& g)
     return g.vertexIndexMap();
 }
 
-auto StellarCartography::get(
-    vertex_index_t p, const StarMap& g, const StarMap::vertex_descriptor& v)
-    -> StarMap::size_type
+StarId StellarCartography::get(vertex_index_t, const StarMap&, StarId v)
 {
-    return get(get(p, g), v);
+    return v;
 }
 
 auto StellarCartography::get(
     vertex_index_t p, const StarMap::dist_index& g)
     -> decltype(get(p, g))
 {
-    return get(p, g.parent());
+    return StarMap::dist_index::vertex_index_map();
 }
 
-auto StellarCartography::get(
-    vertex_index_t p, 
-    const StarMap::dist_index& g, 
-    const StarMap::dist_index::vertex_descriptor& v)
-    -> decltype(get(p, g, v))
+StarId StellarCartography::get(
+    vertex_index_t, const StarMap::dist_index&, StarId v)
 {
-    return get(get(p, g), v);
+    return v;
 }
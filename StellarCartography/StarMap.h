@@ -2,12 +2,17 @@
 #define SC_STAR_MAP_H
 
 #include "StellarCartography/Jump.h"
+#include "StellarCartography/MapFile.h"
 #include "StellarCartography/Star.h"
+#include "StellarCartography/ThresholdCache.h"
+#include "StellarCartography/Trace.h"
 
 #include <boost/container/flat_map.hpp>
 #include <boost/graph/graph_traits.hpp>
 #include <boost/graph/properties.hpp>
+#include <boost/iterator/counting_iterator.hpp>
 #include <boost/iterator/filter_iterator.hpp>
+#include <boost/iterator/iterator_facade.hpp>
 #include <boost/iterator/function_input_iterator.hpp>
 #include <boost/iterator/transform_iterator.hpp>
 #include <boost/multi_index/hashed_index.hpp>
@@ -15,10 +20,18 @@
 #include <boost/multi_index/ordered_index.hpp>
 #include <boost/multi_index/random_access_index.hpp>
 #include <boost/multi_index_container.hpp>
-#include <boost/property_map/function_property_map.hpp>
+#include <boost/property_map/property_map.hpp>
+#include <boost/range/iterator_range.hpp>
 #include <flann/flann.hpp>
+#include <condition_variable>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <pairs_iterator.hpp>
+#include <set>
 #include <unordered_map>
+#include <vector>
 
 namespace StellarCartography
 {
@@ -26,6 +39,110 @@ namespace StellarCartography
 using namespace boost;
 using namespace boost::multi_index;
 
+/* Dense index of a Star within its StarMap. Used as the graph vertex. */
+typedef std::uint32_t StarId;
+
+/* A (source, target) pair of StarIds. Used as the graph edge. */
+typedef std::pair<StarId, StarId> JumpId;
+
+class ConnectivityHierarchy;
+class UniformGrid;
+
+/* 
+ * How fixed-radius searches find candidates. Auto uses a UniformGrid when 
+ * the threshold allows tight cells and the kd-tree otherwise. Maps use the
+ * kd-tree unless told otherwise: the grid and Auto are opt-in, and stay so
+ * until spatialbench shows the grid beating the kd-tree with a real FLANN
+ * build. Each copy of a map has its own setting.
+ */
+enum class SpatialBackend
+{
+    Auto,
+    KdTree,
+    Grid
+};
+
+/*
+ * Heap use of a map by part, in bytes. These are estimates from the sizes
+ * of the containers involved, without allocator overhead. Copies of a map
+ * share most of this, so it's what they use between them.
+ */
+struct MemoryUsage
+{
+    std::size_t stars;          /* Stars and their names. */
+    std::size_t properties;     /* Stars' property maps. */
+    std::size_t star_indexes;   /* Lookup by position, name and coordinates. */
+    std::size_t coordinates;    /* Coordinates packed for searches. */
+    std::size_t spatial_tree;   /* The kd-tree, and coordinates only it uses. */
+    std::size_t pending_edits;  /* Edits the kd-tree doesn't have yet. */
+    std::size_t grid;
+    std::size_t hierarchy;
+
+    /* Each cached threshold graph, by threshold. */
+    std::vector<std::pair<double, std::size_t>> graphs;
+
+    std::size_t total() const
+    {
+        auto result = stars + properties + star_indexes + coordinates + 
+            spatial_tree + pending_edits + grid + hierarchy;
+        for (auto& g : graphs) result += g.second;
+        return result;
+    }
+};
+
+/* A star and its distance from a query point. */
+typedef std::pair<StarId, double> Neighbor;
+typedef std::vector<Neighbor> NeighborList;
+
+/*
+ * Results of a batch query, one row per query in the order given. The stars
+ * in each row are sorted by id, with the distance to each alongside.
+ */
+class NeighborTable
+{
+    typedef std::vector<std::size_t> offset_container;
+    typedef std::vector<StarId> neighbor_container;
+    typedef std::vector<double> distance_container;
+
+public:
+    typedef neighbor_container::const_iterator neighbor_iterator;
+    typedef distance_container::const_iterator distance_iterator;
+
+    NeighborTable() : offsets_(1, 0) { }
+
+    std::size_t size() const { return offsets_.size() - 1; }
+
+    iterator_range<neighbor_iterator> neighbors(std::size_t row) const
+    {
+        return { 
+            neighbors_.begin() + offsets_.at(row), 
+            neighbors_.begin() + offsets_.at(row + 1) 
+        };
+    }
+
+    iterator_range<distance_iterator> distances(std::size_t row) const
+    {
+        return { 
+            distances_.begin() + offsets_.at(row), 
+            distances_.begin() + offsets_.at(row + 1) 
+        };
+    }
+
+private:
+    friend class StarMap;
+
+    offset_container offsets_;
+    neighbor_container neighbors_;
+    distance_container distances_;
+};
+
+/*
+ * Const member functions may be called from any number of threads at once,
+ * on one map or on copies of it. Anything they build lazily, such as
+ * threshold graphs, is built once and shared. Any other call must not 
+ * overlap other calls on the same map, but copies are separate maps: one 
+ * can be edited while others are queried.
+ */
 class StarMap
 {
     typedef multi_index_container<
@@ -39,7 +156,6 @@ class StarMap
     > container_type;
 
     typedef flann::KDTreeSingleIndex<flann::L2<double>> spatial_type;
-    typedef std::unique_ptr<spatial_type> spatial_ptr_type;
     typedef std::vector<double> spatial_storage_type;
     typedef flann::Matrix<double> matrix_type;
 
@@ -55,6 +171,10 @@ class StarMap
     typedef container_type::nth_index<NameMapIndex>::type name_map_index;
     typedef container_type::nth_index<CoordinateIndex>::type coord_index;
 
+    struct Data;
+    struct Edit;
+    struct PendingEdits;
+
 public:
     /**************************************************************************/
     /* Constructors, destructors, assignment operators.                       */
@@ -66,6 +186,14 @@ public:
     StarMap(const std::initializer_list<Star>&);
     template<class It>
     explicit StarMap(It begin, It end); 
+    explicit StarMap(const MapFile& file);
+
+    /*
+     * Move stars into a new map. Those with the name or position of an
+     * earlier star are left out, and untouched, and their indexes are
+     * appended to dropped in order.
+     */
+    StarMap(std::vector<Star>&& stars, std::vector<std::size_t>& dropped);
 
     StarMap& operator=(const StarMap&);
     StarMap& operator=(StarMap&&);
@@ -100,8 +228,8 @@ public:
     /**************************************************************************/
     /* Graph concept requirements.                                            */
     /**************************************************************************/
-    typedef Star vertex_descriptor;
-    typedef Jump edge_descriptor;
+    typedef StarId vertex_descriptor;
+    typedef JumpId edge_descriptor;
     typedef boost::undirected_tag directed_category;
     typedef boost::disallow_parallel_edge_tag edge_parallel_category;
     struct traversal_category : 
@@ -110,19 +238,19 @@ public:
         public virtual boost::incidence_graph_tag
     { };
 
-    static Star null_vertex() { return Star(); }
+    static StarId null_vertex() { return std::numeric_limits<StarId>::max(); }
 
     /**************************************************************************/
     /* VertexListGraph concept requirements.                                  */
     /**************************************************************************/
     typedef size_type vertices_size_type;
-    typedef const_iterator vertex_iterator;
+    typedef counting_iterator<StarId> vertex_iterator;
     
     /**************************************************************************/
     /* IncidenceGraph concept requirements.                                   */
     /**************************************************************************/
-    typedef std::function<Jump(const Star&)> out_edge_iterator_fcn;
-    typedef std::function<bool(const Star&)> out_edge_filter_fcn;
+    typedef std::function<JumpId(StarId)> out_edge_iterator_fcn;
+    typedef std::function<bool(StarId)> out_edge_filter_fcn;
     typedef filter_iterator<out_edge_filter_fcn, vertex_iterator> 
         out_edge_iterator_base;
     typedef transform_iterator<out_edge_iterator_fcn, out_edge_iterator_base> 
@@ -133,17 +261,12 @@ public:
     /* EdgeListGraph concept requirements.                                    */
     /**************************************************************************/
     typedef size_type edges_size_type;
-    typedef pairs_iterator<vertex_iterator, Jump> edge_iterator;
+    typedef pairs_iterator<vertex_iterator, JumpId> edge_iterator;
 
     /**************************************************************************/
-    /* PropertyGraph(Star, vertex_index_t) concept requirements.              */
+    /* PropertyGraph(StarId, vertex_index_t) concept requirements.            */
     /**************************************************************************/
-    typedef std::function<size_type(vertex_descriptor)> vertex_index_fcn;
-    typedef function_property_map<
-        vertex_index_fcn, 
-        vertex_descriptor, 
-        size_type
-    > vertex_index_map;
+    typedef typed_identity_property_map<StarId> vertex_index_map;
 
     /**************************************************************************/
     /* Adaptor for the various graph concept requirements with edges filtered */
@@ -152,22 +275,70 @@ public:
     class dist_index
     {
         double t2_;
-        const StarMap *m_;
 
-        typedef JumpSet edge_container;
-        typedef std::unordered_map<Star, edge_container> edge_map;
+        /* 
+         * Compressed sparse row adjacency: the neighbors of star u are 
+         * neighbors_[offsets_[u]] .. neighbors_[offsets_[u + 1]], sorted 
+         * by id. If present, lengths_ runs parallel to neighbors_.
+         */
+        typedef std::vector<std::size_t> offset_container;
+        typedef std::vector<StarId> neighbor_container;
+        typedef std::vector<float> length_container;
 
     public:
-        dist_index(double t2, const StarMap *m) :
-            t2_(t2), m_(m)
-        { 
-            init(); 
-        }
-
-        const StarMap& parent() const { return *m_; }
-
-        const edge_container& edges() const { return edges_; }
-        const edge_container& neighbors(const Star& s) const;
+        typedef neighbor_container::const_iterator neighbor_iterator;
+        typedef length_container::const_iterator length_iterator;
+
+        class edge_iterator : 
+            public iterator_facade<
+                edge_iterator, JumpId, forward_traversal_tag, JumpId
+            >
+        {
+        public:
+            edge_iterator() : g_(nullptr), u_(0), i_(0) { }
+            edge_iterator(const dist_index *g, std::size_t i);
+
+        private:
+            friend class boost::iterator_core_access;
+
+            void increment();
+            void skip();
+            bool equal(const edge_iterator& o) const { return i_ == o.i_; }
+            JumpId dereference() const 
+            { 
+                return JumpId(u_, g_->neighbors_[i_]); 
+            }
+
+            const dist_index *g_;
+            StarId u_;
+            std::size_t i_;
+        };
+
+        struct out_edge_fcn
+        {
+            StarId u;
+            JumpId operator()(StarId v) const { return JumpId(u, v); }
+        };
+
+        dist_index(double t2, const StarMap *m, bool lengths = true);
+        dist_index(double t2, const dist_index& superset, const StarMap& m);
+        dist_index(
+            const dist_index& before, const Edit& edit, const StarMap& m);
+        dist_index(const MapFile::Blob& saved, const StarMap *m);
+
+        double thresholdSquared() const { return t2_; }
+        std::size_t numVertices() const { return offsets_.size() - 1; }
+
+        std::pair<edge_iterator, edge_iterator> edges() const;
+        std::size_t numEdges() const { return neighbors_.size() / 2; }
+
+        iterator_range<neighbor_iterator> neighbors(StarId s) const;
+
+        bool hasLengths() const { return !lengths_.empty(); }
+        iterator_range<length_iterator> lengths(StarId s) const;
+
+        std::size_t memoryUsage() const;
+        void write(MapFileWriter& out) const;
  
         /* Graph concept */
         typedef StarMap::vertex_descriptor vertex_descriptor;
@@ -176,45 +347,52 @@ public:
         typedef StarMap::edge_parallel_category edge_parallel_category;
         typedef StarMap::traversal_category traversal_category;
     
-        static Star null_vertex() { return Star(); }
+        static StarId null_vertex() { return StarMap::null_vertex(); }
 
         /* VertexListGraph concept */
         typedef StarMap::vertices_size_type vertices_size_type;
         typedef StarMap::vertex_iterator vertex_iterator;
 
         /* EdgeListGraph concept */
-        typedef edge_container::size_type edges_size_type;
-        typedef edge_container::const_iterator edge_iterator;
+        typedef std::size_t edges_size_type;
 
         /* IncidenceGraph concept */
-        typedef edge_map::value_type::second_type::const_iterator 
+        typedef transform_iterator<out_edge_fcn, neighbor_iterator> 
             out_edge_iterator;
-        typedef edge_map::value_type::second_type::size_type degree_size_type;
+        typedef std::size_t degree_size_type;
 
-        /* PropertyGraph(Star, vertex_index_t) concept */
+        /* PropertyGraph(StarId, vertex_index_t) concept */
         typedef StarMap::vertex_index_map vertex_index_map;
 
     private:
-        edge_container edges_;
-        edge_map neighbors_;
+        offset_container offsets_;
+        neighbor_container neighbors_;
+        length_container lengths_;
 
-        void init();
+        void init(const StarMap& m, bool lengths);
+        void checkId(StarId s) const;
     };
 
     /**************************************************************************/
     /* Container views.                                                       */
     /**************************************************************************/
-    const seq_index& byIndex() const { return stars_.get<SeqIndex>(); }
+    const seq_index& byIndex() const { return data_->stars.get<SeqIndex>(); }
     
     const name_seq_index& bySortedIndex() const 
-    { return stars_.get<NameSeqIndex>(); }
+    { return data_->stars.get<NameSeqIndex>(); }
 
-    const name_map_index& byName() const { return stars_.get<NameMapIndex>(); }
+    const name_map_index& byName() const 
+    { return data_->stars.get<NameMapIndex>(); }
 
     const coord_index& byCoordinate() const 
-    { return stars_.get<CoordinateIndex>(); }
+    { return data_->stars.get<CoordinateIndex>(); }
 
-    const dist_index& byDistance(double threshold) const; 
+    /* 
+     * Graphs handed out before an edit keep the stars and ids of the map as 
+     * it was.
+     */
+    typedef std::shared_ptr<const dist_index> dist_index_ptr;
+    dist_index_ptr byDistance(double threshold) const; 
 
     vertex_index_map vertexIndexMap() const; 
 
@@ -222,13 +400,57 @@ public:
     /* Algorithms                                                             */
     /**************************************************************************/
     Star getStar(const std::string& name) const;
-    size_type getIndex(const Star& star) const;
+    StarId getId(const std::string& name) const;
+    StarId getId(const Star& star) const;
+    Jump getJump(const JumpId& jump) const;
+
     Star nearestNeighbor(const std::string& name, double threshold) const;
     Star nearestNeighbor(const Star& star, double threshold) const;
 
     StarSet neighbors(const std::string& name, double threshold) const;
     StarSet neighbors(const Star& star, double threshold) const;
 
+    /* 
+     * The k stars closest to a star or point, nearest first. A star is never 
+     * its own neighbor. neighborsSorted() considers only stars closer than 
+     * the threshold and returns at most limit of them.
+     */
+    NeighborList knn(const std::string& name, std::size_t k) const;
+    NeighborList knn(const Star& star, std::size_t k) const;
+    NeighborList knn(const Coordinate& c, std::size_t k) const;
+
+    NeighborList neighborsSorted(
+        const std::string& name, 
+        double threshold, 
+        std::size_t limit = std::numeric_limits<std::size_t>::max()) const;
+    NeighborList neighborsSorted(
+        const Star& star, 
+        double threshold, 
+        std::size_t limit = std::numeric_limits<std::size_t>::max()) const;
+    NeighborList neighborsSorted(
+        const Coordinate& c, 
+        double threshold, 
+        std::size_t limit = std::numeric_limits<std::size_t>::max()) const;
+
+    /* 
+     * Batch versions of the above. A query by id excludes that star from its 
+     * own results. Rows with nothing in range are empty, and nearest rows 
+     * hold at most one star.
+     */
+    NeighborTable nearestNeighbors(
+        const std::vector<StarId>& stars, 
+        double threshold) const;
+    NeighborTable nearestNeighbors(
+        const std::vector<Coordinate>& coords, 
+        double threshold) const;
+
+    NeighborTable neighbors(
+        const std::vector<StarId>& stars, 
+        double threshold) const;
+    NeighborTable neighbors(
+        const std::vector<Coordinate>& coords, 
+        double threshold) const;
+
     StarList path(
         const std::string& from, 
         const std::string& to, 
@@ -238,24 +460,216 @@ public:
         const Star& to, 
         double threshold) const;
 
+    StarList shortestPath(
+        const std::string& from, 
+        const std::string& to, 
+        double threshold) const;
+    StarList shortestPath(
+        const Star& from, 
+        const Star& to, 
+        double threshold) const;
+
     StarSet reachable(const std::string& name, double threshold) const;
     StarSet reachable(const Star& star, double threshold) const;
 
     std::vector<StarSet> connectedComponents(double threshold) const;
+
+    /**************************************************************************/
+    /* Queries over all thresholds at once                                    */
+    /**************************************************************************/
+    std::shared_ptr<const ConnectivityHierarchy> hierarchy() const;
+
+    double minimumJumpRange(
+        const std::string& from, 
+        const std::string& to) const;
+    double minimumJumpRange(const Star& from, const Star& to) const;
+
+    size_type componentCount(double threshold) const;
+    StarSet component(const std::string& name, double threshold) const;
+    StarSet component(const Star& star, double threshold) const;
+
     Coordinate centerOfMass() const;
     double extent() const;
 
+    /**************************************************************************/
+    /* Threshold graph cache                                                  */
+    /**************************************************************************/
+    /* Copies of a map share its cache, and these settings with it. */
+    void setCacheBudget(std::size_t bytes);
+    void setCachePolicy(EvictionPolicy policy);
+    CacheStats cacheStats() const;
+    void clearCache();
+
+    MemoryUsage memoryUsage() const;
+
+    /**************************************************************************/
+    /* Editing                                                                */
+    /**************************************************************************/
+    /*
+     * Edits update the spatial index incrementally and patch the cached
+     * threshold graphs in place of rebuilding them. Erasing a star gives its
+     * id to the last star, so no other ids change.
+     */
+    StarId insert(const Star& star);
+    void erase(const std::string& name);
+    void erase(const Star& star);
+    void moveStar(const std::string& name, const Coordinate& to);
+    void moveStar(const Star& star, const Coordinate& to);
+
+    /**************************************************************************/
+    /* Binary files                                                           */
+    /**************************************************************************/
+    /*
+     * Save the map along with its kd-tree and the graphs for the given
+     * thresholds, which a map loaded from the file starts with in its cache.
+     * Loading copies everything out of the file, so the MapFile needn't
+     * outlive the map. Nothing is used in place: loading skips parsing and
+     * building the kd-tree, but still takes time and memory linear in the
+     * file, and processes loading one file each have their own copy.
+     */
+    void save(
+        const std::string& path, 
+        const std::vector<double>& thresholds = std::vector<double>()) const;
+
+    /**************************************************************************/
+    /* Spatial search                                                         */
+    /**************************************************************************/
+    SpatialBackend spatialBackend() const { return backend_; }
+    void setSpatialBackend(SpatialBackend backend);
+
 private:
-    typedef container::flat_map<double, dist_index> dist_index_cache;
+    typedef ThresholdCache<dist_index> dist_index_cache;
+
+    StarSet toStarSet(const std::vector<StarId>& ids) const;
+    StarId find(const Star& star) const;
+
+    NeighborList closest(
+        const Coordinate& c, 
+        StarId self, 
+        std::size_t k, 
+        double t2) const;
 
     template<class It>
     static spatial_storage_type initSpatialStorage(It begin, It end);
-    spatial_ptr_type initIndex();
 
-    container_type stars_;
-    spatial_storage_type  spatial_storage_;
-    mutable spatial_ptr_type spatial_index_;
-    mutable dist_index_cache dist_index_cache_;
+    std::shared_ptr<const UniformGrid> grid(double t2, bool build) const;
+
+    Data& mutate();
+    spatial_storage_type& writableCoords();
+    PendingEdits& writablePending();
+    void detach();
+    void retire(StarId s);
+    void commit(const Edit& edit);
+    void merge() const;
+
+    typedef std::vector<std::pair<StarId, double>> hit_list;
+
+    template<class F>
+    void radiusSearch(
+        const double *queries, 
+        std::size_t n, 
+        double t2, 
+        const UniformGrid *grid, 
+        F f) const;
+
+    NeighborTable batchSearch(
+        const std::vector<double>& queries, 
+        const StarId *self, 
+        double threshold,
+        bool nearest) const;
+
+    /* A kd-tree and the coordinates it was built from. */
+    struct SpatialTree
+    {
+        typedef std::shared_ptr<const spatial_storage_type> coords_ptr;
+
+        explicit SpatialTree(coords_ptr coords);
+        SpatialTree(coords_ptr coords, const MapFile::Blob& saved);
+
+        coords_ptr coords;
+        spatial_type index;
+    };
+
+    /*
+     * Edits since the kd-tree was last built. Stars erased or moved since 
+     * are dead in the tree, and stars inserted or moved are kept in a list
+     * that is searched linearly until the tree is rebuilt.
+     */
+    struct PendingEdits
+    {
+        PendingEdits() : dead(0), detached(false) { }
+
+        std::vector<StarId> ids;        /* Tree slot to star, if alive. */
+        std::vector<StarId> slots;      /* Star to tree slot, if any. */
+        std::vector<StarId> added;      /* Stars not in the tree. */
+        std::size_t dead;
+        bool detached;
+    };
+
+    /* 
+     * The kd-tree and the edits since it was built. Queries work from a 
+     * snapshot of this, so rebuilding the tree can swap in a new one while
+     * other threads are still searching the old.
+     */
+    struct SpatialState
+    {
+        explicit SpatialState(std::shared_ptr<const SpatialTree> t) : tree(t)
+        {
+        }
+
+        std::shared_ptr<const SpatialTree> tree;
+        PendingEdits pending;
+    };
+
+    std::shared_ptr<const SpatialState> spatial() const;
+
+    /*
+     * Guards the parts of the shared data that const queries fill in. Each
+     * of those is built with this unlocked, after marking it as underway so
+     * that other threads wait for it rather than build it again. A copy of
+     * the data gets a fresh one.
+     */
+    struct Sync
+    {
+        Sync() : merging(false), building_hierarchy(false) { }
+        Sync(const Sync&) : Sync() { }
+        Sync& operator=(const Sync&) { return *this; }
+
+        std::mutex mutex;
+        std::condition_variable done;
+        std::set<double> building;
+        bool merging;
+        bool building_hierarchy;
+    };
+
+    /*
+     * Everything a map holds, shared between copies until one of them is 
+     * edited. The edited copy clones this, but the clone still shares the 
+     * coordinates and kd-tree until they change, and its cached graphs are 
+     * patched rather than rebuilt. The caches are filled lazily by whichever
+     * copy needs them first, under sync.
+     */
+    struct Data
+    {
+        template<class It>
+        Data(It begin, It end);
+        explicit Data(const MapFile& file);
+        Data(std::vector<Star>&& stars, std::vector<std::size_t>& dropped);
+
+        container_type stars;
+        std::shared_ptr<spatial_storage_type> coords;
+        std::shared_ptr<SpatialState> spatial;
+        dist_index_cache dist_indexes;
+        std::shared_ptr<const ConnectivityHierarchy> hierarchy;
+        double grid_t2;
+        std::shared_ptr<const UniformGrid> grid;
+        Sync sync;
+    };
+
+    static std::shared_ptr<Data> emptyData();
+
+    std::shared_ptr<Data> data_;
+    SpatialBackend backend_;
 };
 
 std::pair<StarMap::vertex_iterator,StarMap::vertex_iterator>
@@ -273,25 +687,25 @@ num_vertices(const StarMap& g);
 StarMap::dist_index::vertices_size_type
 num_vertices(const StarMap::dist_index& g);
 
-Star source(const Jump& j, const StarMap& g);
-Star target(const Jump& j, const StarMap& g);
-Star source(const Jump& j, const StarMap::dist_index& g);
-Star target(const Jump& j, const StarMap::dist_index& g);
+StarId source(const JumpId& j, const StarMap& g);
+StarId target(const JumpId& j, const StarMap& g);
+StarId source(const JumpId& j, const StarMap::dist_index& g);
+StarId target(const JumpId& j, const StarMap::dist_index& g);
 
 std::pair<StarMap::out_edge_iterator,StarMap::out_edge_iterator>
-out_edges(const Star& u, const StarMap& g);
+out_edges(StarId u, const StarMap& g);
 
 StarMap::degree_size_type
-out_degree(const Star& u, const StarMap& g);
+out_degree(StarId u, const StarMap& g);
 
 std::pair<
     StarMap::dist_index::out_edge_iterator,
     StarMap::dist_index::out_edge_iterator
 >
-out_edges(const Star& u, const StarMap::dist_index& g);
+out_edges(StarId u, const StarMap::dist_index& g);
 
 StarMap::dist_index::degree_size_type
-out_degree(const Star& u, const StarMap::dist_index& g);
+out_degree(StarId u, const StarMap::dist_index& g);
 
 std::pair<StarMap::edge_iterator,StarMap::edge_iterator>
 edges(const StarMap& g);
@@ -309,23 +723,19 @@ StarMap::dist_index::edges_size_type
 num_edges(const StarMap::dist_index& g);
 
 StarMap::vertex_index_map get(vertex_index_t, const StarMap& g);
-StarMap::size_type get(
-    vertex_index_t, const StarMap& g, const StarMap::vertex_descriptor& x);
+StarId get(vertex_index_t, const StarMap& g, StarId x);
 
 StarMap::dist_index::vertex_index_map 
 get(vertex_index_t, const StarMap::dist_index& g);
 
-StarMap::dist_index::vertices_size_type get(
-    vertex_index_t, 
-    const StarMap::dist_index& g, 
-    const StarMap::dist_index::vertex_descriptor& x);
+StarId get(vertex_index_t, const StarMap::dist_index& g, StarId x);
 
 template<class It>
 auto StarMap::initSpatialStorage(It begin, It end)
     -> spatial_storage_type
 {
     spatial_storage_type result;
-    result.reserve(distance(begin, end) * 3);
+    result.reserve(std::distance(begin, end) * 3);
 
     for (auto it = begin; it != end; ++it)
     {
@@ -337,13 +747,21 @@ auto StarMap::initSpatialStorage(It begin, It end)
     return result;
 }
 
+template<class It>
+StarMap::Data::Data(It begin, It end) : grid_t2(0)
+{
+    Trace::Scope scope("StarMap::StarMap");
+    stars.insert(stars.end(), begin, end);
+    coords = std::make_shared<spatial_storage_type>(
+        initSpatialStorage(stars.begin(), stars.end()));
+    spatial = std::make_shared<SpatialState>(
+        std::make_shared<SpatialTree>(coords));
+}
+
 template<class It>
 StarMap::StarMap(It begin, It end) : 
-    stars_(begin, end), 
-    spatial_storage_(
-        std::move(initSpatialStorage(begin, end))
-    ),
-    spatial_index_(std::move(initIndex()))
+    data_(std::make_shared<Data>(begin, end)),
+    backend_(SpatialBackend::KdTree)
 {
 }
 
@@ -0,0 +1,233 @@
+#ifndef SC_THRESHOLD_CACHE_H
+#define SC_THRESHOLD_CACHE_H
+
+#include <boost/container/flat_map.hpp>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace StellarCartography
+{
+
+enum class EvictionPolicy
+{
+    LRU,
+    LFU
+};
+
+struct CacheStats
+{
+    std::size_t hits;
+    std::size_t misses;
+    std::size_t evictions;
+    std::size_t entries;
+    std::size_t bytes;
+    std::size_t budget;
+};
+
+/*
+ * A cache of immutable values keyed by distance threshold, bounded by the
+ * total memory footprint of its entries as reported by T::memoryUsage().
+ * When an insertion takes the cache over budget, other entries are evicted
+ * in LRU or LFU order until it fits again. The entry being inserted is never
+ * evicted, so a single entry larger than the budget is still cached until the
+ * next insertion. Entries are handed out as shared pointers, so evicting one
+ * never invalidates a value that is still in use.
+ */
+template<class T>
+class ThresholdCache
+{
+public:
+    typedef std::shared_ptr<const T> value_ptr;
+
+    static constexpr std::size_t unbounded()
+    {
+        return std::numeric_limits<std::size_t>::max();
+    }
+
+    explicit ThresholdCache(
+        std::size_t budget = unbounded(),
+        EvictionPolicy policy = EvictionPolicy::LRU) :
+        budget_(budget), policy_(policy),
+        clock_(0), bytes_(0), hits_(0), misses_(0), evictions_(0)
+    {
+    }
+
+    value_ptr find(double key);
+    value_ptr ceiling(double key) const;
+    value_ptr insert(double key, value_ptr value);
+    void clear();
+
+    template<class F>
+    void transform(F f);
+
+    std::size_t budget() const { return budget_; }
+    void setBudget(std::size_t budget);
+
+    EvictionPolicy policy() const { return policy_; }
+    void setPolicy(EvictionPolicy policy) { policy_ = policy; }
+
+    CacheStats stats() const;
+
+    /* Each entry's key and size in bytes, in key order. */
+    std::vector<std::pair<double, std::size_t>> sizes() const;
+
+private:
+    struct Entry
+    {
+        value_ptr value;
+        std::size_t bytes;
+        std::uint64_t last_use;
+        std::uint64_t uses;
+    };
+    typedef boost::container::flat_map<double, Entry> entry_map;
+
+    void shrink(double keep);
+    typename entry_map::iterator victim(double keep);
+
+    std::size_t budget_;
+    EvictionPolicy policy_;
+    entry_map entries_;
+    std::uint64_t clock_;
+    std::size_t bytes_;
+    std::size_t hits_;
+    std::size_t misses_;
+    std::size_t evictions_;
+};
+
+template<class T>
+auto ThresholdCache<T>::find(double key)
+    -> value_ptr
+{
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+    {
+        ++misses_;
+        return value_ptr();
+    }
+
+    ++hits_;
+    it->second.last_use = ++clock_;
+    ++it->second.uses;
+    return it->second.value;
+}
+
+/*
+ * Return the entry with the smallest key greater than the given key, if any. 
+ * This is not counted as a hit or a use of that entry.
+ */
+template<class T>
+auto ThresholdCache<T>::ceiling(double key) const
+    -> value_ptr
+{
+    auto it = entries_.upper_bound(key);
+    return (it != entries_.end()) ? it->second.value : value_ptr();
+}
+
+template<class T>
+auto ThresholdCache<T>::insert(double key, value_ptr value)
+    -> value_ptr
+{
+    auto& e = entries_[key];
+    bytes_ -= e.value ? e.bytes : 0;
+
+    e.value = value;
+    e.bytes = value->memoryUsage();
+    e.last_use = ++clock_;
+    e.uses = 1;
+    bytes_ += e.bytes;
+
+    shrink(key);
+    return value;
+}
+
+template<class T>
+void ThresholdCache<T>::clear()
+{
+    entries_.clear();
+    bytes_ = 0;
+}
+
+/* 
+ * Replace every value v with f(v), keeping each entry's usage history. 
+ * The new values may have a different size, so this can evict entries.
+ */
+template<class T>
+template<class F>
+void ThresholdCache<T>::transform(F f)
+{
+    bytes_ = 0;
+    for (auto& e : entries_)
+    {
+        e.second.value = f(*e.second.value);
+        e.second.bytes = e.second.value->memoryUsage();
+        bytes_ += e.second.bytes;
+    }
+    shrink(std::numeric_limits<double>::quiet_NaN());
+}
+
+template<class T>
+void ThresholdCache<T>::setBudget(std::size_t budget)
+{
+    budget_ = budget;
+    shrink(std::numeric_limits<double>::quiet_NaN());
+}
+
+template<class T>
+auto ThresholdCache<T>::sizes() const
+    -> std::vector<std::pair<double, std::size_t>>
+{
+    std::vector<std::pair<double, std::size_t>> result;
+    result.reserve(entries_.size());
+    for (auto& e : entries_) result.emplace_back(e.first, e.second.bytes);
+    return result;
+}
+
+template<class T>
+CacheStats ThresholdCache<T>::stats() const
+{
+    return {
+        hits_, misses_, evictions_, entries_.size(), bytes_, budget_
+    };
+}
+
+template<class T>
+void ThresholdCache<T>::shrink(double keep)
+{
+    while (bytes_ > budget_)
+    {
+        auto it = victim(keep);
+        if (it == entries_.end()) break;
+
+        bytes_ -= it->second.bytes;
+        entries_.erase(it);
+        ++evictions_;
+    }
+}
+
+template<class T>
+auto ThresholdCache<T>::victim(double keep)
+    -> typename entry_map::iterator
+{
+    auto older = [this](const Entry& l, const Entry& r)
+    {
+        if (policy_ == EvictionPolicy::LFU && l.uses != r.uses)
+            return l.uses < r.uses;
+        return l.last_use < r.last_use;
+    };
+
+    auto result = entries_.end();
+    for (auto it = entries_.begin(); it != entries_.end(); ++it)
+    {
+        if (it->first == keep) continue;
+        if (result == entries_.end() || older(it->second, result->second))
+            result = it;
+    }
+    return result;
+}
+
+} /* namespace StellarCartography */
+
+#endif /* SC_THRESHOLD_CACHE_H */
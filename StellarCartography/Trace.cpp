@@ -0,0 +1,223 @@
+#include "StellarCartography/Trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+using namespace StellarCartography;
+using namespace StellarCartography::Trace;
+
+namespace
+{
+
+/* Events kept per thread; older ones are overwritten. */
+const std::size_t ring_size = 1 << 14;
+
+std::atomic<bool> active(false);
+
+/* Events that began before this weren't part of the trace. */
+std::atomic<std::uint64_t> trace_begin(0);
+
+std::uint64_t now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Event
+{
+    std::atomic<const char*> name;
+    std::atomic<std::uint64_t> begin;
+    std::atomic<std::uint64_t> end;
+};
+
+/*
+ * One thread's events. Only that thread writes them, publishing each by
+ * bumping head, and a reader takes a slot as valid if head shows it wasn't
+ * being overwritten while it was read.
+ */
+struct Ring
+{
+    explicit Ring(unsigned t) : tid(t), events(new Event[ring_size]), head(0),
+        exited(false)
+    {
+    }
+
+    void push(const char *name, std::uint64_t begin, std::uint64_t end)
+    {
+        auto i = head.load(std::memory_order_relaxed);
+        auto& e = events[i % ring_size];
+        e.name.store(name, std::memory_order_relaxed);
+        e.begin.store(begin, std::memory_order_relaxed);
+        e.end.store(end, std::memory_order_relaxed);
+        head.store(i + 1, std::memory_order_release);
+    }
+
+    unsigned tid;
+    std::unique_ptr<Event[]> events;
+    std::atomic<std::uint64_t> head;
+    std::atomic<bool> exited;
+};
+
+struct Registry
+{
+    Registry() : next_tid(1) { }
+
+    std::mutex mutex;
+    std::vector<std::shared_ptr<Ring>> rings;
+    unsigned next_tid;
+};
+
+Registry& registry()
+{
+    static Registry r;
+    return r;
+}
+
+/* The calling thread's ring, made when it first records an event. */
+struct LocalRing
+{
+    ~LocalRing()
+    {
+        if (ring) ring->exited.store(true, std::memory_order_relaxed);
+    }
+
+    Ring& get()
+    {
+        if (!ring)
+        {
+            auto& r = registry();
+            std::lock_guard<std::mutex> lock(r.mutex);
+            ring = std::make_shared<Ring>(r.next_tid++);
+            r.rings.push_back(ring);
+        }
+        return *ring;
+    }
+
+    std::shared_ptr<Ring> ring;
+};
+
+Ring& local()
+{
+    static thread_local LocalRing ring;
+    return ring.get();
+}
+
+void writeName(std::ostream& os, const char *name)
+{
+    for (auto p = name; *p; ++p)
+    {
+        if (*p == '"' || *p == '\\') os << '\\';
+        if (static_cast<unsigned char>(*p) >= 0x20) os << *p;
+    }
+}
+
+/* Microseconds, as Chrome expects, to the nanosecond. */
+void writeMicros(std::ostream& os, std::uint64_t ns)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%llu.%03u",
+        static_cast<unsigned long long>(ns / 1000),
+        static_cast<unsigned>(ns % 1000));
+    os << buf;
+}
+
+}
+
+void Trace::start()
+{
+    auto& r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+
+    /* Threads that have exited have nothing more to add. */
+    r.rings.erase(
+        std::remove_if(r.rings.begin(), r.rings.end(),
+            [](const std::shared_ptr<Ring>& ring)
+            {
+                return ring->exited.load(std::memory_order_relaxed);
+            }),
+        r.rings.end()
+    );
+
+    trace_begin.store(now(), std::memory_order_relaxed);
+    active.store(true, std::memory_order_release);
+}
+
+std::size_t Trace::stop(std::ostream& os)
+{
+    active.store(false, std::memory_order_relaxed);
+    auto begin = trace_begin.load(std::memory_order_relaxed);
+
+    std::vector<std::shared_ptr<Ring>> rings;
+    {
+        auto& r = registry();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        rings = r.rings;
+    }
+
+    std::size_t count = 0;
+    os << "{\"traceEvents\":[";
+    for (auto& ring : rings)
+    {
+        auto head = ring->head.load(std::memory_order_acquire);
+        auto first = head > ring_size ? head - ring_size : 0;
+
+        struct Copy { const char *name; std::uint64_t begin, end; };
+        std::vector<Copy> copies;
+        for (auto i = first; i < head; ++i)
+        {
+            auto& e = ring->events[i % ring_size];
+            copies.push_back({
+                e.name.load(std::memory_order_relaxed),
+                e.begin.load(std::memory_order_relaxed),
+                e.end.load(std::memory_order_relaxed)
+            });
+        }
+
+        /*
+         * Slots the thread moved on to while they were copied may be torn,
+         * including the one it's writing now.
+         */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        auto after = ring->head.load(std::memory_order_relaxed);
+        auto valid = after + 1 > ring_size + first ?
+            after + 1 - ring_size - first : 0;
+
+        for (auto i = valid; i < copies.size(); ++i)
+        {
+            auto& e = copies[i];
+            if (e.begin < begin) continue;
+
+            os << (count++ ? ",\n" : "\n") << "{\"name\":\"";
+            writeName(os, e.name);
+            os << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->tid
+               << ",\"ts\":";
+            writeMicros(os, e.begin - begin);
+            os << ",\"dur\":";
+            writeMicros(os, e.end - e.begin);
+            os << "}";
+        }
+    }
+    os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return count;
+}
+
+bool Trace::recording()
+{
+    return active.load(std::memory_order_acquire);
+}
+
+Trace::Scope::Scope(const char *name) :
+    name_(recording() ? name : nullptr),
+    begin_(name_ ? now() : 0)
+{
+}
+
+Trace::Scope::~Scope()
+{
+    if (name_) local().push(name_, begin_, now());
+}
@@ -0,0 +1,52 @@
+#ifndef SC_TRACE_H
+#define SC_TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace StellarCartography
+{
+
+/*
+ * Timed scopes around the library's phases, recorded while a trace is
+ * running and written out in the Chrome trace event format, for
+ * chrome://tracing or Perfetto. Each thread records into its own ring
+ * buffer without locks, so a long trace keeps the latest events of each
+ * thread. When no trace is running, a scope costs one atomic load.
+ */
+namespace Trace
+{
+
+/* Start a trace, leaving out anything recorded before. */
+void start();
+
+/*
+ * Stop the trace and write its events as JSON. Returns how many events
+ * were written.
+ */
+std::size_t stop(std::ostream& os);
+
+bool recording();
+
+/* Records the time from construction to destruction as one event. */
+class Scope
+{
+public:
+    /* The name must outlive the trace, so is usually a literal. */
+    explicit Scope(const char *name);
+    ~Scope();
+
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+private:
+    const char *name_;
+    std::uint64_t begin_;
+};
+
+} /* namespace Trace */
+
+} /* namespace StellarCartography */
+
+#endif /* SC_TRACE_H */
@@ -0,0 +1,122 @@
+#include "StellarCartography/UniformGrid.h"
+
+#include <limits>
+
+using namespace StellarCartography;
+
+namespace
+{
+
+/* Dense storage allows this many cells per point before the cells grow. */
+const std::size_t max_cells_per_point = 8;
+
+/*
+ * Cells are made slightly wider than the radius so that rounding in the
+ * cell computation can't put two points within the radius more than one
+ * cell apart.
+ */
+const double cell_slack = 1.0 + 1e-6;
+
+/* The bounding box of n points, or the origin if there are none. */
+void bounds(const double *coords, std::size_t n, double *lo, double *hi)
+{
+    for (int d = 0; d < 3; ++d)
+    {
+        lo[d] = n ? std::numeric_limits<double>::max() : 0.0;
+        hi[d] = n ? std::numeric_limits<double>::lowest() : 0.0;
+    }
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        for (int d = 0; d < 3; ++d)
+        {
+            lo[d] = std::min(lo[d], coords[3 * i + d]);
+            hi[d] = std::max(hi[d], coords[3 * i + d]);
+        }
+    }
+}
+
+/*
+ * Widen cell until the grid over [lo, hi] has few enough cells for n points,
+ * storing the number along each axis in dims. Returns whether the cells
+ * stayed as given.
+ */
+bool layout(
+    const double *lo, const double *hi, std::size_t n,
+    double& cell, std::size_t *dims)
+{
+    double span = 0.0;
+    for (int d = 0; d < 3; ++d) span = std::max(span, hi[d] - lo[d]);
+    if (!(cell > 0.0)) cell = (span > 0.0) ? span : 1.0;
+
+    bool tight = true;
+    auto max_cells = max_cells_per_point * n + 64;
+    for (;;)
+    {
+        double cells = 1.0;
+        for (int d = 0; d < 3; ++d)
+        {
+            dims[d] = static_cast<std::size_t>((hi[d] - lo[d]) / cell) + 1;
+            cells *= dims[d];
+        }
+        if (cells <= max_cells) return tight;
+
+        cell *= std::max(std::cbrt(cells / max_cells), 1.25);
+        tight = false;
+    }
+}
+
+}
+
+UniformGrid::UniformGrid(const double *coords, std::size_t n, double radius) :
+    radius_(radius), cell_(radius * cell_slack)
+{
+    double hi[3];
+    bounds(coords, n, lo_, hi);
+    tight_ = layout(lo_, hi, n, cell_, dims_);
+
+    std::vector<std::size_t> which(n);
+    offsets_.assign(dims_[0] * dims_[1] * dims_[2] + 1, 0);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto p = coords + 3 * i;
+        which[i] = (cell(0, p[0]) * dims_[1] + cell(1, p[1])) * dims_[2]
+            + cell(2, p[2]);
+        ++offsets_[which[i] + 1];
+    }
+    for (std::size_t c = 1; c < offsets_.size(); ++c)
+        offsets_[c] += offsets_[c - 1];
+
+    auto next = offsets_;
+    ids_.resize(n);
+    points_.resize(3 * n);
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        auto k = next[which[i]]++;
+        ids_[k] = i;
+        std::copy(coords + 3 * i, coords + 3 * i + 3, &points_[3 * k]);
+    }
+}
+
+bool UniformGrid::tight(const double *coords, std::size_t n, double radius)
+{
+    double lo[3], hi[3], cell = radius * cell_slack;
+    std::size_t dims[3];
+    bounds(coords, n, lo, hi);
+    return layout(lo, hi, n, cell, dims);
+}
+
+std::size_t UniformGrid::memoryUsage() const
+{
+    return sizeof(*this)
+        + offsets_.capacity() * sizeof(id_type)
+        + ids_.capacity() * sizeof(id_type)
+        + points_.capacity() * sizeof(double);
+}
+
+std::size_t UniformGrid::cell(int d, double x) const
+{
+    double c = std::floor((x - lo_[d]) / cell_);
+    if (!(c > 0.0)) return 0;
+    return std::min(static_cast<std::size_t>(
+        std::min(c, static_cast<double>(dims_[d]))), dims_[d] - 1);
+}
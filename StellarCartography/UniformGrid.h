@@ -0,0 +1,103 @@
+#ifndef SC_UNIFORM_GRID_H
+#define SC_UNIFORM_GRID_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace StellarCartography
+{
+
+/*
+ * A cell list for fixed-radius searches. Points are bucketed into cubic
+ * cells at least as wide as the search radius, so everything within the
+ * radius of a point lies in the 3x3x3 block of cells around it. Points are
+ * copied in cell order, so a search reads a few contiguous runs of memory
+ * instead of walking a tree.
+ *
+ * The cells are stored densely, so their number is capped relative to the
+ * number of points. For radii small compared to the spread of the points,
+ * the cells grow beyond the radius and the grid is no longer tight(); it
+ * still gives exact results, just more slowly.
+ */
+class UniformGrid
+{
+public:
+    typedef std::uint32_t id_type;
+
+    UniformGrid(const double *coords, std::size_t n, double radius);
+
+    double radius() const { return radius_; }
+    double cellSize() const { return cell_; }
+    bool tight() const { return tight_; }
+
+    /*
+     * Call f(id, d2) for every point whose squared distance d2 from q is
+     * less than t2, which must be at most radius() squared.
+     */
+    template<class F>
+    void near(const double *q, double t2, F f) const;
+
+    std::size_t memoryUsage() const;
+
+    /*
+     * Whether a grid over these points would be tight(), found from their
+     * bounding box alone without bucketing or copying them.
+     */
+    static bool tight(const double *coords, std::size_t n, double radius);
+
+private:
+    std::size_t cell(int d, double x) const;
+
+    double lo_[3];
+    std::size_t dims_[3];
+    double radius_;
+    double cell_;
+    bool tight_;
+
+    std::vector<id_type> offsets_;
+    std::vector<id_type> ids_;
+    std::vector<double> points_;
+};
+
+template<class F>
+void UniformGrid::near(const double *q, double t2, F f) const
+{
+    std::size_t lo[3], hi[3];
+    for (int d = 0; d < 3; ++d)
+    {
+        /* Anything outside the grid by more than a cell can't match. */
+        double x = (q[d] - lo_[d]) / cell_;
+        if (x < -1.0 || x >= dims_[d] + 1.0) return;
+
+        auto c = cell(d, q[d]);
+        lo[d] = (c > 0) ? c - 1 : 0;
+        hi[d] = std::min(c + 1, dims_[d] - 1);
+    }
+
+    for (auto i = lo[0]; i <= hi[0]; ++i)
+    {
+        for (auto j = lo[1]; j <= hi[1]; ++j)
+        {
+            /* Cells along z are adjacent, so scan them as one run. */
+            auto row = (i * dims_[1] + j) * dims_[2];
+            auto begin = offsets_[row + lo[2]];
+            auto end = offsets_[row + hi[2] + 1];
+
+            for (auto k = begin; k < end; ++k)
+            {
+                auto p = points_.data() + 3 * k;
+                double d2 = 0.0;
+                for (int d = 0; d < 3; ++d)
+                    d2 += (q[d] - p[d]) * (q[d] - p[d]);
+                if (d2 < t2) f(ids_[k], d2);
+            }
+        }
+    }
+}
+
+} /* namespace StellarCartography */
+
+#endif /* SC_UNIFORM_GRID_H */
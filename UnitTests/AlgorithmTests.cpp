@@ -2,6 +2,8 @@
 
 #include "StellarCartography/Algorithms.h"
 
+#include <random>
+
 using namespace StellarCartography;
 
 SC_TEST_SUITE(AlgorithmTests)
@@ -9,18 +11,34 @@ SC_TEST_SUITE(AlgorithmTests)
 namespace
 {
 
+typedef std::pair<Coordinate, double> Arg;
+typedef std::vector<Arg> ArgList;
+
 double error(const Coordinate& p1, const Coordinate& p2)
 {
     return p1.distance(p2);
 }
 
+/* Beacons scattered around p, with their distances from it plus noise. */
+ArgList beacons(const Coordinate& p, std::size_t n, double noise)
+{
+    std::mt19937 rng(n);
+    std::uniform_real_distribution<double> coord(-50.0, 50.0);
+    std::normal_distribution<double> err(0.0, noise);
+
+    ArgList result;
+    for (std::size_t i = 0; i < n; ++i)
+    {
+        Coordinate c { coord(rng), coord(rng), coord(rng) };
+        result.emplace_back(c, c.distance(p) + (noise ? err(rng) : 0.0));
+    }
+    return result;
+}
+
 }
 
 SC_TEST_CASE(AlgorithmTests, TrilaterateTests)
 {
-    typedef std::pair<Coordinate, double> Arg;
-    typedef std::vector<Arg> ArgList;
-
     ArgList args {
         { { 2.0, 1.0, 1.0 }, 1.0 },
         { { 1.0, 2.0, 1.0 }, 1.0 },
@@ -42,4 +60,71 @@ SC_TEST_CASE(AlgorithmTests, TrilaterateTests)
 }
 SC_TEST_CASE_END()
 
+SC_TEST_CASE(AlgorithmTests, TrilaterateLeastSquaresTests)
+{
+    Coordinate p = { 3.0, -7.0, 11.0 };
+
+    for (std::size_t n : { 4, 5, 40 })
+    {
+        auto args = beacons(p, n, 0.0);
+        BOOST_CHECK_SMALL(
+            error(p, trilaterate(args.begin(), args.end())), 1e-6);
+    }
+
+    /* Noise averages out over many beacons. */
+    auto noisy = beacons(p, 400, 0.1);
+    BOOST_CHECK_SMALL(error(p, trilaterate(noisy.begin(), noisy.end())), 0.1);
+
+    /* Beacons in a plane can't tell p from its mirror image. */
+    ArgList flat;
+    for (auto& a : beacons(p, 10, 0.0))
+    {
+        Coordinate c { a.first.x(), a.first.y(), 0.0 };
+        flat.emplace_back(c, c.distance(p));
+    }
+    auto q = trilaterate(flat.begin(), flat.end());
+    Coordinate mirror { p.x(), p.y(), -p.z() };
+    BOOST_CHECK_SMALL(std::min(error(p, q), error(mirror, q)), 1e-6);
+
+    ArgList line;
+    for (int i = 0; i < 5; ++i)
+    {
+        Coordinate c { double(i), 0.0, 0.0 };
+        line.emplace_back(c, c.distance(p));
+    }
+    BOOST_CHECK_THROW(
+        trilaterate(line.begin(), line.end()), std::invalid_argument);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(AlgorithmTests, TrilaterateRansacTests)
+{
+    Coordinate p = { 3.0, -7.0, 11.0 };
+    auto args = beacons(p, 40, 0.0);
+    for (std::size_t i = 0; i < args.size(); i += 5) args[i].second += 25.0;
+
+    BOOST_CHECK(error(p, trilaterate(args.begin(), args.end())) > 1.0);
+    BOOST_CHECK_SMALL(
+        error(p, trilaterateRansac(args.begin(), args.end(), 0.01)), 1e-6);
+
+    /* Outliers among beacons in a plane are left out too. */
+    ArgList flat;
+    for (auto& a : args)
+    {
+        Coordinate c { a.first.x(), a.first.y(), 0.0 };
+        flat.emplace_back(c, c.distance(p) + (a.second - a.first.distance(p)));
+    }
+    Coordinate mirror { p.x(), p.y(), -p.z() };
+    auto q = trilaterate(flat.begin(), flat.end());
+    BOOST_CHECK(std::min(error(p, q), error(mirror, q)) > 1.0);
+    q = trilaterateRansac(flat.begin(), flat.end(), 0.01);
+    BOOST_CHECK_SMALL(std::min(error(p, q), error(mirror, q)), 1e-6);
+
+    /* With nothing to leave out it's the same as least squares. */
+    auto exact = beacons(p, 4, 0.0);
+    BOOST_CHECK_SMALL(
+        error(p, trilaterateRansac(exact.begin(), exact.end(), 0.01)), 1e-6);
+}
+SC_TEST_CASE_END()
+
 SC_TEST_SUITE_END()
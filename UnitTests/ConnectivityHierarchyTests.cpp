@@ -0,0 +1,108 @@
+#include "Tests.h"
+
+#include <random>
+#include "StellarCartography/ConnectivityHierarchy.h"
+
+using namespace StellarCartography;
+
+SC_TEST_SUITE(ConnectivityHierarchyTests)
+
+namespace
+{
+
+StarMap randomGalaxy(int n, double size, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::uniform_real_distribution<double> coord(0.0, size);
+    std::vector<Star> stars;
+    for (int i = 0; i < n; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    return StarMap(stars.begin(), stars.end());
+}
+
+}
+
+SC_TEST_CASE(ConnectivityHierarchyTests, TestEmpty)
+{
+    StarMap g;
+    ConnectivityHierarchy h(g);
+
+    BOOST_CHECK_EQUAL(0, h.componentCount(1.0));
+    BOOST_CHECK(h.components(1.0).empty());
+
+    StarMap one { { "a", { 1.0, 2.0, 3.0 } } };
+    ConnectivityHierarchy h1(one);
+
+    BOOST_CHECK_EQUAL(1, h1.componentCount(0.0));
+    BOOST_CHECK_EQUAL(1, h1.component(0, 1.0).size());
+    BOOST_CHECK_EQUAL(0.0, h1.bottleneck(0, 0));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(ConnectivityHierarchyTests, TestLine)
+{
+    StarMap g 
+    {
+        { "a", { 0.0, 0.0, 0.0 } },
+        { "b", { 1.0, 0.0, 0.0 } },
+        { "c", { 3.0, 0.0, 0.0 } },
+        { "d", { 6.0, 0.0, 0.0 } }
+    };
+
+    BOOST_CHECK_EQUAL(1.0, g.minimumJumpRange("a", "b"));
+    BOOST_CHECK_EQUAL(2.0, g.minimumJumpRange("a", "c"));
+    BOOST_CHECK_EQUAL(3.0, g.minimumJumpRange("d", "a"));
+
+    /* Jumps must be strictly shorter than the range. */
+    BOOST_CHECK_EQUAL(4, g.componentCount(1.0));
+    BOOST_CHECK_EQUAL(3, g.componentCount(1.5));
+    BOOST_CHECK_EQUAL(2, g.componentCount(2.5));
+    BOOST_CHECK_EQUAL(1, g.componentCount(3.5));
+
+    SC_CHECK_EQUAL_COLLECTIONS(
+        (StarSet { g.getStar("a"), g.getStar("b"), g.getStar("c") }),
+        g.component("b", 2.5)
+    );
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(ConnectivityHierarchyTests, TestAgainstSearch)
+{
+    StarMap g = randomGalaxy(400, 30.0, 7);
+
+    for (double t : { 0.5, 1.5, 2.5, 3.0, 3.5, 4.5, 8.0 })
+    {
+        auto exp = g.connectedComponents(t);
+        BOOST_CHECK_EQUAL(exp.size(), g.componentCount(t));
+        BOOST_CHECK_EQUAL(exp.size(), g.hierarchy()->components(t).size());
+
+        for (auto& cc : exp)
+        {
+            SC_CHECK_EQUAL_COLLECTIONS(cc, g.component(*cc.begin(), t));
+        }
+    }
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(ConnectivityHierarchyTests, TestMinimumJumpRange)
+{
+    StarMap g = randomGalaxy(200, 30.0, 11);
+
+    for (StarId i = 0; i < 20; ++i)
+    {
+        Star from = g[i];
+        Star to = g[g.size() - 1 - i];
+        double r = g.minimumJumpRange(from, to);
+
+        BOOST_CHECK(!g.path(from, to, r * (1 + 1e-9)).empty());
+        BOOST_CHECK(g.path(from, to, r * (1 - 1e-9)).empty());
+    }
+}
+SC_TEST_CASE_END()
+
+SC_TEST_SUITE_END()
@@ -0,0 +1,125 @@
+#include "Tests.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+using namespace StellarCartography;
+
+SC_TEST_SUITE(CsvLoaderTests)
+
+namespace
+{
+
+std::vector<std::size_t> errorLines(const CsvLoader& loader)
+{
+    std::vector<std::size_t> result;
+    for (auto& e : loader.errors()) result.push_back(e.line);
+    return result;
+}
+
+}
+
+SC_TEST_CASE(CsvLoaderTests, TestParse)
+{
+    CsvLoader loader({ "bloc", "economy" });
+    auto g = loader.parse(
+        "Sol,0,0,0,Federation,Diverse\n"
+        "  Alpha Centauri,6.5,-6e1,0.25,,Mining  \r\n"
+        "\n"
+        "Polaris,-5,0,0,Empire,Trade,unused"
+    );
+
+    BOOST_CHECK(loader.errors().empty());
+    BOOST_REQUIRE_EQUAL(3, g.size());
+    BOOST_CHECK_EQUAL(Star("Sol", { 0.0, 0.0, 0.0 }), g[0]);
+    BOOST_CHECK_EQUAL(
+        Star("Alpha Centauri", { 6.5, -60.0, 0.25 }), g[1]);
+    BOOST_CHECK_EQUAL(Star("Polaris", { -5.0, 0.0, 0.0 }), g[2]);
+
+    BOOST_CHECK_EQUAL("Federation", g[0].getProperty("bloc"));
+    BOOST_CHECK_EQUAL("", g[1].getProperty("bloc"));
+    BOOST_CHECK_EQUAL("Mining", g[1].getProperty("economy"));
+    BOOST_CHECK_EQUAL("Trade", g[2].getProperty("economy"));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(CsvLoaderTests, TestErrors)
+{
+    CsvLoader loader;
+    auto g = loader.parse(
+        "Sol,0,0,0\n"
+        "Vega,1,2\n"
+        "Altair,1,2,x\n"
+        "Sol,5,5,5\n"
+        ",1,1,1\n"
+        "Deneb,0,0,0\n"
+        "Rigel,nan,0,0\n"
+        "Sirius,1,1,1e999\n"
+        "Vega,1,2,3,4\n"
+        "Vega,1,2,3\n"
+    );
+
+    /* Extra fields are ignored, so the first full Vega is kept. */
+    BOOST_REQUIRE_EQUAL(2, g.size());
+    BOOST_CHECK_EQUAL(Star("Vega", { 1.0, 2.0, 3.0 }), g[1]);
+    SC_CHECK_EQUAL_COLLECTIONS(
+        std::vector<std::size_t>({ 2, 3, 4, 5, 6, 7, 8, 10 }),
+        errorLines(loader));
+    BOOST_CHECK_EQUAL(
+        "Star Sol has the name or position of another star.",
+        loader.errors()[2].message);
+
+    /* Errors are only kept for the most recent input. */
+    loader.parse("Sol,0,0,0\n");
+    BOOST_CHECK(loader.errors().empty());
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(CsvLoaderTests, TestLoad)
+{
+    /* Big enough to be split into several chunks, with no final newline. */
+    const std::size_t n = 60000;
+    const std::string path = "CsvLoaderTests-load.csv";
+    {
+        std::ofstream os(path);
+        for (std::size_t i = 0; i < n; ++i)
+        {
+            if (i) os << "\n";
+            if (i == n / 2) os << "broken line\n";
+            os << "Star " << i << "," << i << ".5,-" << i << ",1e-3,"
+               << "Bloc " << i % 7 << ",government-that-pads-the-line";
+        }
+    }
+
+    CsvLoader loader({ "bloc", "government" });
+    std::vector<std::size_t> progress;
+    std::size_t total = 0;
+    loader.setProgress([&](std::size_t done, std::size_t size)
+    {
+        progress.push_back(done);
+        total = size;
+    });
+    auto g = loader.load(path);
+    std::remove(path.c_str());
+
+    BOOST_CHECK_GT(progress.size(), 1);
+    BOOST_CHECK(std::is_sorted(progress.begin(), progress.end()));
+    BOOST_CHECK_EQUAL(total, progress.back());
+
+    BOOST_REQUIRE_EQUAL(n, g.size());
+    SC_CHECK_EQUAL_COLLECTIONS(
+        std::vector<std::size_t>({ n / 2 + 1 }), errorLines(loader));
+    for (std::size_t i = 0; i < n; i += 997)
+    {
+        BOOST_CHECK_EQUAL("Star " + std::to_string(i), g[i].getName());
+        BOOST_CHECK_EQUAL(i + 0.5, g[i].getCoords().x());
+        BOOST_CHECK_EQUAL(-double(i), g[i].getCoords().y());
+    }
+    BOOST_CHECK_EQUAL("Bloc 2", g[n - 1].getProperty("bloc"));
+
+    BOOST_CHECK_THROW(loader.load(path), std::runtime_error);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_SUITE_END()
@@ -0,0 +1,220 @@
+#include "Tests.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+using namespace StellarCartography;
+
+SC_TEST_SUITE(MapFileTests)
+
+namespace
+{
+
+/* Removes the file when done with it. */
+struct TempFile
+{
+    explicit TempFile(const std::string& p) : path(p) { }
+    ~TempFile() { std::remove(path.c_str()); }
+
+    std::string path;
+};
+
+StarMap galaxy()
+{
+    Star sol("Sol", { 0.0, 0.0, 0.0 });
+    sol.setProperty("bloc", "Federation");
+    sol.setProperty("economy", "");
+
+    return
+    {
+        sol,
+        { "Proxima Centauri", { 4.0, 0.0, 0.0 } },
+        { "Alpha Centauri", { 6.0, 6.0, 6.0 } },
+        { "Polaris", { -5.0, 0.0, 0.0 } },
+        { "Sirius", { 4.96, -4.96, 4.96 } },
+        { "Beta Canis Majoris", { 10.0, 10.0, 10.0 } },
+    };
+}
+
+std::vector<JumpId> edgeList(const StarMap::dist_index& g)
+{
+    auto e = edges(g);
+    return std::vector<JumpId>(e.first, e.second);
+}
+
+std::string readBytes(const std::string& path)
+{
+    std::ifstream is(path, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(is), {});
+}
+
+void writeBytes(const std::string& path, const std::string& bytes)
+{
+    std::ofstream os(path, std::ios::binary | std::ios::trunc);
+    os.write(bytes.data(), bytes.size());
+}
+
+/* Where the first section of a kind starts, from the table at the end. */
+std::size_t sectionOffset(const std::string& bytes, MapFile::Section kind)
+{
+    std::uint64_t table_offset, table_size;
+    std::memcpy(&table_offset, &bytes[24], sizeof(table_offset));
+    std::memcpy(&table_size, &bytes[32], sizeof(table_size));
+    for (std::size_t i = 0; i < table_size; ++i)
+    {
+        auto entry = &bytes[table_offset + 24 * i];
+        std::uint32_t k;
+        std::uint64_t offset;
+        std::memcpy(&k, entry, sizeof(k));
+        std::memcpy(&offset, entry + 8, sizeof(offset));
+        if (k == static_cast<std::uint32_t>(kind)) return offset;
+    }
+    return 0;
+}
+
+}
+
+SC_TEST_CASE(MapFileTests, TestRoundTrip)
+{
+    TempFile tmp("MapFileTests-round-trip.scmap");
+    auto g = galaxy();
+    g.save(tmp.path, { 5.0, 8.0 });
+
+    MapFile file(tmp.path);
+    BOOST_CHECK_EQUAL(g.size(), file.starCount());
+    BOOST_CHECK_EQUAL(2, file.sections(MapFile::Section::Adjacency).size());
+
+    StarMap h(file);
+    SC_CHECK_EQUAL_COLLECTIONS(g, h);
+    BOOST_CHECK_EQUAL("Federation", h.getStar("Sol").getProperty("bloc"));
+    BOOST_CHECK_EQUAL("", h.getStar("Sol").getProperty("economy"));
+    BOOST_CHECK(h.getStar("Polaris").properties().empty());
+
+    /* Saved graphs are cached as they were. */
+    BOOST_CHECK_EQUAL(2, h.cacheStats().entries);
+    for (double t : { 5.0, 8.0 })
+    {
+        auto expected = g.byDistance(t);
+        auto actual = h.byDistance(t);
+        BOOST_CHECK(actual->hasLengths());
+        BOOST_CHECK(edgeList(*expected) == edgeList(*actual));
+        for (StarId u = 0; u < h.size(); ++u)
+        {
+            SC_CHECK_EQUAL_COLLECTIONS(
+                expected->lengths(u), actual->lengths(u));
+        }
+    }
+    BOOST_CHECK_EQUAL(2, h.cacheStats().hits);
+
+    BOOST_CHECK_EQUAL(
+        g.nearestNeighbor("Sirius", 10.0), h.nearestNeighbor("Sirius", 10.0));
+    BOOST_CHECK(
+        edgeList(*g.byDistance(12.0)) == edgeList(*h.byDistance(12.0)));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(MapFileTests, TestEdited)
+{
+    /* Edits not yet merged into the kd-tree are saved all the same. */
+    TempFile tmp("MapFileTests-edited.scmap");
+    auto g = galaxy();
+    g.erase("Sol");
+    g.insert({ "Vega", { 1.0, 1.0, 1.0 } });
+    g.moveStar("Polaris", { -2.0, 0.0, 0.0 });
+    g.save(tmp.path);
+
+    StarMap h { MapFile(tmp.path) };
+    SC_CHECK_EQUAL_COLLECTIONS(g, h);
+    BOOST_CHECK_EQUAL(0, h.cacheStats().entries);
+    BOOST_CHECK(
+        edgeList(*g.byDistance(6.0)) == edgeList(*h.byDistance(6.0)));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(MapFileTests, TestEmpty)
+{
+    TempFile tmp("MapFileTests-empty.scmap");
+    StarMap().save(tmp.path, { 1.0 });
+
+    StarMap h { MapFile(tmp.path) };
+    BOOST_CHECK(h.empty());
+    BOOST_CHECK_EQUAL(0, num_edges(*h.byDistance(1.0)));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(MapFileTests, TestInvalid)
+{
+    TempFile tmp("MapFileTests-invalid.scmap");
+    BOOST_CHECK_THROW(MapFile(tmp.path), std::runtime_error);
+
+    {
+        std::ofstream os(tmp.path);
+        os << "Sol,0,0,0,Federation,Democracy,Diverse" << std::endl;
+    }
+    BOOST_CHECK_THROW(MapFile(tmp.path), std::runtime_error);
+
+    /* Cut a good file short. */
+    galaxy().save(tmp.path, { 5.0 });
+    std::string bytes;
+    {
+        std::ifstream is(tmp.path, std::ios::binary);
+        bytes.assign(std::istreambuf_iterator<char>(is), {});
+    }
+    {
+        std::ofstream os(tmp.path, std::ios::binary | std::ios::trunc);
+        os.write(bytes.data(), bytes.size() - 8);
+    }
+    BOOST_CHECK_THROW(MapFile(tmp.path), std::runtime_error);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(MapFileTests, TestCorruptCounts)
+{
+    TempFile tmp("MapFileTests-counts.scmap");
+
+    /*
+     * 24 bytes a star times 2^61 stars wraps around to nothing, and the
+     * string tables' 2^61 + 1 offsets wrap around to one.
+     */
+    {
+        MapFileWriter out(tmp.path, std::size_t(1) << 61);
+        out.begin(MapFile::Section::Coordinates);
+        out.end();
+        typedef MapFile::Section Section;
+        for (auto kind : { Section::Names, Section::Properties })
+        {
+            out.begin(kind);
+            out.write(std::vector<std::uint64_t>(1, 0));
+            out.end();
+        }
+        out.close();
+    }
+    BOOST_CHECK_THROW(StarMap { MapFile(tmp.path) }, std::runtime_error);
+
+    /* A graph whose first row is out of order. */
+    galaxy().save(tmp.path, { 12.0 });
+    auto bytes = readBytes(tmp.path);
+    auto graph = sectionOffset(bytes, MapFile::Section::Adjacency);
+    BOOST_REQUIRE(graph != 0);
+
+    auto offsets = graph + 32;
+    auto neighbors = offsets + 8 * (galaxy().size() + 1);
+    std::uint64_t row_end;
+    std::memcpy(&row_end, &bytes[offsets + 8], sizeof(row_end));
+    BOOST_REQUIRE_GE(row_end, 2);
+    std::swap_ranges(
+        &bytes[neighbors], &bytes[neighbors + 4], &bytes[neighbors + 4]);
+    writeBytes(tmp.path, bytes);
+    BOOST_CHECK_THROW(StarMap { MapFile(tmp.path) }, std::runtime_error);
+
+    /* And one with a neighbor past the last star. */
+    std::uint32_t past = galaxy().size();
+    std::memcpy(&bytes[neighbors], &past, sizeof(past));
+    writeBytes(tmp.path, bytes);
+    BOOST_CHECK_THROW(StarMap { MapFile(tmp.path) }, std::runtime_error);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_SUITE_END()
@@ -0,0 +1,120 @@
+#include "Tests.h"
+
+#include <thread>
+
+using namespace StellarCartography;
+
+#ifdef SC_METRICS
+
+SC_TEST_SUITE(MetricsTests)
+
+namespace
+{
+
+Metrics::Counter test_counter("test.counter");
+Metrics::Histogram test_histogram("test.histogram", "things");
+
+std::uint64_t counter(const std::string& name)
+{
+    for (auto& c : Metrics::snapshot().counters)
+    {
+        if (c.name == name) return c.value;
+    }
+    return 0;
+}
+
+Metrics::HistogramValue histogram(const std::string& name)
+{
+    for (auto& h : Metrics::snapshot().histograms)
+    {
+        if (h.name == name) return h;
+    }
+    BOOST_FAIL("No histogram " + name);
+    return Metrics::HistogramValue();
+}
+
+}
+
+SC_TEST_CASE(MetricsTests, TestCounter)
+{
+    Metrics::reset();
+    test_counter.add();
+    test_counter.add(4);
+    BOOST_CHECK_EQUAL(5, counter("test.counter"));
+
+    /* Threads that have exited still count. */
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i)
+    {
+        threads.emplace_back([]
+        {
+            for (int j = 0; j < 1000; ++j) test_counter.add();
+        });
+    }
+    for (auto& t : threads) t.join();
+    BOOST_CHECK_EQUAL(4005, counter("test.counter"));
+
+    Metrics::reset();
+    BOOST_CHECK_EQUAL(0, counter("test.counter"));
+    test_counter.add(2);
+    BOOST_CHECK_EQUAL(2, counter("test.counter"));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(MetricsTests, TestHistogram)
+{
+    Metrics::reset();
+    test_histogram.record(0);
+    for (int i = 0; i < 8; ++i) test_histogram.record(5);
+    test_histogram.record(1000);
+
+    auto h = histogram("test.histogram");
+    BOOST_CHECK_EQUAL("things", h.unit);
+    BOOST_CHECK_EQUAL(10, h.count);
+    BOOST_CHECK_EQUAL(1040, h.sum);
+    BOOST_CHECK_CLOSE(104.0, h.mean(), 1e-9);
+
+    BOOST_CHECK_EQUAL(1, h.buckets[0]);
+    BOOST_CHECK_EQUAL(8, h.buckets[3]);
+    BOOST_CHECK_EQUAL(1, h.buckets[10]);
+
+    /* Quantiles are spread across their bucket by rank. */
+    BOOST_CHECK_EQUAL(0, h.quantile(0.0));
+    BOOST_CHECK_EQUAL(4, h.quantile(0.1));
+    BOOST_CHECK_EQUAL(6, h.quantile(0.5));
+    BOOST_CHECK_EQUAL(7, h.quantile(0.85));
+    BOOST_CHECK_EQUAL(768, h.quantile(0.95));
+    BOOST_CHECK_EQUAL(768, h.quantile(1.0));
+
+    Metrics::reset();
+    BOOST_CHECK_EQUAL(0, histogram("test.histogram").count);
+    BOOST_CHECK_EQUAL(0, histogram("test.histogram").quantile(0.5));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(MetricsTests, TestStarMap)
+{
+    StarMap g
+    {
+        Star("Sol", { 0.0, 0.0, 0.0 }),
+        Star("Alpha", { 1.0, 0.0, 0.0 }),
+        Star("Beta", { 5.0, 0.0, 0.0 }),
+    };
+
+    Metrics::reset();
+    g.byDistance(2.0);
+    g.byDistance(2.0);
+    g.byDistance(6.0);
+    BOOST_CHECK_EQUAL(1, counter("graph.cache_hits"));
+    BOOST_CHECK_EQUAL(2, counter("graph.cache_misses"));
+
+    g.reachable(g[0], 2.0);
+    auto h = histogram("search.reachable_visited");
+    BOOST_CHECK_EQUAL(1, h.count);
+    BOOST_CHECK_EQUAL(2, h.sum);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_SUITE_END()
+
+#endif /* SC_METRICS */
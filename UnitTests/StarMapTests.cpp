@@ -1,6 +1,9 @@
 #include "UnitTests/Tests.h"
 
+#include <atomic>
 #include <cmath>
+#include <random>
+#include <thread>
 #include "StellarCartography/StarMap.h"
 
 using namespace StellarCartography;
@@ -56,6 +59,53 @@ SC_TEST_CASE(StarMapTests, TestCopyCtor)
     h.nearestNeighbor(sol(), 10.0);
 }
 
+SC_TEST_CASE(StarMapTests, TestSnapshots)
+{
+    auto g = basicGalaxy();
+    auto before = g.byDistance(8.0);
+
+    /* Copies share cached graphs, and outlive the map they came from. */
+    StarMap h(g);
+    {
+        StarMap(std::move(g));
+    }
+    BOOST_CHECK(g.empty());
+    BOOST_CHECK_EQUAL(before, h.byDistance(8.0));
+    BOOST_CHECK_EQUAL(1, h.cacheStats().hits);
+
+    auto derived = h.byDistance(6.0);
+    StarMap::dist_index fresh(36.0, &h);
+    BOOST_REQUIRE_EQUAL(num_edges(fresh), num_edges(*derived));
+
+    /* Editing a copy leaves the others alone. */
+    StarMap edited(h);
+    edited.erase(sol());
+    edited.moveStar(polaris(), Coordinate { 100.0, 0.0, 0.0 });
+
+    BOOST_CHECK_EQUAL(basicGalaxy().size(), h.size());
+    BOOST_CHECK_EQUAL(basicGalaxy().size() - 1, edited.size());
+    BOOST_CHECK_EQUAL(polaris(), h.getStar(polaris().getName()));
+    BOOST_CHECK_EQUAL(before, h.byDistance(8.0));
+    BOOST_CHECK(before != edited.byDistance(8.0));
+    BOOST_CHECK_EQUAL(sol(), h.nearestNeighbor(polaris(), 10.0));
+    BOOST_CHECK_EQUAL(
+        Star(), edited.nearestNeighbor(polaris().getName(), 10.0));
+
+    std::vector<Star> rest(edited.begin(), edited.end());
+    StarMap rebuilt(rest.begin(), rest.end());
+    BOOST_CHECK_EQUAL(
+        num_edges(*rebuilt.byDistance(8.0)),
+        num_edges(*edited.byDistance(8.0)));
+
+    /* So does editing an empty map. */
+    StarMap a, b;
+    a.insert(sol());
+    BOOST_CHECK_EQUAL(1, a.size());
+    BOOST_CHECK(b.empty());
+    BOOST_CHECK(StarMap().empty());
+}
+SC_TEST_CASE_END()
+
 SC_TEST_CASE(StarMapTests, TestGetStar)
 {
     auto g = basicGalaxy();
@@ -67,6 +117,24 @@ SC_TEST_CASE(StarMapTests, TestGetStar)
     BOOST_CHECK_THROW(g.getStar("Foo"), std::invalid_argument);
 }
 
+SC_TEST_CASE(StarMapTests, TestGetId)
+{
+    auto g = basicGalaxy();
+
+    for (StarId i = 0; i < g.size(); ++i)
+    {
+        BOOST_CHECK_EQUAL(i, g.getId(g[i]));
+        BOOST_CHECK_EQUAL(i, g.getId(g[i].getName()));
+    }
+
+    BOOST_CHECK_EQUAL(sol(), g[g.getId(sol())]);
+    BOOST_CHECK_THROW(g.getId("Foo"), std::invalid_argument);
+    BOOST_CHECK_THROW(
+        g.getId(Star(sol().getName(), { 1.0, 1.0, 1.0 })), 
+        std::invalid_argument
+    );
+}
+
 SC_TEST_CASE(StarMapTests, TestGetEdges)
 {
     auto g = basicGalaxy();
@@ -74,7 +142,7 @@ SC_TEST_CASE(StarMapTests, TestGetEdges)
     BOOST_CHECK_EQUAL(g.size() * (g.size() - 1) / 2, num_edges(g));
     
     auto e = edges(g);
-    std::vector<Jump> edge_vec(e.first, e.second);
+    std::vector<JumpId> edge_vec(e.first, e.second);
     
     BOOST_CHECK_EQUAL(edge_vec.size(), num_edges(g));
 }
@@ -166,6 +234,146 @@ SC_TEST_CASE(StarMapTests, TestRoutingWeight)
 }
 SC_TEST_CASE_END()
 
+SC_TEST_CASE(StarMapTests, TestPathHopCount)
+{
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<double> coord(0.0, 30.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 150; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    StarMap g(stars.begin(), stars.end());
+    double t = 6.0;
+
+    /* Reference hop counts from a plain BFS out of each source. */
+    for (StarId u = 0; u < g.size(); u += 11)
+    {
+        std::vector<int> hops(g.size(), -1);
+        std::vector<StarId> queue { u };
+        hops[u] = 0;
+        for (size_t i = 0; i < queue.size(); ++i)
+        {
+            for (StarId v = 0; v < g.size(); ++v)
+            {
+                double d = g[queue[i]].getCoords().distance(g[v].getCoords());
+                if (hops[v] >= 0 || d >= t) continue;
+                hops[v] = hops[queue[i]] + 1;
+                queue.push_back(v);
+            }
+        }
+
+        for (StarId v = 0; v < g.size(); v += 3)
+        {
+            auto p = g.path(g[u], g[v], t);
+            BOOST_CHECK_EQUAL(hops[v] + 1, int(p.size()));
+            if (p.empty()) continue;
+
+            BOOST_CHECK_EQUAL(g[u], p.front());
+            BOOST_CHECK_EQUAL(g[v], p.back());
+            for (auto it = p.begin(); std::next(it) != p.end(); ++it)
+            {
+                BOOST_CHECK_LT(
+                    it->getCoords().distance(std::next(it)->getCoords()), t);
+            }
+        }
+    }
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestShortestPath)
+{
+    /* Same layout as TestRoutingWeight, but minimizing total distance. */
+    Star 
+        a { "A", { 0, 0, 0 } },
+        b { "B", { 1, 0, 0 } },
+        c { "C", { 2, 0, 0 } },
+        d { "D", { 3, 0, 0 } },
+        e { "E", { 1.5, 0.5, 0 } };
+
+    StarMap g { a, b, c, d, e };
+
+    SC_CHECK_EQUAL_COLLECTIONS(
+        (StarList { a, b, c, d }),
+        (g.shortestPath(a, d, 1.99))
+    );
+
+    SC_CHECK_EQUAL_COLLECTIONS(
+        (StarList { a, d }),
+        (g.shortestPath(a.getName(), d.getName(), 4.0))
+    );
+
+    SC_CHECK_EQUAL_COLLECTIONS(
+        (StarList { a }),
+        (g.shortestPath(a, a, 1.0))
+    );
+
+    SC_CHECK_EQUAL_COLLECTIONS(
+        (StarList { }),
+        (g.shortestPath(a, d, 0.9))
+    );
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestShortestPathOptimal)
+{
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<double> coord(0.0, 20.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 80; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    StarMap g(stars.begin(), stars.end());
+    double t = 6.0;
+
+    /* Floyd-Warshall over the threshold graph. */
+    auto n = g.size();
+    auto inf = std::numeric_limits<double>::infinity();
+    std::vector<std::vector<double>> dist(n, std::vector<double>(n, inf));
+    for (StarId u = 0; u < n; ++u)
+    {
+        dist[u][u] = 0.0;
+        for (StarId v = 0; v < n; ++v)
+        {
+            double d = g[u].getCoords().distance(g[v].getCoords());
+            if (d < t) dist[u][v] = d;
+        }
+    }
+    for (StarId k = 0; k < n; ++k)
+        for (StarId u = 0; u < n; ++u)
+            for (StarId v = 0; v < n; ++v)
+                dist[u][v] = std::min(dist[u][v], dist[u][k] + dist[k][v]);
+
+    for (StarId u = 0; u < n; u += 7)
+    {
+        for (StarId v = 0; v < n; v += 5)
+        {
+            auto p = g.shortestPath(g[u], g[v], t);
+            if (dist[u][v] == inf)
+            {
+                BOOST_CHECK(p.empty());
+                continue;
+            }
+
+            BOOST_REQUIRE(!p.empty());
+            double total = 0.0;
+            for (auto it = p.begin(); std::next(it) != p.end(); ++it)
+            {
+                total += it->getCoords().distance(std::next(it)->getCoords());
+            }
+            BOOST_CHECK_CLOSE(dist[u][v] + 1.0, total + 1.0, 1e-9);
+        }
+    }
+}
+SC_TEST_CASE_END()
+
 SC_TEST_CASE(StarMapTests, TestReachable)
 {
     StarMap g = basicGalaxy();
@@ -212,13 +420,15 @@ SC_TEST_CASE(StarMapTests, TestByDistance)
 {
     StarMap g = basicGalaxy();
 
-    auto d = g.byDistance(10.0);
+    auto dp = g.byDistance(10.0);
+    auto& d = *dp;
 
     BOOST_CHECK_EQUAL(num_vertices(g), num_vertices(d));
     
+    auto u = vertices(g);
     auto v = vertices(d);
     BOOST_CHECK_EQUAL_COLLECTIONS(
-        g.begin(), g.end(), 
+        u.first, u.second, 
         v.first, v.second
     );
 
@@ -234,9 +444,33 @@ SC_TEST_CASE(StarMapTests, TestEdges)
         d { "d", { 1.0, 1.0, 0.0 } };
 
     StarMap g { a, b, c, d };
-    auto idx = g.byDistance(1.1);
+    auto idxp = g.byDistance(1.1);
+    auto& idx = *idxp;
 
-    JumpSet e(edges(idx).first, edges(idx).second);
+    auto toJumps = [&g](
+        std::vector<JumpId>::const_iterator begin, 
+        std::vector<JumpId>::const_iterator end)
+    {
+        JumpSet result;
+        for (auto it = begin; it != end; ++it)
+        {
+            result.insert(g.getJump(*it));
+        }
+        return result;
+    };
+    auto edgeJumps = [&toJumps](const StarMap::dist_index& i)
+    {
+        std::vector<JumpId> e(edges(i).first, edges(i).second);
+        return toJumps(e.begin(), e.end());
+    };
+    auto outJumps = [&toJumps, &g](const Star& s, const StarMap::dist_index& i)
+    {
+        auto r = out_edges(g.getId(s), i);
+        std::vector<JumpId> e(r.first, r.second);
+        return toJumps(e.begin(), e.end());
+    };
+
+    JumpSet e = edgeJumps(idx);
 
     BOOST_CHECK_EQUAL(4, num_edges(idx));
     BOOST_REQUIRE_EQUAL(e.size(), num_edges(idx));
@@ -245,38 +479,658 @@ SC_TEST_CASE(StarMapTests, TestEdges)
         e
     );
 
-    auto idx2 = g.byDistance(2);
+    auto idx2p = g.byDistance(2);
+    auto& idx2 = *idx2p;
 
-    auto g_edges = JumpSet(edges(g).first, edges(g).second);
-    e = JumpSet(edges(idx2).first, edges(idx2).second);
+    std::vector<JumpId> g_edge_ids(edges(g).first, edges(g).second);
+    auto g_edges = toJumps(g_edge_ids.begin(), g_edge_ids.end());
+    e = edgeJumps(idx2);
 
     BOOST_CHECK_EQUAL(num_edges(g), num_edges(idx2));
     SC_CHECK_EQUAL_COLLECTIONS(g_edges, e);
 
-    BOOST_CHECK_EQUAL(2, out_degree(a, idx));
-    BOOST_CHECK_EQUAL(2, out_degree(b, idx));
-    BOOST_CHECK_EQUAL(2, out_degree(c, idx));
-    BOOST_CHECK_EQUAL(2, out_degree(d, idx));
+    BOOST_CHECK_EQUAL(2, out_degree(g.getId(a), idx));
+    BOOST_CHECK_EQUAL(2, out_degree(g.getId(b), idx));
+    BOOST_CHECK_EQUAL(2, out_degree(g.getId(c), idx));
+    BOOST_CHECK_EQUAL(2, out_degree(g.getId(d), idx));
 
-    BOOST_CHECK_EQUAL(3, out_degree(a, idx2));
-    BOOST_CHECK_EQUAL(3, out_degree(b, idx2));
-    BOOST_CHECK_EQUAL(3, out_degree(c, idx2));
-    BOOST_CHECK_EQUAL(3, out_degree(d, idx2));
+    BOOST_CHECK_EQUAL(3, out_degree(g.getId(a), idx2));
+    BOOST_CHECK_EQUAL(3, out_degree(g.getId(b), idx2));
+    BOOST_CHECK_EQUAL(3, out_degree(g.getId(c), idx2));
+    BOOST_CHECK_EQUAL(3, out_degree(g.getId(d), idx2));
 
-    auto a_out = JumpSet(out_edges(a, idx).first, out_edges(a, idx).second);
     SC_CHECK_EQUAL_COLLECTIONS(
         (JumpList { { a, b }, { a, c } }),
-        a_out
+        outJumps(a, idx)
     );
 
-    a_out = JumpSet(out_edges(a, idx2).first, out_edges(a, idx2).second);
     SC_CHECK_EQUAL_COLLECTIONS(
         (JumpList { { a, b }, { a, c }, { a, d } }),
-        a_out
+        outJumps(a, idx2)
     );
 }
 SC_TEST_CASE_END()
 
+SC_TEST_CASE(StarMapTests, TestEdgeLengths)
+{
+    Star 
+        a { "a", { 0.0, 0.0, 0.0 } },
+        b { "b", { 1.0, 0.0, 0.0 } },
+        c { "c", { 0.0, 2.0, 0.0 } },
+        d { "d", { 3.0, 0.0, 0.0 } };
+
+    StarMap g { a, b, c, d };
+    auto idxp = g.byDistance(2.5);
+    auto& idx = *idxp;
+
+    BOOST_REQUIRE(idx.hasLengths());
+
+    auto n = idx.neighbors(g.getId(a));
+    auto l = idx.lengths(g.getId(a));
+    BOOST_REQUIRE_EQUAL(n.size(), l.size());
+
+    for (size_t i = 0; i < n.size(); ++i)
+    {
+        BOOST_CHECK_CLOSE(
+            a.getCoords().distance(g[n[i]].getCoords()), l[i], 0.0001);
+    }
+
+    StarMap::dist_index bare(2.5 * 2.5, &g, false);
+    BOOST_CHECK(!bare.hasLengths());
+    BOOST_CHECK_EQUAL(num_edges(idx), num_edges(bare));
+    BOOST_CHECK(idx.lengths(g.getId(a)).size() > 0);
+    BOOST_CHECK_EQUAL(0, bare.lengths(g.getId(a)).size());
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestCacheBudget)
+{
+    StarMap g = basicGalaxy();
+
+    auto d1 = g.byDistance(5.0);
+    BOOST_CHECK_EQUAL(d1, g.byDistance(5.0));
+
+    auto stats = g.cacheStats();
+    BOOST_CHECK_EQUAL(1, stats.hits);
+    BOOST_CHECK_EQUAL(1, stats.misses);
+    BOOST_CHECK_EQUAL(0, stats.evictions);
+    BOOST_CHECK_EQUAL(1, stats.entries);
+    BOOST_CHECK_EQUAL(d1->memoryUsage(), stats.bytes);
+
+    /* Room for exactly one index; the newest entry always stays. */
+    g.setCacheBudget(d1->memoryUsage());
+    auto d2 = g.byDistance(7.0);
+
+    stats = g.cacheStats();
+    BOOST_CHECK_EQUAL(1, stats.evictions);
+    BOOST_CHECK_EQUAL(1, stats.entries);
+    BOOST_CHECK_EQUAL(d2, g.byDistance(7.0));
+
+    /* Evicted indexes stay valid for their holders. */
+    BOOST_CHECK_EQUAL(num_vertices(g), num_vertices(*d1));
+    BOOST_CHECK(d1 != g.byDistance(5.0));
+
+    g.clearCache();
+    BOOST_CHECK_EQUAL(0, g.cacheStats().entries);
+    BOOST_CHECK_EQUAL(0, g.cacheStats().bytes);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestCachePolicy)
+{
+    /* None of these thresholds has any edges, so all are the same size. */
+    StarMap g = basicGalaxy();
+    auto d1 = g.byDistance(1.0);
+    auto d2 = g.byDistance(2.0);
+    g.byDistance(1.0);
+    g.byDistance(1.0);
+    g.byDistance(2.0);
+
+    /* d1 is used more often, d2 more recently. */
+    g.setCachePolicy(EvictionPolicy::LFU);
+    g.setCacheBudget(d1->memoryUsage() + d2->memoryUsage());
+    g.byDistance(3.0);
+    BOOST_CHECK_EQUAL(d1, g.byDistance(1.0));
+
+    g.clearCache();
+    d1 = g.byDistance(1.0);
+    d2 = g.byDistance(2.0);
+    g.byDistance(1.0);
+    g.byDistance(1.0);
+    g.byDistance(2.0);
+
+    g.setCachePolicy(EvictionPolicy::LRU);
+    g.byDistance(3.0);
+    BOOST_CHECK_EQUAL(d2, g.byDistance(2.0));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestMemoryUsage)
+{
+    StarMap g = basicGalaxy();
+    g.setSpatialBackend(SpatialBackend::KdTree);
+
+    auto before = g.memoryUsage();
+    BOOST_CHECK(before.stars >= g.size() * sizeof(Star));
+    BOOST_CHECK(before.star_indexes > 0);
+    BOOST_CHECK(before.coordinates >= g.size() * 3 * sizeof(double));
+    BOOST_CHECK_EQUAL(0, before.pending_edits);
+    BOOST_CHECK_EQUAL(0, before.hierarchy);
+    BOOST_CHECK(before.graphs.empty());
+
+    auto d5 = g.byDistance(5.0);
+    auto d7 = g.byDistance(7.0);
+    g.componentCount(5.0);
+
+    auto after = g.memoryUsage();
+    BOOST_REQUIRE_EQUAL(2, after.graphs.size());
+    BOOST_CHECK_CLOSE(5.0, after.graphs[0].first, 1e-9);
+    BOOST_CHECK_EQUAL(d5->memoryUsage(), after.graphs[0].second);
+    BOOST_CHECK_CLOSE(7.0, after.graphs[1].first, 1e-9);
+    BOOST_CHECK_EQUAL(d7->memoryUsage(), after.graphs[1].second);
+    BOOST_CHECK_EQUAL(g.hierarchy()->memoryUsage(), after.hierarchy);
+    BOOST_CHECK_EQUAL(
+        before.total() + after.hierarchy +
+            d5->memoryUsage() + d7->memoryUsage(),
+        after.total());
+
+    /* Properties and edits are counted once there are any. */
+    StarMap h = g;
+    auto s = sol();
+    s.setProperty("government", "A name long enough to be on the heap");
+    h.erase(sol());
+    h.insert(s);
+    BOOST_CHECK(h.memoryUsage().properties > 0);
+    BOOST_CHECK(h.memoryUsage().pending_edits > 0);
+    BOOST_CHECK_EQUAL(0, g.memoryUsage().properties);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestDerivedIndex)
+{
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> coord(0.0, 20.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 300; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    StarMap g(stars.begin(), stars.end());
+
+    auto large = g.byDistance(4.0);
+    for (double t : { 3.9, 3.0, 2.5, 2.0, 1.0 })
+    {
+        auto derived = g.byDistance(t);
+        StarMap::dist_index fresh(t * t, &g);
+
+        std::vector<JumpId> exp(edges(fresh).first, edges(fresh).second);
+        std::vector<JumpId> act(edges(*derived).first, edges(*derived).second);
+        BOOST_CHECK(exp == act);
+
+        for (StarId u = 0; u < g.size(); ++u)
+        {
+            SC_CHECK_EQUAL_COLLECTIONS(
+                fresh.lengths(u), derived->lengths(u));
+        }
+    }
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestParallelIndex)
+{
+    std::mt19937 rng(9);
+    std::uniform_real_distribution<double> coord(0.0, 40.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 3000; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    StarMap g(stars.begin(), stars.end());
+
+    setThreadCount(1);
+    StarMap::dist_index serial(9.0, &g);
+    StarMap::dist_index serial_derived(4.0, serial, g);
+
+    setThreadCount(4);
+    StarMap::dist_index parallel(9.0, &g);
+    StarMap::dist_index parallel_derived(4.0, parallel, g);
+    setThreadCount(0);
+
+    auto checkSame = [&g](
+        const StarMap::dist_index& l, const StarMap::dist_index& r)
+    {
+        BOOST_REQUIRE_EQUAL(num_edges(l), num_edges(r));
+        for (StarId u = 0; u < g.size(); ++u)
+        {
+            SC_CHECK_EQUAL_COLLECTIONS(l.neighbors(u), r.neighbors(u));
+            SC_CHECK_EQUAL_COLLECTIONS(l.lengths(u), r.lengths(u));
+        }
+    };
+
+    BOOST_CHECK(num_edges(serial) > 0);
+    checkSame(serial, parallel);
+    checkSame(serial_derived, parallel_derived);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestSpatialBackend)
+{
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<double> coord(0.0, 40.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 1000; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    /* Separate maps, since copies would share their cached graphs. */
+    StarMap kd(stars.begin(), stars.end());
+    StarMap grid(stars.begin(), stars.end());
+    StarMap automatic(stars.begin(), stars.end());
+    grid.setSpatialBackend(SpatialBackend::Grid);
+    automatic.setSpatialBackend(SpatialBackend::Auto);
+    BOOST_CHECK(SpatialBackend::KdTree == StarMap().spatialBackend());
+
+    /* The smaller thresholds are too fine for tight grid cells. */
+    for (double t : { 0.1, 2.0, 5.0, 100.0 })
+    {
+        auto lp = kd.byDistance(t);
+        auto rp = grid.byDistance(t);
+        BOOST_REQUIRE_EQUAL(num_edges(*lp), num_edges(*rp));
+        BOOST_CHECK_EQUAL(
+            num_edges(*lp), num_edges(*automatic.byDistance(t)));
+        for (StarId u = 0; u < kd.size(); ++u)
+        {
+            SC_CHECK_EQUAL_COLLECTIONS(lp->neighbors(u), rp->neighbors(u));
+            SC_CHECK_EQUAL_COLLECTIONS(lp->lengths(u), rp->lengths(u));
+        }
+
+        for (int i = 0; i < 1000; i += 97)
+        {
+            SC_CHECK_EQUAL_COLLECTIONS(
+                kd.neighbors(stars[i], t), grid.neighbors(stars[i], t));
+        }
+    }
+
+    /* A copy's setting leaves the grid it shares alone. */
+    StarMap copy(grid);
+    copy.setSpatialBackend(SpatialBackend::KdTree);
+    BOOST_CHECK(SpatialBackend::Grid == grid.spatialBackend());
+    BOOST_CHECK_GT(grid.memoryUsage().grid, 0);
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestBatchQueries)
+{
+    std::mt19937 rng(13);
+    std::uniform_real_distribution<double> coord(0.0, 30.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 2500; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    StarMap g(stars.begin(), stars.end());
+
+    std::vector<StarId> ids;
+    std::vector<Coordinate> coords;
+    for (StarId i = 0; i < g.size(); i += 3) 
+    {
+        ids.push_back(i);
+        coords.push_back(g[i].getCoords());
+    }
+
+    setThreadCount(4);
+    for (double t : { 0.5, 3.0 })
+    {
+        auto near = g.neighbors(ids, t);
+        auto nearest = g.nearestNeighbors(ids, t);
+        auto at = g.neighbors(coords, t);
+        auto nearest_at = g.nearestNeighbors(coords, t);
+        BOOST_REQUIRE_EQUAL(ids.size(), near.size());
+        BOOST_REQUIRE_EQUAL(ids.size(), nearest.size());
+
+        for (std::size_t i = 0; i < ids.size(); ++i)
+        {
+            auto star = g[ids[i]];
+            StarSet expected = g.neighbors(star, t);
+            StarSet actual;
+            for (auto v : near.neighbors(i)) actual.insert(g[v]);
+            SC_CHECK_EQUAL_COLLECTIONS(expected, actual);
+
+            auto d = near.distances(i).begin();
+            for (auto v : near.neighbors(i))
+            {
+                BOOST_CHECK_CLOSE(
+                    star.getCoords().distance(g[v].getCoords()), *d++, 1e-9);
+            }
+
+            /* A coordinate query finds the star sitting on it, too. */
+            BOOST_CHECK_EQUAL(near.neighbors(i).size() + 1, 
+                at.neighbors(i).size());
+            BOOST_REQUIRE_EQUAL(1, nearest_at.neighbors(i).size());
+            BOOST_CHECK_EQUAL(ids[i], nearest_at.neighbors(i).front());
+            BOOST_CHECK_EQUAL(0.0, nearest_at.distances(i).front());
+
+            auto n = g.nearestNeighbor(star, t);
+            if (n == Star())
+            {
+                BOOST_CHECK(nearest.neighbors(i).empty());
+            }
+            else
+            {
+                BOOST_REQUIRE_EQUAL(1, nearest.neighbors(i).size());
+                BOOST_CHECK_EQUAL(n, g[nearest.neighbors(i).front()]);
+            }
+        }
+    }
+    setThreadCount(0);
+
+    BOOST_CHECK_THROW(
+        g.neighbors(std::vector<StarId> { StarId(g.size()) }, 1.0), 
+        std::invalid_argument);
+    BOOST_CHECK_EQUAL(0, g.neighbors(std::vector<StarId>(), 1.0).size());
+
+    StarMap empty;
+    auto none = empty.nearestNeighbors(coords, 1.0);
+    BOOST_REQUIRE_EQUAL(coords.size(), none.size());
+    BOOST_CHECK(none.neighbors(0).empty());
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestKnn)
+{
+    std::mt19937 rng(17);
+    std::uniform_real_distribution<double> coord(0.0, 20.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 800; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    StarMap g(stars.begin(), stars.end());
+
+    /* Everything closer than t to c except self, nearest first. */
+    auto bruteForce = [&g](
+        const Coordinate& c, StarId self, double t, std::size_t k)
+    {
+        std::vector<std::pair<double, StarId>> all;
+        for (StarId v = 0; v < g.size(); ++v)
+        {
+            double d2 = c.distanceSquared(g[v].getCoords());
+            if (v != self && d2 < t * t) all.emplace_back(d2, v);
+        }
+        std::sort(all.begin(), all.end());
+        if (all.size() > k) all.resize(k);
+
+        std::vector<StarId> result;
+        for (auto& e : all) result.push_back(e.second);
+        return result;
+    };
+    auto ids = [](const NeighborList& l)
+    {
+        std::vector<StarId> result;
+        for (auto& n : l) result.push_back(n.first);
+        return result;
+    };
+
+    auto inf = std::numeric_limits<double>::infinity();
+    for (auto backend : { SpatialBackend::KdTree, SpatialBackend::Grid })
+    {
+        g.setSpatialBackend(backend);
+        for (StarId u = 0; u < g.size(); u += 37)
+        {
+            auto c = g[u].getCoords();
+            for (std::size_t k : { 0, 1, 5, 40 })
+            {
+                SC_CHECK_EQUAL_COLLECTIONS(
+                    bruteForce(c, u, inf, k), ids(g.knn(g[u], k)));
+                SC_CHECK_EQUAL_COLLECTIONS(
+                    bruteForce(c, g.null_vertex(), inf, k), ids(g.knn(c, k)));
+                SC_CHECK_EQUAL_COLLECTIONS(
+                    bruteForce(c, u, 3.0, k), 
+                    ids(g.neighborsSorted(g[u], 3.0, k)));
+            }
+            SC_CHECK_EQUAL_COLLECTIONS(
+                bruteForce(c, u, 4.0, g.size()), 
+                ids(g.neighborsSorted(g[u].getName(), 4.0)));
+        }
+    }
+
+    auto l = g.knn(g[0], 10);
+    BOOST_REQUIRE_EQUAL(10, l.size());
+    for (auto& n : l)
+    {
+        BOOST_CHECK_CLOSE(
+            g[0].getCoords().distance(g[n.first].getCoords()), n.second, 1e-9);
+    }
+    BOOST_CHECK_EQUAL(g.size() - 1, g.knn(g[0], g.size() + 5).size());
+    BOOST_CHECK(StarMap().knn(Coordinate { 0, 0, 0 }, 3).empty());
+
+    /* The query star needn't come first, or be in the map at all. */
+    Star outsider("outsider", g[0].getCoords());
+    BOOST_CHECK_EQUAL(0, g.knn(outsider, 1).front().first);
+    BOOST_CHECK_EQUAL(g[l.front().first], g.nearestNeighbor(g[0], 100.0));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestEdits)
+{
+    std::mt19937 rng(19);
+    std::uniform_real_distribution<double> coord(0.0, 25.0);
+    auto randomStar = [&](int i)
+    {
+        return Star(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    };
+
+    std::vector<Star> stars;
+    for (int i = 0; i < 1000; ++i) stars.push_back(randomStar(i));
+    StarMap g(stars.begin(), stars.end());
+
+    auto checkSame = [](const StarMap& l, const StarMap& r, double t)
+    {
+        auto lp = l.byDistance(t);
+        auto rp = r.byDistance(t);
+        BOOST_REQUIRE_EQUAL(num_vertices(*lp), num_vertices(*rp));
+        BOOST_REQUIRE_EQUAL(num_edges(*lp), num_edges(*rp));
+        for (StarId u = 0; u < l.size(); ++u)
+        {
+            SC_CHECK_EQUAL_COLLECTIONS(lp->neighbors(u), rp->neighbors(u));
+            SC_CHECK_EQUAL_COLLECTIONS(lp->lengths(u), rp->lengths(u));
+        }
+    };
+
+    /* Cached graphs are patched, so looking them up again always hits. */
+    auto before = g.byDistance(2.0);
+    g.byDistance(4.0);
+    auto misses = g.cacheStats().misses;
+
+    int next = 1000;
+    for (int round = 0; round < 12; ++round)
+    {
+        for (int i = 0; i < 25; ++i)
+        {
+            std::uniform_int_distribution<StarId> any(0, g.size() - 1);
+            switch (rng() % 3)
+            {
+            case 0:
+            {
+                StarId s = g.size();
+                BOOST_CHECK_EQUAL(s, g.insert(randomStar(next++)));
+                break;
+            }
+            case 1:
+            {
+                StarId s = any(rng);
+                Star last = g[g.size() - 1];
+                g.erase(g[s]);
+                if (s < g.size()) BOOST_CHECK_EQUAL(last, g[s]);
+                break;
+            }
+            case 2:
+                g.moveStar(g[any(rng)].getName(), randomStar(0).getCoords());
+                break;
+            }
+        }
+
+        std::vector<Star> current(g.begin(), g.end());
+        StarMap fresh(current.begin(), current.end());
+        checkSame(g, fresh, 2.0);
+        checkSame(g, fresh, 4.0);
+        BOOST_CHECK_EQUAL(misses, g.cacheStats().misses);
+
+        for (StarId u = 0; u < g.size(); u += 41)
+        {
+            SC_CHECK_EQUAL_COLLECTIONS(
+                fresh.neighbors(g[u], 3.0), g.neighbors(g[u], 3.0));
+            BOOST_CHECK_EQUAL(
+                fresh.nearestNeighbor(g[u], 3.0), 
+                g.nearestNeighbor(g[u], 3.0));
+
+            auto l = fresh.knn(g[u], 8);
+            auto r = g.knn(g[u], 8);
+            BOOST_REQUIRE_EQUAL(l.size(), r.size());
+            for (std::size_t i = 0; i < l.size(); ++i)
+                BOOST_CHECK_EQUAL(l[i].first, r[i].first);
+        }
+    }
+    BOOST_CHECK_EQUAL(1000, before->numVertices());
+
+    Star taken = g[0];
+    BOOST_CHECK_THROW(g.insert(taken), std::invalid_argument);
+    BOOST_CHECK_THROW(
+        g.moveStar(g[1].getName(), taken.getCoords()), std::invalid_argument);
+    BOOST_CHECK_THROW(g.erase("nonexistent"), std::invalid_argument);
+
+    while (!g.empty()) g.erase(g[0]);
+    BOOST_CHECK_EQUAL(0, num_edges(*g.byDistance(4.0)));
+    BOOST_CHECK_EQUAL(0, g.insert(taken));
+    BOOST_CHECK_EQUAL(taken, g.nearestNeighbor(Star("x", { 0, 0, 0 }), 100.0));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestFailedEdits)
+{
+    std::mt19937 rng(23);
+    std::uniform_real_distribution<double> coord(0.0, 20.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 500; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+
+    /* A failed edit on a copy mustn't tie it to the original's data. */
+    auto g = std::make_shared<StarMap>(stars.begin(), stars.end());
+    g->byDistance(5.0);
+    StarMap copy(*g);
+    BOOST_CHECK_THROW(copy.insert(stars[3]), std::invalid_argument);
+    BOOST_CHECK_THROW(
+        copy.insert(Star("New", stars[4].getCoords())), 
+        std::invalid_argument);
+    BOOST_CHECK_THROW(
+        copy.moveStar(stars[5].getName(), stars[6].getCoords()),
+        std::invalid_argument);
+    BOOST_CHECK_THROW(
+        copy.moveStar("Missing", Coordinate { 1, 2, 3 }), 
+        std::invalid_argument);
+
+    g->moveStar(stars[7].getName(), Coordinate { 30, 30, 30 });
+    g->erase(stars[8].getName());
+    g.reset();
+
+    SC_CHECK_EQUAL_COLLECTIONS(stars, copy);
+    StarMap fresh(stars.begin(), stars.end());
+    auto lp = copy.byDistance(4.0);
+    auto rp = fresh.byDistance(4.0);
+    BOOST_REQUIRE_EQUAL(num_edges(*rp), num_edges(*lp));
+    for (StarId u = 0; u < fresh.size(); ++u)
+        SC_CHECK_EQUAL_COLLECTIONS(rp->neighbors(u), lp->neighbors(u));
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(StarMapTests, TestConcurrentQueries)
+{
+    std::mt19937 rng(11);
+    std::uniform_real_distribution<double> coord(0.0, 30.0);
+    std::vector<Star> stars;
+    for (int i = 0; i < 2000; ++i)
+    {
+        stars.emplace_back(
+            "S" + std::to_string(i), 
+            Coordinate { coord(rng), coord(rng), coord(rng) }
+        );
+    }
+    StarMap g(stars.begin(), stars.end());
+    const std::vector<double> ranges { 1.0, 1.5, 2.0, 3.0 };
+
+    StarMap serial(stars.begin(), stars.end());
+    std::vector<std::size_t> expected;
+    for (auto t : ranges) expected.push_back(num_edges(*serial.byDistance(t)));
+    auto components = serial.componentCount(2.0);
+    auto knn = serial.knn("S7", 5);
+
+    /* Pending edits make the first bulk query rebuild the kd-tree. */
+    g.moveStar("S0", { -1.0, -1.0, -1.0 });
+    g.moveStar("S0", stars[0].getCoords());
+    g.clearCache();
+    auto before = g.cacheStats();
+
+    /* Boost.Test isn't thread-safe, so threads only count mismatches. */
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t)
+    {
+        threads.emplace_back([&, t]
+        {
+            StarMap copy(g);
+            for (std::size_t i = 0; i < 4 * ranges.size(); ++i)
+            {
+                auto r = (i + t) % ranges.size();
+                auto& m = (t % 2) ? copy : g;
+                if (num_edges(*m.byDistance(ranges[r])) != expected[r]) 
+                    ++failures;
+            }
+            if (g.componentCount(2.0) != components) ++failures;
+            if (g.knn("S7", 5) != knn) ++failures;
+            if (g.neighbors(std::vector<StarId> { 1, 2, 3 }, 2.0).size() != 3)
+                ++failures;
+
+            /* Editing a copy leaves the others be. */
+            copy.erase("S1");
+            if (num_edges(*copy.byDistance(2.0)) > expected[2]) ++failures;
+        });
+    }
+    for (auto& t : threads) t.join();
+
+    BOOST_CHECK_EQUAL(0, failures);
+    BOOST_CHECK_EQUAL(g.size(), stars.size());
+
+    /* Each index was built once, and every other request shared it. */
+    auto stats = g.cacheStats();
+    BOOST_CHECK_EQUAL(ranges.size(), stats.misses - before.misses);
+    BOOST_CHECK_EQUAL(
+        8 * 4 * ranges.size() - ranges.size(), stats.hits - before.hits);
+}
+SC_TEST_CASE_END()
+
 SC_TEST_CASE(StarMapTests, TestCenterOfMass)
 {
     StarMap g 
@@ -0,0 +1,67 @@
+#include "Tests.h"
+
+#include <sstream>
+#include <thread>
+
+using namespace StellarCartography;
+
+SC_TEST_SUITE(TraceTests)
+
+SC_TEST_CASE(TraceTests, TestTrace)
+{
+    BOOST_CHECK(!Trace::recording());
+    {
+        /* Nothing is recorded outside a trace. */
+        Trace::Scope scope("before");
+    }
+
+    Trace::start();
+    BOOST_CHECK(Trace::recording());
+
+    StarMap g
+    {
+        Star("Sol", { 0.0, 0.0, 0.0 }),
+        Star("Alpha", { 1.0, 0.0, 0.0 }),
+        Star("Beta", { 5.0, 0.0, 0.0 }),
+    };
+    g.reachable(g[0], 2.0);
+
+    std::thread([] { Trace::Scope scope("other \"thread\""); }).join();
+
+    std::ostringstream os;
+    auto count = Trace::stop(os);
+    BOOST_CHECK(!Trace::recording());
+
+    auto json = os.str();
+    BOOST_CHECK_EQUAL(0, json.find("{\"traceEvents\":["));
+    BOOST_CHECK(json.find("\"name\":\"before\"") == std::string::npos);
+    BOOST_CHECK(
+        json.find("\"name\":\"StarMap::StarMap\"") != std::string::npos);
+    BOOST_CHECK(
+        json.find("\"name\":\"dist_index::init\"") != std::string::npos);
+    BOOST_CHECK(
+        json.find("\"name\":\"dist_index::search\"") != std::string::npos);
+    BOOST_CHECK(
+        json.find("\"name\":\"StarMap::reachable\"") != std::string::npos);
+    BOOST_CHECK(
+        json.find("\"name\":\"other \\\"thread\\\"\"") != std::string::npos);
+    BOOST_CHECK(json.find("\"tid\":2") != std::string::npos);
+
+    std::size_t events = 0;
+    for (auto p = json.find("\"ph\":\"X\""); p != std::string::npos;
+        p = json.find("\"ph\":\"X\"", p + 1))
+    {
+        ++events;
+    }
+    BOOST_CHECK_EQUAL(count, events);
+
+    /* A new trace leaves out the last one's events. */
+    Trace::start();
+    std::ostringstream empty;
+    BOOST_CHECK_EQUAL(0, Trace::stop(empty));
+    BOOST_CHECK_EQUAL("{\"traceEvents\":[\n],\"displayTimeUnit\":\"ms\"}\n",
+        empty.str());
+}
+SC_TEST_CASE_END()
+
+SC_TEST_SUITE_END()
@@ -0,0 +1,107 @@
+#include "Tests.h"
+
+#include <algorithm>
+#include <random>
+#include "StellarCartography/UniformGrid.h"
+
+using namespace StellarCartography;
+
+SC_TEST_SUITE(UniformGridTests)
+
+namespace
+{
+
+typedef std::vector<UniformGrid::id_type> result_type;
+
+double distanceSquared(const double *p, const double *q)
+{
+    double d2 = 0.0;
+    for (int d = 0; d < 3; ++d) d2 += (p[d] - q[d]) * (p[d] - q[d]);
+    return d2;
+}
+
+result_type near(const UniformGrid& g, const double *q, double t2)
+{
+    result_type result;
+    g.near(q, t2, [&result](UniformGrid::id_type id, double)
+    {
+        result.push_back(id);
+    });
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+result_type bruteForce(
+    const std::vector<double>& coords, const double *q, double t2)
+{
+    result_type result;
+    for (std::size_t i = 0; i < coords.size() / 3; ++i)
+    {
+        if (distanceSquared(q, &coords[3 * i]) < t2) result.push_back(i);
+    }
+    return result;
+}
+
+}
+
+SC_TEST_CASE(UniformGridTests, TestEmpty)
+{
+    UniformGrid g(nullptr, 0, 1.0);
+    double q[3] = { 0.0, 0.0, 0.0 };
+
+    BOOST_CHECK(g.tight());
+    BOOST_CHECK(near(g, q, 1.0).empty());
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(UniformGridTests, TestBoundary)
+{
+    /* Jumps must be strictly shorter than the radius. */
+    std::vector<double> coords { 0, 0, 0,  1, 0, 0,  2, 0, 0,  0, 0.5, 0 };
+    UniformGrid g(coords.data(), 4, 1.0);
+
+    SC_CHECK_EQUAL_COLLECTIONS(
+        result_type({ 0, 3 }), near(g, coords.data(), 1.0));
+
+    auto q = coords.data() + 9;
+    g.near(q, 1.0, [&](UniformGrid::id_type id, double d2)
+    {
+        BOOST_CHECK_EQUAL(distanceSquared(q, &coords[3 * id]), d2);
+    });
+}
+SC_TEST_CASE_END()
+
+SC_TEST_CASE(UniformGridTests, TestAgainstBruteForce)
+{
+    std::mt19937 rng(5);
+    std::uniform_real_distribution<double> coord(-50.0, 50.0);
+    std::uniform_real_distribution<double> query(-60.0, 60.0);
+    std::vector<double> coords(3 * 2000);
+    for (auto& c : coords) c = coord(rng);
+
+    /* Cells for the smaller radii would outnumber the points too far. */
+    for (double r : { 0.05, 3.0, 10.0, 40.0, 500.0 })
+    {
+        UniformGrid g(coords.data(), coords.size() / 3, r);
+        BOOST_CHECK(g.cellSize() >= r);
+        BOOST_CHECK_EQUAL(r >= 10.0, g.tight());
+        BOOST_CHECK_EQUAL(
+            g.tight(), UniformGrid::tight(coords.data(), coords.size() / 3, r));
+
+        for (int i = 0; i < 200; ++i)
+        {
+            double q[3] = { query(rng), query(rng), query(rng) };
+            if (i % 2) std::copy(&coords[3 * i], &coords[3 * i + 3], q);
+
+            for (double t : { r, r / 2 })
+            {
+                auto expected = bruteForce(coords, q, t * t);
+                auto actual = near(g, q, t * t);
+                SC_CHECK_EQUAL_COLLECTIONS(expected, actual);
+            }
+        }
+    }
+}
+SC_TEST_CASE_END()
+
+SC_TEST_SUITE_END()